@@ -0,0 +1,595 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Tenant aware ACL checks.
+ *
+ * The broker's own acl_file sees topics as the broker stores them, so write
+ * rules have to use the original topic and read rules the prefixed topic,
+ * and every rule has to be repeated for every tenant. The rules in
+ * plugin_opt_acl_file are instead written relative to the tenant, once:
+ *
+ *   # Rules for all tenants
+ *   topic readwrite test/#
+ *   topic read status/%t
+ *
+ *   # Extra rules for tenant foo only
+ *   tenant foo
+ *   topic write admin/#
+ *
+ * The access types are the same as the broker's acl_file: read (which also
+ * allows subscribing), write, readwrite (the default) and deny. A deny rule
+ * that matches always wins. %t matches a topic level equal to the client's
+ * team name. Tenant clients that match no rule are denied, other clients are
+ * left to the rest of the broker's security checks. The global namespace, if
+ * set, is readable by every tenant and writable by none, whatever the rules.
+ *
+ * The rules are compiled into a topic trie for the global rules and one for
+ * each tenant section, so a check costs O(topic depth) rather than O(rules).
+ * Literal levels are looked up in a single hash table of (parent, level)
+ * edges shared by all tries, and the tenant sections in a hash table by
+ * name, so thousands of sections cost no more per check than one.
+ *
+ * The same callback enforces the subscription budget (see subs.c), and is
+ * registered for that alone when there is no plugin_opt_acl_file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define ACL_READ_BITS (MOSQ_ACL_READ | MOSQ_ACL_SUBSCRIBE)
+#define ACL_WRITE_BITS (MOSQ_ACL_WRITE)
+#define ACL_RULESET_TABLE_SIZE 1024
+
+struct acl_node {
+	struct acl_node *plus;   /* '+' child */
+	struct acl_node *team;   /* '%t' child */
+	uint8_t allow;           /* rules that end exactly here */
+	uint8_t deny;
+	uint8_t hash_allow;      /* rules that end with '#' here */
+	uint8_t hash_deny;
+};
+
+struct acl_edge {
+	struct acl_edge *next;
+	const struct acl_node *parent;
+	struct acl_node *child;
+	uint32_t hash;
+	size_t len;
+	char level[];
+};
+
+struct acl_ruleset {
+	struct acl_ruleset *next;
+	char *tenant;
+	size_t tenant_len;
+	uint32_t hash;
+	struct acl_node *root;
+};
+
+struct acl_walk {
+	const struct tenant *tenant;
+	bool is_filter;
+	uint8_t allow;
+	uint8_t deny;
+};
+
+static struct acl_edge **edge_table = NULL;
+static size_t edge_table_size = 0;
+static size_t edge_count = 0;
+
+/* All allocated nodes, so they can be freed without walking the tries */
+static struct acl_node **nodes = NULL;
+static size_t node_count = 0;
+static size_t node_alloc = 0;
+
+static struct acl_node *global_root = NULL;
+static struct acl_ruleset *ruleset_table[ACL_RULESET_TABLE_SIZE];
+static bool acl_rules = false;      /* plugin_opt_acl_file was given */
+static bool acl_registered = false;
+
+static uint32_t edge_hash(const struct acl_node *parent, const char *level, size_t len)
+{
+	uint32_t h = mt_hash(level, len);
+	uint64_t p = (uint64_t)(uintptr_t)parent;
+
+	h ^= (uint32_t)(p ^ (p >> 32));
+	h *= 0x9E3779B1U;
+	return h;
+}
+
+static struct acl_node *edge_find(const struct acl_node *parent, const char *level, size_t len)
+{
+	struct acl_edge *e;
+	uint32_t hash;
+
+	if(edge_count == 0){
+		return NULL;
+	}
+	hash = edge_hash(parent, level, len);
+	for(e=edge_table[hash & (edge_table_size-1)]; e; e=e->next){
+		if(e->hash == hash && e->parent == parent && e->len == len && !memcmp(e->level, level, len)){
+			return e->child;
+		}
+	}
+	return NULL;
+}
+
+static int edge_table_grow(void)
+{
+	struct acl_edge **new_table, *e, *next;
+	size_t new_size = edge_table_size ? edge_table_size*2 : 256;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct acl_edge *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<edge_table_size; i++){
+		for(e=edge_table[i]; e; e=next){
+			next = e->next;
+			e->next = new_table[e->hash & (new_size-1)];
+			new_table[e->hash & (new_size-1)] = e;
+		}
+	}
+	mosquitto_free(edge_table);
+	edge_table = new_table;
+	edge_table_size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct acl_node *node_new(void)
+{
+	struct acl_node *n, **new_nodes;
+	size_t new_alloc;
+
+	if(node_count == node_alloc){
+		new_alloc = node_alloc ? node_alloc*2 : 64;
+		new_nodes = mosquitto_realloc(nodes, new_alloc*sizeof(struct acl_node *));
+		if(new_nodes == NULL){
+			return NULL;
+		}
+		nodes = new_nodes;
+		node_alloc = new_alloc;
+	}
+	n = mosquitto_calloc(1, sizeof(struct acl_node));
+	if(n){
+		nodes[node_count++] = n;
+	}
+	return n;
+}
+
+static struct acl_node *edge_add(struct acl_node *parent, const char *level, size_t len)
+{
+	struct acl_node *child;
+	struct acl_edge *e;
+
+	child = edge_find(parent, level, len);
+	if(child){
+		return child;
+	}
+
+	if(edge_count >= edge_table_size - edge_table_size/4){
+		if(edge_table_grow()){
+			return NULL;
+		}
+	}
+	e = mosquitto_malloc(sizeof(struct acl_edge) + len + 1);
+	child = node_new();
+	if(e == NULL || child == NULL){
+		mosquitto_free(e);
+		return NULL;
+	}
+	e->parent = parent;
+	e->child = child;
+	e->len = len;
+	memcpy(e->level, level, len);
+	e->level[len] = 0;
+	e->hash = edge_hash(parent, level, len);
+	e->next = edge_table[e->hash & (edge_table_size-1)];
+	edge_table[e->hash & (edge_table_size-1)] = e;
+	edge_count++;
+
+	return child;
+}
+
+/* Add a rule to a trie. */
+static int acl_rule_add(struct acl_node *root, const char *topic, uint8_t access, bool deny)
+{
+	struct acl_node *node = root;
+	const char *level = topic, *end;
+	size_t len;
+
+	while(1){
+		end = strchr(level, '/');
+		len = end ? (size_t)(end - level) : strlen(level);
+
+		if(len == 1 && level[0] == '#'){
+			if(end){
+				return MOSQ_ERR_INVAL;
+			}
+			if(deny){
+				node->hash_deny |= access;
+			}else{
+				node->hash_allow |= access;
+			}
+			return MOSQ_ERR_SUCCESS;
+		}else if(len == 1 && level[0] == '+'){
+			if(node->plus == NULL){
+				node->plus = node_new();
+			}
+			node = node->plus;
+		}else if(len == 2 && !memcmp(level, "%t", 2)){
+			if(node->team == NULL){
+				node->team = node_new();
+			}
+			node = node->team;
+		}else{
+			if(memchr(level, '+', len) || memchr(level, '#', len)){
+				return MOSQ_ERR_INVAL;
+			}
+			node = edge_add(node, level, len);
+		}
+		if(node == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		if(end == NULL){
+			break;
+		}
+		level = end + 1;
+	}
+
+	if(deny){
+		node->deny |= access;
+	}else{
+		node->allow |= access;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Collect the allow and deny bits of every rule that matches the topic (or
+ * for a subscription, every rule that covers the filter). */
+static void acl_walk(const struct acl_node *node, const char *level, bool at_root, struct acl_walk *w)
+{
+	const struct acl_node *child;
+	const char *end;
+	size_t len;
+	bool dollar = at_root && level && level[0] == '$';
+
+	/* Topics starting with $ are not matched by leading wildcards */
+	if(!dollar){
+		w->allow |= node->hash_allow;
+		w->deny |= node->hash_deny;
+	}
+	if(level == NULL){
+		w->allow |= node->allow;
+		w->deny |= node->deny;
+		return;
+	}
+
+	end = strchr(level, '/');
+	len = end ? (size_t)(end - level) : strlen(level);
+	if(w->is_filter && len == 1 && level[0] == '#'){
+		/* Only a '#' rule at this node covers a '#' filter */
+		return;
+	}
+	if(!(w->is_filter && len == 1 && level[0] == '+')){
+		child = edge_find(node, level, len);
+		if(child){
+			acl_walk(child, end ? end + 1 : NULL, false, w);
+		}
+		if(node->team && len == w->tenant->name_len && !memcmp(level, w->tenant->name, len)){
+			acl_walk(node->team, end ? end + 1 : NULL, false, w);
+		}
+	}
+	if(node->plus && !dollar){
+		acl_walk(node->plus, end ? end + 1 : NULL, false, w);
+	}
+}
+
+static const struct acl_ruleset *ruleset_find(const struct tenant *tenant)
+{
+	const struct acl_ruleset *rs;
+
+	for(rs=ruleset_table[tenant->hash % ACL_RULESET_TABLE_SIZE]; rs; rs=rs->next){
+		if(rs->hash == tenant->hash && rs->tenant_len == tenant->name_len
+				&& !memcmp(rs->tenant, tenant->name, rs->tenant_len)){
+			return rs;
+		}
+	}
+	return NULL;
+}
+
+static int acl_check_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_acl_check *ed = event_data;
+	const struct team_client *tc;
+	const struct acl_ruleset *rs;
+	struct acl_walk w;
+	const char *topic;
+	uint8_t access;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	tc = client_find(ed->client);
+	if(!tc){
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+
+	if(ed->access == MOSQ_ACL_SUBSCRIBE && !subs_allowed(tc, ed->topic)){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+	if(!acl_rules){
+		/* Only here for the subscription budget */
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+
+	topic = ed->topic;
+	memset(&w, 0, sizeof(w));
+	w.tenant = tc->tenant;
+
+	switch(ed->access){
+		case MOSQ_ACL_UNSUBSCRIBE:
+			return MOSQ_ERR_SUCCESS;
+
+		case MOSQ_ACL_READ:
+			/* Messages being delivered have the tenant prefix */
+			if(!strncmp(topic, tc->tenant->prefix, tc->tenant->prefix_len)){
+				topic += tc->tenant->prefix_len;
+			}
+			break;
+
+		case MOSQ_ACL_SUBSCRIBE:
+			w.is_filter = true;
+			if(!strncmp(topic, "$share/", 7)){
+				topic = strchr(topic + 7, '/');
+				if(topic == NULL){
+					return MOSQ_ERR_ACL_DENIED;
+				}
+				topic++;
+			}
+			break;
+
+		default:
+			break;
+	}
+	if(global_topic(topic)){
+		/* Every tenant can read the global namespace, none can write to it */
+		return ed->access == MOSQ_ACL_WRITE ? MOSQ_ERR_ACL_DENIED : MOSQ_ERR_SUCCESS;
+	}
+	access = (uint8_t)ed->access;
+
+	acl_walk(global_root, topic, true, &w);
+	rs = ruleset_find(tc->tenant);
+	if(rs){
+		acl_walk(rs->root, topic, true, &w);
+	}
+
+	if((w.deny & access) || !(w.allow & access)){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct acl_ruleset *ruleset_add(const char *tenant)
+{
+	struct acl_ruleset *rs;
+	size_t len = strlen(tenant);
+	uint32_t hash = mt_hash(tenant, len);
+	size_t slot = hash % ACL_RULESET_TABLE_SIZE;
+
+	for(rs=ruleset_table[slot]; rs; rs=rs->next){
+		if(rs->hash == hash && rs->tenant_len == len && !memcmp(rs->tenant, tenant, len)){
+			return rs;
+		}
+	}
+
+	rs = mosquitto_calloc(1, sizeof(struct acl_ruleset));
+	if(rs == NULL){
+		return NULL;
+	}
+	rs->tenant = mosquitto_strdup(tenant);
+	rs->root = node_new();
+	if(rs->tenant == NULL || rs->root == NULL){
+		mosquitto_free(rs->tenant);
+		mosquitto_free(rs);
+		return NULL;
+	}
+	rs->tenant_len = len;
+	rs->hash = hash;
+	rs->next = ruleset_table[slot];
+	ruleset_table[slot] = rs;
+	return rs;
+}
+
+static int acl_load_file(const char *path)
+{
+	FILE *fptr;
+	char buf[1024];
+	char *line, *key, *access, *topic, *saveptr = NULL;
+	struct acl_node *root = global_root;
+	struct acl_ruleset *rs;
+	uint8_t bits;
+	bool deny;
+	int lineno = 0;
+	int rc;
+
+	fptr = fopen(path, "rt");
+	if(fptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open acl_file '%s'.", path);
+		return MOSQ_ERR_INVAL;
+	}
+
+	while(fgets(buf, sizeof(buf), fptr)){
+		lineno++;
+		line = buf;
+		while(*line == ' ' || *line == '\t') line++;
+		if(line[0] == '#' || line[0] == '\r' || line[0] == '\n' || line[0] == 0){
+			continue;
+		}
+
+		key = strtok_r(line, " \t\r\n", &saveptr);
+		access = strtok_r(NULL, " \t\r\n", &saveptr);
+		topic = strtok_r(NULL, "\r\n", &saveptr);
+		if(access == NULL){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Missing value for '%s'.", path, lineno, key);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+
+		if(!strcasecmp(key, "tenant")){
+			rs = ruleset_add(access);
+			if(rs == NULL){
+				fclose(fptr);
+				return MOSQ_ERR_NOMEM;
+			}
+			root = rs->root;
+			continue;
+		}else if(strcasecmp(key, "topic")){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Unknown option '%s'.", path, lineno, key);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+
+		if(topic){
+			while(*topic == ' ' || *topic == '\t') topic++;
+		}
+		deny = false;
+		if(topic == NULL || topic[0] == 0){
+			/* "topic <topic>" is readwrite */
+			topic = access;
+			bits = ACL_READ_BITS | ACL_WRITE_BITS;
+		}else if(!strcasecmp(access, "read")){
+			bits = ACL_READ_BITS;
+		}else if(!strcasecmp(access, "write")){
+			bits = ACL_WRITE_BITS;
+		}else if(!strcasecmp(access, "readwrite")){
+			bits = ACL_READ_BITS | ACL_WRITE_BITS;
+		}else if(!strcasecmp(access, "deny")){
+			bits = ACL_READ_BITS | ACL_WRITE_BITS;
+			deny = true;
+		}else{
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Invalid access type '%s'.", path, lineno, access);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+
+		rc = acl_rule_add(root, topic, bits, deny);
+		if(rc){
+			if(rc == MOSQ_ERR_INVAL){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Invalid topic '%s'.", path, lineno, topic);
+			}
+			fclose(fptr);
+			return rc;
+		}
+	}
+	fclose(fptr);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int acl_init(struct mosquitto_opt *opts, int opt_count)
+{
+	const char *acl_file = NULL;
+	int i, rc;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "acl_file")){
+			acl_file = opts[i].value;
+		}
+	}
+	if(acl_file){
+		global_root = node_new();
+		if(global_root == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		rc = acl_load_file(acl_file);
+		if(rc){
+			return rc;
+		}
+		acl_rules = true;
+	}
+
+	/* The subscription budget is checked here too, as a refused ACL check is
+	 * the only way to reject a single filter in the SUBACK. */
+	if(!acl_rules && !limits_subscriptions_limited()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_ACL_CHECK, acl_check_callback, NULL, NULL);
+	if(rc == MOSQ_ERR_SUCCESS){
+		acl_registered = true;
+	}
+	return rc;
+}
+
+int acl_limits_changed(void)
+{
+	int rc;
+
+	if(acl_registered || !limits_subscriptions_limited()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_ACL_CHECK, acl_check_callback, NULL, NULL);
+	if(rc == MOSQ_ERR_SUCCESS){
+		acl_registered = true;
+	}
+	return rc;
+}
+
+void acl_cleanup(void)
+{
+	struct acl_ruleset *rs, *rs_next;
+	struct acl_edge *e, *e_next;
+	size_t i;
+
+	if(acl_registered){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_ACL_CHECK, acl_check_callback, NULL);
+		acl_registered = false;
+	}
+	acl_rules = false;
+
+	for(i=0; i<ACL_RULESET_TABLE_SIZE; i++){
+		for(rs=ruleset_table[i]; rs; rs=rs_next){
+			rs_next = rs->next;
+			mosquitto_free(rs->tenant);
+			mosquitto_free(rs);
+		}
+		ruleset_table[i] = NULL;
+	}
+
+	for(i=0; i<edge_table_size; i++){
+		for(e=edge_table[i]; e; e=e_next){
+			e_next = e->next;
+			mosquitto_free(e);
+		}
+	}
+	mosquitto_free(edge_table);
+	edge_table = NULL;
+	edge_table_size = 0;
+	edge_count = 0;
+
+	for(i=0; i<node_count; i++){
+		mosquitto_free(nodes[i]);
+	}
+	mosquitto_free(nodes);
+	nodes = NULL;
+	node_count = 0;
+	node_alloc = 0;
+	global_root = NULL;
+}
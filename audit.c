@@ -0,0 +1,535 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Asynchronous per-tenant audit log.
+ *
+ * The callbacks only copy a fixed size record into a single producer, single
+ * consumer ring buffer, which needs no locks: the broker thread is the only
+ * writer of the head index and the audit thread the only writer of the tail.
+ * The audit thread formats the records in batches and appends them either
+ * to <plugin_opt_audit_dir>/<team>.log, or to the unix socket
+ * plugin_opt_audit_socket with the team as the second field of each line.
+ * A team name too long for the record is cut short and ends with '~' and a
+ * 64 bit hash of the whole name, so two teams never share a log. In file
+ * names, bytes other than letters, digits, '-' and '_' are percent-encoded.
+ *
+ * Connects, disconnects and subscribes are always recorded, publishes only
+ * one in every plugin_opt_audit_publish_sample (0, the default, records
+ * none). If the ring is full the record is dropped and counted in the
+ * tenant's stats, the broker is never made to wait for the log.
+ *
+ * Records for the socket stay in the ring until they have been sent. If the
+ * connection is lost, or can't be made, it is tried again once a second and
+ * sending picks up from the first line that didn't get through in full, so
+ * a reader that goes away loses records only once the ring fills up, and
+ * those are counted like any other. Connects and sends time out after
+ * AUDIT_SEND_TIMEOUT_MS, so a reader that stops reading can't hold up
+ * shutdown.
+ *
+ * The audit thread must not use mosquitto_malloc() and friends, as the
+ * broker's memory accounting is not thread safe.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define AUDIT_DEFAULT_RING 8192
+#define AUDIT_MAX_OPEN 128
+#define AUDIT_IDLE_NS 20000000L /* 20ms */
+#define AUDIT_RETRY_MS 1000
+#define AUDIT_SEND_TIMEOUT_MS 1000
+#define AUDIT_LINE_MAX 512
+#define AUDIT_BATCH_BYTES 65536
+#define AUDIT_BATCH_RECORDS 1024
+
+enum audit_type {
+	AUDIT_CONNECT,
+	AUDIT_DISCONNECT,
+	AUDIT_SUBSCRIBE,
+	AUDIT_UNSUBSCRIBE,
+	AUDIT_PUBLISH,
+};
+
+static const char *audit_type_names[] = {
+	"connect",
+	"disconnect",
+	"subscribe",
+	"unsubscribe",
+	"publish",
+};
+
+/* The team name, including the "~<hash>" of a shortened one */
+#define AUDIT_TENANT_LEN 48
+#define AUDIT_TENANT_HASH_LEN 16
+
+/* Strings other than the team are truncated to fit, the record is 256
+ * bytes. */
+struct audit_record {
+	uint64_t time_ns;
+	uint32_t payloadlen;
+	uint8_t type;
+	uint8_t qos;
+	bool retain;
+	char tenant[AUDIT_TENANT_LEN+1];
+	char client_id[64];
+	char detail[128];
+};
+
+struct audit_file {
+	struct audit_file *next;
+	FILE *fptr;
+	char tenant[AUDIT_TENANT_LEN+1];
+};
+
+static struct audit_record *ring = NULL;
+static size_t ring_mask = 0;
+static size_t ring_head = 0; /* written by the broker thread only */
+static size_t ring_tail = 0; /* written by the audit thread only */
+
+static char *audit_dir = NULL;
+static char *audit_socket = NULL;
+static uint32_t publish_sample = 0;
+static uint32_t publish_count = 0;
+
+static pthread_t audit_thread;
+static bool audit_running = false;
+static int audit_stop = 0;
+
+/* Audit thread state */
+static struct audit_file *open_files = NULL;
+static int open_file_count = 0;
+static int sock = -1;
+
+
+static void audit_copy(char *dst, size_t size, const char *src)
+{
+	size_t len = src ? strlen(src) : 0;
+
+	if(len >= size){
+		len = size - 1;
+	}
+	if(len){
+		memcpy(dst, src, len);
+	}
+	dst[len] = 0;
+}
+
+/* Names that fill the whole field are always shortened ones, so a name that
+ * fits can't be taken for the shortened form of another. */
+static void audit_copy_tenant(char *dst, const struct tenant *t)
+{
+	size_t keep = AUDIT_TENANT_LEN - 1 - AUDIT_TENANT_HASH_LEN;
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	size_t i;
+
+	if(t->name_len < AUDIT_TENANT_LEN){
+		memcpy(dst, t->name, t->name_len + 1);
+		return;
+	}
+	for(i=0; i<t->name_len; i++){
+		hash = (hash ^ (unsigned char)t->name[i]) * 1099511628211ULL;
+	}
+	memcpy(dst, t->name, keep);
+	snprintf(dst + keep, AUDIT_TENANT_HASH_LEN + 2, "~%016llx", (unsigned long long)hash);
+}
+
+static void audit_push(const struct team_client *tc, enum audit_type type, const char *detail, uint32_t payloadlen, uint8_t qos, bool retain)
+{
+	struct audit_record *r;
+	struct timespec ts;
+	size_t tail;
+
+	tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+	if(ring_head - tail > ring_mask){
+		tc->tenant->stats.audit_dropped++;
+		return;
+	}
+
+	r = &ring[ring_head & ring_mask];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time_ns = (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+	r->type = (uint8_t)type;
+	r->payloadlen = payloadlen;
+	r->qos = qos;
+	r->retain = retain;
+	audit_copy_tenant(r->tenant, tc->tenant);
+	audit_copy(r->client_id, sizeof(r->client_id), mosquitto_client_id(tc->client));
+	audit_copy(r->detail, sizeof(r->detail), detail);
+
+	__atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+}
+
+void audit_connect(const struct team_client *tc)
+{
+	if(ring){
+		audit_push(tc, AUDIT_CONNECT, mosquitto_client_username(tc->client), 0, 0, false);
+	}
+}
+
+void audit_disconnect(const struct team_client *tc)
+{
+	if(ring){
+		audit_push(tc, AUDIT_DISCONNECT, NULL, 0, 0, false);
+	}
+}
+
+void audit_subscribe(const struct team_client *tc, const char *filter, bool unsubscribe)
+{
+	if(ring){
+		audit_push(tc, unsubscribe ? AUDIT_UNSUBSCRIBE : AUDIT_SUBSCRIBE, filter, 0, 0, false);
+	}
+}
+
+void audit_publish(const struct team_client *tc, const struct mosquitto_evt_message *ed)
+{
+	if(ring && publish_sample){
+		if(++publish_count < publish_sample){
+			return;
+		}
+		publish_count = 0;
+		audit_push(tc, AUDIT_PUBLISH, ed->topic, ed->payloadlen, ed->qos, ed->retain);
+	}
+}
+
+/* ================================================================
+ * Audit thread
+ * ================================================================ */
+
+static int audit_format(const struct audit_record *r, bool with_tenant, char *buf, size_t len)
+{
+	struct tm tm;
+	time_t secs = (time_t)(r->time_ns / 1000000000ULL);
+	char timestr[32];
+	int n;
+
+	gmtime_r(&secs, &tm);
+	strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	n = snprintf(buf, len, "%s.%03uZ %s%s%s %s",
+			timestr, (unsigned int)((r->time_ns / 1000000ULL) % 1000),
+			with_tenant ? r->tenant : "", with_tenant ? " " : "",
+			audit_type_names[r->type], r->client_id);
+	if(n < 0 || (size_t)n >= len){
+		return (int)len - 1;
+	}
+	if(r->type == AUDIT_PUBLISH){
+		n += snprintf(buf + n, len - (size_t)n, " %s qos=%u retain=%d len=%u\n",
+				r->detail, r->qos, r->retain, r->payloadlen);
+	}else if(r->detail[0]){
+		n += snprintf(buf + n, len - (size_t)n, " %s\n", r->detail);
+	}else{
+		n += snprintf(buf + n, len - (size_t)n, "\n");
+	}
+	return n;
+}
+
+static void audit_close_files(void)
+{
+	struct audit_file *f, *next;
+
+	for(f=open_files; f; f=next){
+		next = f->next;
+		fclose(f->fptr);
+		free(f);
+	}
+	open_files = NULL;
+	open_file_count = 0;
+}
+
+static FILE *audit_file_get(const char *tenant)
+{
+	struct audit_file *f;
+	static const char hex[] = "0123456789abcdef";
+	char path[4096];
+	char name[AUDIT_TENANT_LEN*3+1];
+	size_t i, n = 0;
+
+	for(f=open_files; f; f=f->next){
+		if(!strcmp(f->tenant, tenant)){
+			return f->fptr;
+		}
+	}
+	if(open_file_count >= AUDIT_MAX_OPEN){
+		audit_close_files();
+	}
+
+	/* Team names come from usernames, so keep them to a safe file name */
+	for(i=0; tenant[i]; i++){
+		unsigned char c = (unsigned char)tenant[i];
+		if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'){
+			name[n++] = (char)c;
+		}else{
+			name[n++] = '%';
+			name[n++] = hex[c >> 4];
+			name[n++] = hex[c & 0x0F];
+		}
+	}
+	name[n] = 0;
+
+	f = malloc(sizeof(struct audit_file));
+	if(f == NULL){
+		return NULL;
+	}
+	snprintf(path, sizeof(path), "%s/%s.log", audit_dir, name);
+	f->fptr = fopen(path, "a");
+	if(f->fptr == NULL){
+		free(f);
+		return NULL;
+	}
+	audit_copy(f->tenant, sizeof(f->tenant), tenant);
+	f->next = open_files;
+	open_files = f;
+	open_file_count++;
+	return f->fptr;
+}
+
+static bool audit_socket_open(void)
+{
+	struct timeval tv = {AUDIT_SEND_TIMEOUT_MS / 1000, (AUDIT_SEND_TIMEOUT_MS % 1000) * 1000};
+	struct sockaddr_un addr;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0){
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	audit_copy(addr.sun_path, sizeof(addr.sun_path), audit_socket);
+	if(setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0
+			|| connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+
+		close(sock);
+		sock = -1;
+		return false;
+	}
+	return true;
+}
+
+/* Returns how much of buf was sent, all of it unless the connection is lost
+ * or the thread is stopping. */
+static size_t audit_socket_write(const char *buf, size_t len)
+{
+	size_t sent = 0;
+	ssize_t n;
+
+	if(sock < 0 && !audit_socket_open()){
+		return 0;
+	}
+	while(sent < len){
+		n = send(sock, buf + sent, len - sent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			/* Timed out, the reader is slow but still there */
+			if(__atomic_load_n(&audit_stop, __ATOMIC_ACQUIRE)){
+				return sent;
+			}
+			continue;
+		}
+		if(n <= 0){
+			close(sock);
+			sock = -1;
+			return sent;
+		}
+		sent += (size_t)n;
+	}
+	return sent;
+}
+
+/* Send the ring to the socket in batches. The slots are only given back
+ * once their lines have been sent, and *failed is set if any weren't. */
+static size_t audit_drain_socket(bool *failed)
+{
+	char batch[AUDIT_BATCH_BYTES];
+	size_t ends[AUDIT_BATCH_RECORDS];
+	size_t head, tail, pos, count, done, total = 0, batch_len, sent;
+	int n;
+
+	*failed = false;
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	tail = ring_tail;
+	while(tail != head){
+		batch_len = 0;
+		count = 0;
+		for(pos=tail; pos != head && count < AUDIT_BATCH_RECORDS
+				&& batch_len + AUDIT_LINE_MAX <= sizeof(batch); pos++){
+
+			n = audit_format(&ring[pos & ring_mask], true, batch + batch_len, AUDIT_LINE_MAX);
+			batch_len += (size_t)n < AUDIT_LINE_MAX ? (size_t)n : AUDIT_LINE_MAX - 1;
+			ends[count++] = batch_len;
+		}
+		sent = audit_socket_write(batch, batch_len);
+		for(done=0; done<count && ends[done] <= sent; done++){
+		}
+		tail += done;
+		total += done;
+		__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+		if(done < count){
+			/* A line cut off by a lost connection is sent again in full */
+			*failed = true;
+			break;
+		}
+	}
+	return total;
+}
+
+/* Write out everything in the ring, returns the number of records. */
+static size_t audit_drain(bool *failed)
+{
+	const struct audit_record *r;
+	struct audit_file *f;
+	char line[AUDIT_LINE_MAX];
+	size_t head, tail, count;
+	FILE *fptr;
+	int n;
+
+	if(audit_socket){
+		return audit_drain_socket(failed);
+	}
+	*failed = false;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	tail = ring_tail;
+	count = head - tail;
+
+	for(; tail != head; tail++){
+		r = &ring[tail & ring_mask];
+		fptr = audit_file_get(r->tenant);
+		if(fptr){
+			n = audit_format(r, false, line, sizeof(line));
+			fwrite(line, 1, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1, fptr);
+		}
+		/* Give the slot back as soon as it has been read */
+		__atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	for(f=open_files; f; f=f->next){
+		fflush(f->fptr);
+	}
+	return count;
+}
+
+static void *audit_thread_main(void *arg)
+{
+	struct timespec idle = {0, AUDIT_IDLE_NS};
+	bool failed;
+	int waited;
+
+	UNUSED(arg);
+
+	while(!__atomic_load_n(&audit_stop, __ATOMIC_ACQUIRE)){
+		if(audit_drain(&failed) == 0 && !failed){
+			nanosleep(&idle, NULL);
+		}
+		if(failed){
+			/* Socket is down, leave the records in the ring for a while */
+			for(waited=0; waited<AUDIT_RETRY_MS && !__atomic_load_n(&audit_stop, __ATOMIC_ACQUIRE);
+					waited+=(int)(AUDIT_IDLE_NS/1000000L)){
+				nanosleep(&idle, NULL);
+			}
+		}
+	}
+	audit_drain(&failed);
+	audit_close_files();
+	if(sock >= 0){
+		close(sock);
+		sock = -1;
+	}
+	return NULL;
+}
+
+int audit_init(struct mosquitto_opt *opts, int opt_count)
+{
+	size_t ring_size = AUDIT_DEFAULT_RING, size;
+	const char *dir = NULL, *sockpath = NULL;
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "audit_dir")){
+			dir = opts[i].value;
+		}else if(!strcasecmp(opts[i].key, "audit_socket")){
+			sockpath = opts[i].value;
+		}else if(!strcasecmp(opts[i].key, "audit_publish_sample")){
+			publish_sample = (uint32_t)strtoul(opts[i].value, NULL, 10);
+		}else if(!strcasecmp(opts[i].key, "audit_ring_size")){
+			ring_size = strtoul(opts[i].value, NULL, 10);
+			if(ring_size < 2){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid audit_ring_size '%s'.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+	if(dir == NULL && sockpath == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(dir && sockpath){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Only one of audit_dir and audit_socket can be set.");
+		return MOSQ_ERR_INVAL;
+	}
+
+	audit_dir = dir ? mosquitto_strdup(dir) : NULL;
+	audit_socket = sockpath ? mosquitto_strdup(sockpath) : NULL;
+	if(audit_dir == NULL && audit_socket == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Round up to a power of two */
+	for(size=2; size<ring_size; size*=2){
+	}
+	ring = mosquitto_calloc(size, sizeof(struct audit_record));
+	if(ring == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	ring_mask = size - 1;
+	ring_head = 0;
+	ring_tail = 0;
+	audit_stop = 0;
+
+	if(pthread_create(&audit_thread, NULL, audit_thread_main, NULL)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to start audit thread.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	audit_running = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void audit_cleanup(void)
+{
+	if(audit_running){
+		__atomic_store_n(&audit_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(audit_thread, NULL);
+		audit_running = false;
+	}
+	mosquitto_free(ring);
+	ring = NULL;
+	mosquitto_free(audit_dir);
+	audit_dir = NULL;
+	mosquitto_free(audit_socket);
+	audit_socket = NULL;
+	publish_sample = 0;
+	publish_count = 0;
+}
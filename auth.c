@@ -0,0 +1,557 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Username and password checks.
+ *
+ * Credentials are read from files in the broker's password_file format,
+ * "username:hash", with $6$ (salted SHA512) and $7$ (PBKDF2-SHA512) hashes
+ * as written by mosquitto_passwd. plugin_opt_password_file is a single file
+ * for all users, plugin_opt_password_dir a directory of <team>.passwd files,
+ * where each file can only authenticate users that resolve to its team.
+ *
+ * Checking a $7$ hash is deliberately slow, which hurts when a whole fleet
+ * reconnects at once. A successful check is therefore cached for
+ * plugin_opt_auth_cache_ttl seconds: the cache holds a keyed SHA256 of the
+ * password, never the password itself, and the next connect with the same
+ * password only has to compare that. The cache is a fixed array of
+ * plugin_opt_auth_cache_size slots indexed by a hash of the username, so a
+ * busy slot just replaces its previous user.
+ *
+ * The files are read again, and the cache emptied, when the broker reloads
+ * its config. Users that are in no file are left to the other
+ * authentication methods.
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define CRED_TABLE_MIN_SIZE 1024
+#define CRED_HASH_LEN 64 /* SHA512 */
+#define CRED_SALT_MAX 64
+#define AUTH_DEFAULT_CACHE_SIZE 4096
+#define AUTH_DEFAULT_CACHE_TTL 300
+
+enum cred_type {
+	CRED_SHA512,
+	CRED_PBKDF2_SHA512,
+};
+
+struct cred_entry {
+	struct cred_entry *next;
+	const char *tenant;  /* points into username[], NULL for the shared file */
+	size_t username_len;
+	size_t tenant_len;
+	uint32_t hash;
+	enum cred_type type;
+	int iterations;
+	unsigned int salt_len;
+	unsigned char salt[CRED_SALT_MAX];
+	unsigned char pw_hash[CRED_HASH_LEN];
+	char username[];
+};
+
+struct cred_store {
+	struct cred_entry **table;
+	size_t size; /* always a power of two */
+	size_t count;
+};
+
+struct auth_cache_slot {
+	const struct cred_entry *entry;
+	uint64_t expires_ns;
+	unsigned char digest[32];
+};
+
+static struct cred_store *current_store = NULL;
+static char *password_file = NULL;
+static char *password_dir = NULL;
+
+static struct auth_cache_slot *cache = NULL;
+static size_t cache_size = 0; /* always a power of two */
+static uint64_t cache_ttl_ns = 0;
+static unsigned char cache_key[32];
+
+static void store_free(struct cred_store *store)
+{
+	struct cred_entry *e, *next;
+	size_t i;
+
+	if(store == NULL){
+		return;
+	}
+	for(i=0; i<store->size; i++){
+		for(e=store->table[i]; e; e=next){
+			next = e->next;
+			mosquitto_free(e);
+		}
+	}
+	mosquitto_free(store->table);
+	mosquitto_free(store);
+}
+
+static const struct cred_entry *store_find(const struct cred_store *store, const char *username, size_t username_len,
+		const char *tenant, size_t tenant_len)
+{
+	const struct cred_entry *e;
+	uint32_t hash = mt_hash(username, username_len);
+
+	for(e=store->table[hash & (store->size-1)]; e; e=e->next){
+		if(e->hash == hash && e->username_len == username_len && !memcmp(e->username, username, username_len)
+				&& (e->tenant == NULL) == (tenant == NULL)
+				&& (tenant == NULL || (e->tenant_len == tenant_len && !memcmp(e->tenant, tenant, tenant_len)))){
+
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static int store_grow(struct cred_store *store)
+{
+	struct cred_entry **new_table, *e, *next;
+	size_t new_size = store->size*2;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct cred_entry *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<store->size; i++){
+		for(e=store->table[i]; e; e=next){
+			next = e->next;
+			e->next = new_table[e->hash & (new_size-1)];
+			new_table[e->hash & (new_size-1)] = e;
+		}
+	}
+	mosquitto_free(store->table);
+	store->table = new_table;
+	store->size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int base64_decode(const char *in, size_t in_len, unsigned char *out, size_t out_size, unsigned int *out_len)
+{
+	unsigned char buf[128];
+	int len;
+
+	if(in_len == 0 || in_len % 4 || in_len/4*3 > sizeof(buf)){
+		return MOSQ_ERR_INVAL;
+	}
+	len = EVP_DecodeBlock(buf, (const unsigned char *)in, (int)in_len);
+	if(len < 0){
+		return MOSQ_ERR_INVAL;
+	}
+	/* EVP_DecodeBlock() counts the padding as data */
+	if(in[in_len-1] == '='){
+		len--;
+	}
+	if(in[in_len-2] == '='){
+		len--;
+	}
+	if((size_t)len > out_size){
+		return MOSQ_ERR_INVAL;
+	}
+	memcpy(out, buf, (size_t)len);
+	*out_len = (unsigned int)len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Parse "$6$salt$hash" or "$7$iterations$salt$hash" into e. */
+static int cred_parse(struct cred_entry *e, const char *hash)
+{
+	const char *salt, *pw;
+	unsigned int len;
+	char *endptr;
+	long iterations;
+
+	if(!strncmp(hash, "$6$", 3)){
+		e->type = CRED_SHA512;
+		e->iterations = 0;
+		salt = hash + 3;
+	}else if(!strncmp(hash, "$7$", 3)){
+		e->type = CRED_PBKDF2_SHA512;
+		iterations = strtol(hash + 3, &endptr, 10);
+		if(endptr == hash + 3 || *endptr != '$' || iterations < 1 || iterations > 100000000){
+			return MOSQ_ERR_INVAL;
+		}
+		e->iterations = (int)iterations;
+		salt = endptr + 1;
+	}else{
+		return MOSQ_ERR_INVAL;
+	}
+
+	pw = strchr(salt, '$');
+	if(pw == NULL){
+		return MOSQ_ERR_INVAL;
+	}
+	if(base64_decode(salt, (size_t)(pw - salt), e->salt, sizeof(e->salt), &e->salt_len)){
+		return MOSQ_ERR_INVAL;
+	}
+	pw++;
+	if(base64_decode(pw, strlen(pw), e->pw_hash, sizeof(e->pw_hash), &len) || len != CRED_HASH_LEN){
+		return MOSQ_ERR_INVAL;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int store_add(struct cred_store *store, const char *username, const char *tenant, const char *hash)
+{
+	struct cred_entry *e;
+	size_t username_len = strlen(username);
+	size_t tenant_len = tenant ? strlen(tenant) : 0;
+
+	if(store_find(store, username, username_len, tenant, tenant_len)){
+		return MOSQ_ERR_ALREADY_EXISTS;
+	}
+	if(store->count >= store->size - store->size/4){
+		if(store_grow(store)){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+
+	e = mosquitto_malloc(sizeof(struct cred_entry) + username_len + 1 + tenant_len + 1);
+	if(e == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	if(cred_parse(e, hash)){
+		mosquitto_free(e);
+		return MOSQ_ERR_INVAL;
+	}
+	memcpy(e->username, username, username_len + 1);
+	e->username_len = username_len;
+	if(tenant){
+		e->tenant = e->username + username_len + 1;
+		memcpy(e->username + username_len + 1, tenant, tenant_len + 1);
+	}else{
+		e->tenant = NULL;
+	}
+	e->tenant_len = tenant_len;
+	e->hash = mt_hash(username, username_len);
+
+	e->next = store->table[e->hash & (store->size-1)];
+	store->table[e->hash & (store->size-1)] = e;
+	store->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static char *strip(char *s)
+{
+	char *end;
+
+	while(*s == ' ' || *s == '\t'){
+		s++;
+	}
+	end = s + strlen(s);
+	while(end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')){
+		end--;
+	}
+	*end = 0;
+	return s;
+}
+
+static int store_load_file(struct cred_store *store, const char *path, const char *tenant)
+{
+	FILE *fptr;
+	char buf[1024];
+	char *line, *hash;
+	int lineno = 0;
+	int rc;
+
+	fptr = fopen(path, "rt");
+	if(fptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open password file '%s'.", path);
+		return MOSQ_ERR_INVAL;
+	}
+
+	while(fgets(buf, sizeof(buf), fptr)){
+		lineno++;
+		line = strip(buf);
+		if(line[0] == 0 || line[0] == '#'){
+			continue;
+		}
+
+		hash = strchr(line, ':');
+		if(hash == NULL || hash == line){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Expected username:hash.", path, lineno);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+		*hash = 0;
+		hash++;
+
+		rc = store_add(store, line, tenant, hash);
+		if(rc == MOSQ_ERR_INVAL){
+			/* e.g. an argon2id hash from a newer mosquitto_passwd */
+			mosquitto_log_printf(MOSQ_LOG_WARNING, PLUGIN_NAME ": %s:%d: Unsupported password hash for '%s', ignoring.", path, lineno, line);
+		}else if(rc == MOSQ_ERR_ALREADY_EXISTS){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Duplicate entry for '%s'.", path, lineno, line);
+			fclose(fptr);
+			return rc;
+		}else if(rc){
+			fclose(fptr);
+			return rc;
+		}
+	}
+	fclose(fptr);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int store_load_dir(struct cred_store *store, const char *dir)
+{
+	DIR *dptr;
+	struct dirent *de;
+	char path[4096];
+	char tenant[256];
+	size_t len;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	dptr = opendir(dir);
+	if(dptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open password_dir '%s'.", dir);
+		return MOSQ_ERR_INVAL;
+	}
+	while(rc == MOSQ_ERR_SUCCESS && (de = readdir(dptr)) != NULL){
+		len = strlen(de->d_name);
+		if(len <= strlen(".passwd") || strcmp(de->d_name + len - strlen(".passwd"), ".passwd")
+				|| len - strlen(".passwd") >= sizeof(tenant)){
+
+			continue;
+		}
+		memcpy(tenant, de->d_name, len - strlen(".passwd"));
+		tenant[len - strlen(".passwd")] = 0;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		rc = store_load_file(store, path, tenant);
+	}
+	closedir(dptr);
+	return rc;
+}
+
+static struct cred_store *store_load(void)
+{
+	struct cred_store *store;
+
+	store = mosquitto_calloc(1, sizeof(struct cred_store));
+	if(store == NULL){
+		return NULL;
+	}
+	store->table = mosquitto_calloc(CRED_TABLE_MIN_SIZE, sizeof(struct cred_entry *));
+	if(store->table == NULL){
+		mosquitto_free(store);
+		return NULL;
+	}
+	store->size = CRED_TABLE_MIN_SIZE;
+
+	if((password_file && store_load_file(store, password_file, NULL))
+			|| (password_dir && store_load_dir(store, password_dir))){
+
+		store_free(store);
+		return NULL;
+	}
+	mosquitto_log_printf(MOSQ_LOG_INFO, PLUGIN_NAME ": Loaded %zu credentials.", store->count);
+	return store;
+}
+
+static bool cred_verify(const struct cred_entry *e, const char *password)
+{
+	unsigned char hash[CRED_HASH_LEN];
+	unsigned int hash_len = 0;
+	EVP_MD_CTX *ctx;
+	bool ok = false;
+
+	if(e->type == CRED_SHA512){
+		ctx = EVP_MD_CTX_new();
+		if(ctx == NULL){
+			return false;
+		}
+		ok = EVP_DigestInit_ex(ctx, EVP_sha512(), NULL)
+				&& EVP_DigestUpdate(ctx, password, strlen(password))
+				&& EVP_DigestUpdate(ctx, e->salt, e->salt_len)
+				&& EVP_DigestFinal_ex(ctx, hash, &hash_len)
+				&& hash_len == CRED_HASH_LEN;
+		EVP_MD_CTX_free(ctx);
+	}else{
+		ok = PKCS5_PBKDF2_HMAC(password, (int)strlen(password), e->salt, (int)e->salt_len,
+				e->iterations, EVP_sha512(), CRED_HASH_LEN, hash);
+	}
+	return ok && !CRYPTO_memcmp(hash, e->pw_hash, CRED_HASH_LEN);
+}
+
+static void cache_digest(const char *password, unsigned char digest[32])
+{
+	unsigned int len = 32;
+
+	HMAC(EVP_sha256(), cache_key, sizeof(cache_key), (const unsigned char *)password, strlen(password), digest, &len);
+}
+
+int auth_check(const char *username, const char *password, const char *team, size_t team_len)
+{
+	const struct cred_entry *e = NULL;
+	struct auth_cache_slot *slot = NULL;
+	unsigned char digest[32];
+	size_t username_len;
+	uint64_t now = 0;
+
+	if(current_store == NULL){
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+	username_len = strlen(username);
+	if(team && password_dir){
+		e = store_find(current_store, username, username_len, team, team_len);
+	}
+	if(e == NULL && password_file){
+		e = store_find(current_store, username, username_len, NULL, 0);
+	}
+	if(e == NULL){
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+	if(password == NULL){
+		return MOSQ_ERR_AUTH;
+	}
+
+	if(cache){
+		now = mt_now_ns();
+		slot = &cache[e->hash & (cache_size-1)];
+		cache_digest(password, digest);
+		if(slot->entry == e && now < slot->expires_ns && !CRYPTO_memcmp(slot->digest, digest, sizeof(digest))){
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	if(!cred_verify(e, password)){
+		return MOSQ_ERR_AUTH;
+	}
+	if(slot){
+		slot->entry = e;
+		slot->expires_ns = now + cache_ttl_ns;
+		memcpy(slot->digest, digest, sizeof(digest));
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool auth_enabled(void)
+{
+	return password_file || password_dir;
+}
+
+static int auth_reload_callback(int event, void *event_data, void *userdata)
+{
+	struct cred_store *store;
+
+	UNUSED(event);
+	UNUSED(event_data);
+	UNUSED(userdata);
+
+	store = store_load();
+	if(store == NULL){
+		mosquitto_log_printf(MOSQ_LOG_WARNING, PLUGIN_NAME ": Keeping the previous credentials.");
+		return MOSQ_ERR_SUCCESS;
+	}
+	/* The cache points at the old entries, and passwords may have changed */
+	if(cache){
+		memset(cache, 0, cache_size*sizeof(struct auth_cache_slot));
+	}
+	store_free(current_store);
+	current_store = store;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int auth_init(struct mosquitto_opt *opts, int opt_count)
+{
+	size_t slots = AUTH_DEFAULT_CACHE_SIZE;
+	long ttl = AUTH_DEFAULT_CACHE_TTL;
+	char *endptr;
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "password_file")){
+			mosquitto_free(password_file);
+			password_file = mosquitto_strdup(opts[i].value);
+			if(password_file == NULL){
+				return MOSQ_ERR_NOMEM;
+			}
+		}else if(!strcasecmp(opts[i].key, "password_dir")){
+			mosquitto_free(password_dir);
+			password_dir = mosquitto_strdup(opts[i].value);
+			if(password_dir == NULL){
+				return MOSQ_ERR_NOMEM;
+			}
+		}else if(!strcasecmp(opts[i].key, "auth_cache_size")){
+			slots = strtoul(opts[i].value, &endptr, 10);
+			if(endptr == opts[i].value || *endptr != 0 || opts[i].value[0] == '-'){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid auth_cache_size '%s'.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "auth_cache_ttl")){
+			ttl = strtol(opts[i].value, &endptr, 10);
+			if(endptr == opts[i].value || *endptr != 0 || ttl < 0){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid auth_cache_ttl '%s'.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+	if(!auth_enabled()){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	current_store = store_load();
+	if(current_store == NULL){
+		return MOSQ_ERR_INVAL;
+	}
+
+	if(slots > 0 && ttl > 0){
+		/* Round up to a power of two */
+		for(cache_size=1; cache_size<slots; cache_size*=2){
+		}
+		cache = mosquitto_calloc(cache_size, sizeof(struct auth_cache_slot));
+		if(cache == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		cache_ttl_ns = (uint64_t)ttl * 1000000000ULL;
+		if(RAND_bytes(cache_key, sizeof(cache_key)) != 1){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to generate auth cache key.");
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
+
+	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_RELOAD, auth_reload_callback, NULL, NULL);
+}
+
+void auth_cleanup(void)
+{
+	if(current_store){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_RELOAD, auth_reload_callback, NULL);
+	}
+	store_free(current_store);
+	current_store = NULL;
+	mosquitto_free(cache);
+	cache = NULL;
+	cache_size = 0;
+	OPENSSL_cleanse(cache_key, sizeof(cache_key));
+	mosquitto_free(password_file);
+	password_file = NULL;
+	mosquitto_free(password_dir);
+	password_dir = NULL;
+}
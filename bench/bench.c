@@ -0,0 +1,559 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * In-process microbenchmark for the multi-tenant plugin callbacks.
+ *
+ * The plugin object is linked against stub versions of the broker functions
+ * it uses, so the callbacks can be driven directly without a broker. Each
+ * callback is timed in ns/op, and the stub allocator counts allocations/op.
+ *
+ * Build and run with:
+ *   make bench
+ *   ./bench/mt_bench -h
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+
+#define UNUSED(A) (void)(A)
+
+#define MAX_EVENTS 64
+#define MAX_OPTS 32
+#define RECONNECT_ROUNDS 5
+
+struct mosquitto {
+	char *id;
+	char *username;
+	int protocol_version;
+	int port;
+};
+
+static MOSQ_FUNC_generic_callback callbacks[MAX_EVENTS];
+static void *callback_userdata[MAX_EVENTS];
+static uint64_t alloc_count = 0;
+
+/* ==================================================
+ * Broker stubs
+ * ================================================== */
+
+void *mosquitto_calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return calloc(nmemb, size);
+}
+
+void *mosquitto_malloc(size_t size)
+{
+	alloc_count++;
+	return malloc(size);
+}
+
+void *mosquitto_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return realloc(ptr, size);
+}
+
+char *mosquitto_strdup(const char *s)
+{
+	alloc_count++;
+	return strdup(s);
+}
+
+void mosquitto_free(void *mem)
+{
+	free(mem);
+}
+
+void mosquitto_log_printf(int level, const char *fmt, ...)
+{
+	va_list va;
+
+	UNUSED(level);
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fputc('\n', stderr);
+}
+
+void mosquitto_plugin_set_info(mosquitto_plugin_id_t *identifier, const char *plugin_name, const char *plugin_version)
+{
+	UNUSED(identifier);
+	UNUSED(plugin_name);
+	UNUSED(plugin_version);
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data, void *userdata)
+{
+	UNUSED(identifier);
+	UNUSED(event_data);
+
+	if(event < 0 || event >= MAX_EVENTS){
+		return MOSQ_ERR_INVAL;
+	}
+	callbacks[event] = cb_func;
+	callback_userdata[event] = userdata;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data)
+{
+	UNUSED(identifier);
+	UNUSED(event_data);
+
+	if(event < 0 || event >= MAX_EVENTS){
+		return MOSQ_ERR_INVAL;
+	}
+	if(callbacks[event] != cb_func){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+	callbacks[event] = NULL;
+	callback_userdata[event] = NULL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+const char *mosquitto_client_id(const struct mosquitto *client)
+{
+	return client->id;
+}
+
+const char *mosquitto_client_username(const struct mosquitto *client)
+{
+	return client->username;
+}
+
+int mosquitto_client_port(const struct mosquitto *client)
+{
+	return client->port;
+}
+
+bool mosquitto_client_clean_session(const struct mosquitto *client)
+{
+	UNUSED(client);
+	return true;
+}
+
+int mosquitto_client_protocol_version(const struct mosquitto *client)
+{
+	return client->protocol_version;
+}
+
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, mosquitto_property *properties)
+{
+	UNUSED(clientid);
+	UNUSED(topic);
+	UNUSED(payloadlen);
+	UNUSED(payload);
+	UNUSED(qos);
+	UNUSED(retain);
+	UNUSED(properties);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_property_copy_all(mosquitto_property **dest, const mosquitto_property *src)
+{
+	UNUSED(src);
+	*dest = NULL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_property_free_all(mosquitto_property **properties)
+{
+	*properties = NULL;
+}
+
+int mosquitto_kick_client_by_clientid(const char *clientid, bool with_will)
+{
+	UNUSED(clientid);
+	UNUSED(with_will);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_set_clientid(struct mosquitto *client, const char *clientid)
+{
+	/* The broker takes ownership of the new id */
+	free(client->id);
+	client->id = (char *)clientid;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* ==================================================
+ * Driver
+ * ================================================== */
+
+static struct {
+	unsigned int tenants;
+	unsigned int clients_per_tenant;
+	unsigned int iterations;
+	unsigned int fanout;
+	unsigned int topic_len;
+	bool shared;
+	bool long_usernames;
+	struct mosquitto_opt opts[MAX_OPTS];
+	int opt_count;
+} cfg = {
+	.tenants = 300,
+	.clients_per_tenant = 100,
+	.iterations = 1000000,
+	.fanout = 1000,
+	.topic_len = 32,
+	.shared = false,
+	.long_usernames = false,
+	.opt_count = 0,
+};
+
+static struct mosquitto *clients = NULL;
+static unsigned int client_count = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void report_elapsed(const char *name, uint64_t elapsed, uint64_t allocs, uint64_t ops)
+{
+	printf("%-16s %12llu ops %10.1f ns/op %8.2f allocs/op\n", name,
+			(unsigned long long)ops,
+			(double)elapsed/(double)ops,
+			(double)allocs/(double)ops);
+}
+
+static void report(const char *name, uint64_t start_ns, uint64_t start_allocs, uint64_t ops)
+{
+	report_elapsed(name, now_ns() - start_ns, alloc_count - start_allocs, ops);
+}
+
+static int call(int event, void *event_data)
+{
+	if(callbacks[event] == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return callbacks[event](event, event_data, callback_userdata[event]);
+}
+
+static void make_topic(char *buf, size_t len)
+{
+	size_t i;
+
+	for(i=0; i<len; i++){
+		buf[i] = (i % 8 == 7) ? '/' : (char)('a' + (i % 26));
+	}
+	if(len > 0 && buf[len-1] == '/'){
+		buf[len-1] = 'z';
+	}
+	buf[len] = 0;
+}
+
+static void bench_connect(void)
+{
+	struct mosquitto_evt_connect ed;
+	char buf[256];
+	unsigned int t, c, i;
+	uint64_t start, allocs;
+
+	client_count = cfg.tenants * cfg.clients_per_tenant;
+	clients = calloc(client_count, sizeof(struct mosquitto));
+	if(clients == NULL){
+		fprintf(stderr, "Error: Out of memory.\n");
+		exit(1);
+	}
+	for(t=0; t<cfg.tenants; t++){
+		for(c=0; c<cfg.clients_per_tenant; c++){
+			i = t*cfg.clients_per_tenant + c;
+			if(cfg.long_usernames){
+				snprintf(buf, sizeof(buf), "device%08u%08x@tenant%04u", c, c*2654435761U, t);
+			}else{
+				snprintf(buf, sizeof(buf), "user%u@team%u", c, t);
+			}
+			clients[i].username = strdup(buf);
+			snprintf(buf, sizeof(buf), "client-%u", i);
+			clients[i].id = strdup(buf);
+			clients[i].protocol_version = 5;
+		}
+	}
+
+	memset(&ed, 0, sizeof(ed));
+	allocs = alloc_count;
+	start = now_ns();
+	for(i=0; i<client_count; i++){
+		ed.client = &clients[i];
+		call(MOSQ_EVT_CONNECT, &ed);
+	}
+	report("connect", start, allocs, client_count);
+}
+
+/* Every client drops and comes straight back, as in a reconnect storm after
+ * a network blip. */
+static void bench_reconnect(void)
+{
+	struct mosquitto_evt_connect ec;
+	struct mosquitto_evt_disconnect ed;
+	char buf[64];
+	unsigned int i, round;
+	uint64_t elapsed = 0, start, allocs_total = 0, allocs;
+
+	memset(&ec, 0, sizeof(ec));
+	memset(&ed, 0, sizeof(ed));
+	for(round=0; round<RECONNECT_ROUNDS; round++){
+		/* The connect callback appends the team to the id, put it back */
+		for(i=0; i<client_count; i++){
+			snprintf(buf, sizeof(buf), "client-%u", i);
+			free(clients[i].id);
+			clients[i].id = strdup(buf);
+		}
+
+		allocs = alloc_count;
+		start = now_ns();
+		for(i=0; i<client_count; i++){
+			ed.client = &clients[i];
+			call(MOSQ_EVT_DISCONNECT, &ed);
+			ec.client = &clients[i];
+			call(MOSQ_EVT_CONNECT, &ec);
+		}
+		elapsed += now_ns() - start;
+		allocs_total += alloc_count - allocs;
+	}
+	report_elapsed("reconnect", elapsed, allocs_total, (uint64_t)client_count*RECONNECT_ROUNDS);
+}
+
+static void bench_disconnect(void)
+{
+	struct mosquitto_evt_disconnect ed;
+	unsigned int i;
+	uint64_t start, allocs;
+
+	memset(&ed, 0, sizeof(ed));
+	allocs = alloc_count;
+	start = now_ns();
+	for(i=0; i<client_count; i++){
+		ed.client = &clients[i];
+		call(MOSQ_EVT_DISCONNECT, &ed);
+	}
+	report("disconnect", start, allocs, client_count);
+
+	for(i=0; i<client_count; i++){
+		free(clients[i].id);
+		free(clients[i].username);
+	}
+	free(clients);
+	clients = NULL;
+}
+
+static void bench_message_in(void)
+{
+	struct mosquitto_evt_message ed;
+	char *topic;
+	unsigned int i;
+	uint64_t start, allocs;
+
+	topic = malloc(cfg.topic_len + 1);
+	make_topic(topic, cfg.topic_len);
+
+	memset(&ed, 0, sizeof(ed));
+	allocs = alloc_count;
+	start = now_ns();
+	for(i=0; i<cfg.iterations; i++){
+		ed.client = &clients[i % client_count];
+		ed.topic = topic;
+		ed.payloadlen = 16;
+		call(MOSQ_EVT_MESSAGE_IN, &ed);
+		if(ed.topic != topic){
+			mosquitto_free(ed.topic);
+		}
+	}
+	report("message_in", start, allocs, cfg.iterations);
+	free(topic);
+}
+
+static void bench_message_out(void)
+{
+	struct mosquitto_evt_message ed_in, ed;
+	char *topic, *stored;
+	unsigned int i, r, fanout, messages;
+	uint64_t start, elapsed = 0, allocs, allocs_total = 0, ops = 0;
+
+	topic = malloc(cfg.topic_len + 1);
+	make_topic(topic, cfg.topic_len);
+
+	fanout = cfg.fanout < cfg.clients_per_tenant ? cfg.fanout : cfg.clients_per_tenant;
+	messages = cfg.iterations / fanout;
+	if(messages == 0) messages = 1;
+
+	memset(&ed, 0, sizeof(ed));
+	for(i=0; i<messages; i++){
+		unsigned int tenant = i % cfg.tenants;
+
+		/* Produce the stored, prefixed topic the broker would hold. This is
+		 * not part of the measurement. */
+		memset(&ed_in, 0, sizeof(ed_in));
+		ed_in.client = &clients[tenant*cfg.clients_per_tenant];
+		ed_in.topic = topic;
+		call(MOSQ_EVT_MESSAGE_IN, &ed_in);
+		stored = ed_in.topic;
+
+		allocs = alloc_count;
+		start = now_ns();
+		for(r=0; r<fanout; r++){
+			ed.client = &clients[tenant*cfg.clients_per_tenant + r];
+			ed.topic = stored;
+			ed.payload = stored;
+			ed.payloadlen = 16;
+			call(MOSQ_EVT_MESSAGE_OUT, &ed);
+			if(ed.topic != stored){
+				mosquitto_free(ed.topic);
+			}
+		}
+		elapsed += now_ns() - start;
+		allocs_total += alloc_count - allocs;
+		ops += fanout;
+
+		if(stored != topic){
+			mosquitto_free(stored);
+		}
+	}
+	report_elapsed("message_out", elapsed, allocs_total, ops);
+	free(topic);
+}
+
+static void bench_subscribe(void)
+{
+	struct mosquitto_evt_subscribe ed;
+	char *filter;
+	unsigned int i;
+	uint64_t start, allocs;
+	size_t head_len = cfg.shared ? strlen("$share/group/") : 0;
+
+	filter = malloc(head_len + cfg.topic_len + 1);
+	if(cfg.shared){
+		memcpy(filter, "$share/group/", head_len);
+	}
+	make_topic(filter + head_len, cfg.topic_len);
+
+	memset(&ed, 0, sizeof(ed));
+	allocs = alloc_count;
+	start = now_ns();
+	for(i=0; i<cfg.iterations; i++){
+		ed.client = &clients[i % client_count];
+		ed.data.topic_filter = filter;
+		call(MOSQ_EVT_SUBSCRIBE, &ed);
+		if(ed.data.topic_filter != filter){
+			mosquitto_free(ed.data.topic_filter);
+		}
+	}
+	report(cfg.shared ? "subscribe_share" : "subscribe", start, allocs, cfg.iterations);
+	free(filter);
+}
+
+static void print_usage(void)
+{
+	printf("mt_bench - microbenchmark for the multi-tenant plugin callbacks\n\n");
+	printf("Usage: mt_bench [-t tenants] [-c clients per tenant] [-n iterations]\n");
+	printf("                [-f fanout] [-l topic length] [-s] [-L] [-o key=value]...\n\n");
+	printf(" -t : number of tenants, default 300\n");
+	printf(" -c : clients per tenant, default 100\n");
+	printf(" -n : iterations for the message and subscribe benchmarks, default 1000000\n");
+	printf(" -f : recipients per message for message_out, default 1000\n");
+	printf(" -l : topic / topic filter length, default 32\n");
+	printf(" -s : use $share/group/ subscriptions\n");
+	printf(" -L : use long usernames (device...@tenant...) rather than user@team\n");
+	printf(" -o : pass a plugin option, e.g. -o tenant_delimiter=@\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	char *eq;
+	int dummy_id;
+
+	while((opt = getopt(argc, argv, "t:c:n:f:l:sLo:h")) != -1){
+		switch(opt){
+			case 't':
+				cfg.tenants = (unsigned int)atoi(optarg);
+				break;
+			case 'c':
+				cfg.clients_per_tenant = (unsigned int)atoi(optarg);
+				break;
+			case 'n':
+				cfg.iterations = (unsigned int)atoi(optarg);
+				break;
+			case 'f':
+				cfg.fanout = (unsigned int)atoi(optarg);
+				break;
+			case 'l':
+				cfg.topic_len = (unsigned int)atoi(optarg);
+				break;
+			case 's':
+				cfg.shared = true;
+				break;
+			case 'L':
+				cfg.long_usernames = true;
+				break;
+			case 'o':
+				eq = strchr(optarg, '=');
+				if(eq == NULL || cfg.opt_count == MAX_OPTS){
+					fprintf(stderr, "Error: Invalid plugin option '%s'.\n", optarg);
+					return 1;
+				}
+				*eq = 0;
+				cfg.opts[cfg.opt_count].key = optarg;
+				cfg.opts[cfg.opt_count].value = eq+1;
+				cfg.opt_count++;
+				break;
+			case 'h':
+			default:
+				print_usage();
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(cfg.tenants == 0 || cfg.clients_per_tenant == 0 || cfg.iterations == 0){
+		print_usage();
+		return 1;
+	}
+	if(cfg.long_usernames && cfg.opt_count == 0){
+		/* The default regex does not allow the long username shape */
+		cfg.opts[0].key = "tenant_delimiter";
+		cfg.opts[0].value = "@";
+		cfg.opt_count = 1;
+	}
+
+	if(mosquitto_plugin_init((mosquitto_plugin_id_t *)&dummy_id, NULL, cfg.opts, cfg.opt_count)){
+		fprintf(stderr, "Error: Plugin init failed.\n");
+		return 1;
+	}
+
+	printf("tenants=%u clients/tenant=%u iterations=%u fanout=%u topic_len=%u\n",
+			cfg.tenants, cfg.clients_per_tenant, cfg.iterations, cfg.fanout, cfg.topic_len);
+
+	bench_connect();
+	bench_reconnect();
+	bench_message_in();
+	bench_message_out();
+	bench_subscribe();
+	bench_disconnect();
+
+	mosquitto_plugin_cleanup(NULL, cfg.opts, cfg.opt_count);
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Clients the plugin leaves alone.
+ *
+ * Internal services and the admin user have no tenant, but would otherwise
+ * still have their username run through the tenant rules when they connect.
+ * plugin_opt_listeners limits the plugin to clients on the listed ports, and
+ * plugin_opt_bypass_users leaves named users out on any listener. Client ids
+ * are not used, as a client picks its own and a tenant user could otherwise
+ * take itself out of its tenant.
+ *
+ * This is checked once, when the client connects. The client table then
+ * records that the client has no tenant, the same as for a username that
+ * matched no rule, so each later callback for it stops at that entry.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+struct bypass_list {
+	char **items;
+	uint32_t count;
+};
+
+static int *listener_ports = NULL;
+static uint32_t listener_count = 0;
+static struct bypass_list bypass_users;
+
+static int bypass_list_add(struct bypass_list *list, const char *item)
+{
+	char **new_items;
+
+	new_items = mosquitto_realloc(list->items, (list->count+1)*sizeof(char *));
+	if(new_items == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	list->items = new_items;
+	list->items[list->count] = mosquitto_strdup(item);
+	if(list->items[list->count] == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	list->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void bypass_list_cleanup(struct bypass_list *list)
+{
+	uint32_t i;
+
+	for(i=0; i<list->count; i++){
+		mosquitto_free(list->items[i]);
+	}
+	mosquitto_free(list->items);
+	memset(list, 0, sizeof(struct bypass_list));
+}
+
+static int listener_add(const char *port)
+{
+	int *new_ports;
+	char *end;
+	long p;
+
+	p = strtol(port, &end, 10);
+	if(*end != 0 || p < 1 || p > 65535){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid port '%s' in listeners.", port);
+		return MOSQ_ERR_INVAL;
+	}
+	new_ports = mosquitto_realloc(listener_ports, (listener_count+1)*sizeof(int));
+	if(new_ports == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	listener_ports = new_ports;
+	listener_ports[listener_count++] = (int)p;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Options are comma or space separated lists, and can be repeated. */
+static int bypass_parse(const char *value, struct bypass_list *list)
+{
+	char *str, *tok, *saveptr = NULL;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	str = mosquitto_strdup(value);
+	if(str == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(tok=strtok_r(str, " \t,", &saveptr); tok && rc == MOSQ_ERR_SUCCESS; tok=strtok_r(NULL, " \t,", &saveptr)){
+		if(list){
+			rc = bypass_list_add(list, tok);
+		}else{
+			rc = listener_add(tok);
+		}
+	}
+	mosquitto_free(str);
+	return rc;
+}
+
+bool bypass_client(const struct mosquitto *client, const char *username)
+{
+	uint32_t i;
+	int port;
+
+	if(listener_count){
+		port = mosquitto_client_port(client);
+		for(i=0; i<listener_count; i++){
+			if(listener_ports[i] == port){
+				break;
+			}
+		}
+		if(i == listener_count){
+			return true;
+		}
+	}
+	for(i=0; i<bypass_users.count; i++){
+		if(!strcmp(username, bypass_users.items[i])){
+			return true;
+		}
+	}
+	return false;
+}
+
+int bypass_init(struct mosquitto_opt *opts, int opt_count)
+{
+	int i, rc;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "listeners")){
+			rc = bypass_parse(opts[i].value, NULL);
+		}else if(!strcasecmp(opts[i].key, "bypass_users")){
+			rc = bypass_parse(opts[i].value, &bypass_users);
+		}else if(!strcasecmp(opts[i].key, "bypass_clientids")){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": bypass_clientids is not supported, clients choose their own ids. Use bypass_users or listeners.");
+			return MOSQ_ERR_INVAL;
+		}else{
+			continue;
+		}
+		if(rc){
+			return rc;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void bypass_cleanup(void)
+{
+	mosquitto_free(listener_ports);
+	listener_ports = NULL;
+	listener_count = 0;
+	bypass_list_cleanup(&bypass_users);
+}
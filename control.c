@@ -0,0 +1,296 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Runtime control over $CONTROL/multi-tenant/v1.
+ *
+ * Each message published to the control topic is a single text command,
+ * e.g. "latency tenant". The result is published back to the sending client
+ * only, on $CONTROL/multi-tenant/v1/response, as "ok" or "error: <reason>"
+ * followed by any output.
+ *
+ * Commands run on the broker thread like every other callback, so the
+ * changes they make take effect between two events. Commands that change
+ * several limits check all of them first and apply either all or none.
+ *
+ * Access to the topic is controlled by the broker's ACLs, as for the other
+ * $CONTROL plugins. Tenant clients are always refused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define CONTROL_TOPIC "$CONTROL/" PLUGIN_NAME "/v1"
+#define CONTROL_MAX_ARGS 16
+#define CONTROL_MAX_PAYLOAD 1024
+#define CONTROL_MAX_RESPONSE 4096
+
+struct control_command {
+	const char *name;
+	const char *usage;
+	int (*handler)(int argc, char **argv, char *resp, size_t resp_len);
+};
+
+static int cmd_latency(int argc, char **argv, char *resp, size_t resp_len)
+{
+	static const char *mode_names[] = {"off", "global", "tenant"};
+	enum latency_mode new_mode;
+
+	if(argc == 1){
+		snprintf(resp, resp_len, "ok\nlatency %s", mode_names[latency_get_mode()]);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(argc != 2 || latency_mode_parse(argv[1], &new_mode)){
+		return MOSQ_ERR_INVAL;
+	}
+	if(latency_set_mode(new_mode)){
+		snprintf(resp, resp_len, "error: unable to change callbacks");
+		return MOSQ_ERR_SUCCESS;
+	}
+	snprintf(resp, resp_len, "ok");
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Report the result of a limits change */
+static int control_limits_result(int rc, char *resp, size_t resp_len)
+{
+	switch(rc){
+		case MOSQ_ERR_SUCCESS:
+			snprintf(resp, resp_len, "ok");
+			break;
+		case MOSQ_ERR_NOT_FOUND:
+			snprintf(resp, resp_len, "error: unknown limit");
+			break;
+		case MOSQ_ERR_INVAL:
+			snprintf(resp, resp_len, "error: limits must be given as <limit>=<value>");
+			break;
+		case MOSQ_ERR_NOMEM:
+			snprintf(resp, resp_len, "error: out of memory");
+			break;
+		default:
+			snprintf(resp, resp_len, "error: unable to register callbacks");
+			break;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int cmd_tenant(int argc, char **argv, char *resp, size_t resp_len)
+{
+	struct tenant *t;
+	unsigned int kicked = 0;
+	int rc;
+
+	if(argc < 3){
+		return MOSQ_ERR_INVAL;
+	}
+	if(!strcasecmp(argv[1], "add")){
+		rc = limits_tenant_add(argv[2], argc-3, &argv[3]);
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = tenant_limits_changed();
+			mosquitto_log_printf(MOSQ_LOG_NOTICE, PLUGIN_NAME ": Tenant '%s' added.", argv[2]);
+		}
+		return control_limits_result(rc, resp, resp_len);
+	}else if(!strcasecmp(argv[1], "remove") && argc == 3){
+		rc = limits_tenant_enable(argv[2], false);
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = tenant_limits_changed();
+		}
+		if(rc){
+			return control_limits_result(rc, resp, resp_len);
+		}
+		t = tenant_find(argv[2], strlen(argv[2]));
+		if(t){
+			kicked = tenant_kick(t);
+		}
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, PLUGIN_NAME ": Tenant '%s' removed, %u clients disconnected.", argv[2], kicked);
+		snprintf(resp, resp_len, "ok\nkicked %u", kicked);
+		return MOSQ_ERR_SUCCESS;
+	}
+	return MOSQ_ERR_INVAL;
+}
+
+static int cmd_limits(int argc, char **argv, char *resp, size_t resp_len)
+{
+	const char *name;
+	int rc;
+
+	if(argc < 2){
+		return MOSQ_ERR_INVAL;
+	}
+	name = strcmp(argv[1], "*") ? argv[1] : NULL;
+	if(argc == 2){
+		snprintf(resp, resp_len, "ok");
+		limits_format(name, resp + 2, resp_len - 2);
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = limits_tenant_set(name, argc-2, &argv[2]);
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = tenant_limits_changed();
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, PLUGIN_NAME ": Limits changed for %s.", name ? name : "all tenants");
+	}
+	return control_limits_result(rc, resp, resp_len);
+}
+
+static int cmd_stats(int argc, char **argv, char *resp, size_t resp_len)
+{
+	const struct tenant *t;
+	size_t n;
+	uint32_t i;
+	int rc;
+
+	if(argc == 1){
+		/* Tenants with connected clients, and how many */
+		n = (size_t)snprintf(resp, resp_len, "ok");
+		for(i=0; i<tenant_id_max && n<resp_len; i++){
+			t = tenant_by_id[i];
+			if(t){
+				rc = snprintf(resp + n, resp_len - n, "\n%s %llu", t->name, (unsigned long long)t->stats.clients);
+				if(rc < 0){
+					break;
+				}
+				n += (size_t)rc;
+			}
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(argc != 2){
+		return MOSQ_ERR_INVAL;
+	}
+	t = tenant_find(argv[1], strlen(argv[1]));
+	if(t == NULL){
+		snprintf(resp, resp_len, "error: tenant '%s' has no connected clients", argv[1]);
+		return MOSQ_ERR_SUCCESS;
+	}
+	snprintf(resp, resp_len, "ok");
+	stats_format(t, resp + 2, resp_len - 2);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int cmd_placement(int argc, char **argv, char *resp, size_t resp_len)
+{
+	if(argc > 2){
+		return MOSQ_ERR_INVAL;
+	}
+	if(!placement_enabled()){
+		snprintf(resp, resp_len, "error: no cluster_nodes configured");
+		return MOSQ_ERR_SUCCESS;
+	}
+	snprintf(resp, resp_len, "ok");
+	placement_format(argc == 2 ? argv[1] : NULL, argc == 2 ? strlen(argv[1]) : 0, resp + 2, resp_len - 2);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int cmd_reload(int argc, char **argv, char *resp, size_t resp_len)
+{
+	if(argc != 2 || strcasecmp(argv[1], "map")){
+		return MOSQ_ERR_INVAL;
+	}
+	switch(tenantmap_reload()){
+		case MOSQ_ERR_SUCCESS:
+			snprintf(resp, resp_len, "ok");
+			break;
+		case MOSQ_ERR_NOT_FOUND:
+			snprintf(resp, resp_len, "error: no tenant_map configured");
+			break;
+		default:
+			snprintf(resp, resp_len, "error: unable to load tenant_map, keeping the old one");
+			break;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static const struct control_command commands[] = {
+	{"latency", "latency [off|global|tenant]", cmd_latency},
+	{"limits", "limits <tenant>|* [<limit>=<value> ...]", cmd_limits},
+	{"placement", "placement [<tenant>]", cmd_placement},
+	{"reload", "reload map", cmd_reload},
+	{"stats", "stats [<tenant>]", cmd_stats},
+	{"tenant", "tenant add <tenant> [<limit>=<value> ...] | tenant remove <tenant>", cmd_tenant},
+};
+
+static int control_split(char *line, char **argv)
+{
+	int argc = 0;
+	char *tok, *saveptr = NULL;
+
+	for(tok=strtok_r(line, " \t\r\n", &saveptr); tok; tok=strtok_r(NULL, " \t\r\n", &saveptr)){
+		if(argc == CONTROL_MAX_ARGS){
+			return -1;
+		}
+		argv[argc++] = tok;
+	}
+	return argc;
+}
+
+static void control_respond(struct mosquitto *client, const char *resp)
+{
+	mt_publish_copy(mosquitto_client_id(client), CONTROL_TOPIC "/response",
+			(int)strlen(resp), resp, 0, false, NULL);
+}
+
+static int control_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_control *ed = event_data;
+	char line[CONTROL_MAX_PAYLOAD + 1];
+	char resp[CONTROL_MAX_RESPONSE];
+	char *argv[CONTROL_MAX_ARGS];
+	size_t i;
+	int argc;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(client_find(ed->client)){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+	if(ed->payloadlen > CONTROL_MAX_PAYLOAD){
+		control_respond(ed->client, "error: command too long");
+		return MOSQ_ERR_SUCCESS;
+	}
+	memcpy(line, ed->payload, ed->payloadlen);
+	line[ed->payloadlen] = 0;
+
+	argc = control_split(line, argv);
+	if(argc <= 0){
+		control_respond(ed->client, "error: too many or no arguments");
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	for(i=0; i<sizeof(commands)/sizeof(commands[0]); i++){
+		if(!strcasecmp(argv[0], commands[i].name)){
+			if(commands[i].handler(argc, argv, resp, sizeof(resp)) == MOSQ_ERR_INVAL){
+				snprintf(resp, sizeof(resp), "error: usage: %s", commands[i].usage);
+			}
+			control_respond(ed->client, resp);
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+	snprintf(resp, sizeof(resp), "error: unknown command '%s'", argv[0]);
+	control_respond(ed->client, resp);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int control_init(void)
+{
+	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_CONTROL, control_callback, CONTROL_TOPIC, NULL);
+}
+
+void control_cleanup(void)
+{
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_CONTROL, control_callback, CONTROL_TOPIC);
+}
@@ -0,0 +1,275 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-topic downsampling.
+ *
+ * For tenants with a downsample_interval, a QoS 0 publish to a topic that
+ * arrives less than the interval after the last one that was passed on is
+ * held back instead of being delivered. Only the newest held back message
+ * for each topic is kept, and it is published once the interval is up, so
+ * subscribers see at most one message per topic per interval but always get
+ * the latest value. QoS 1 and 2 publishes are never held back. A held back
+ * message keeps its properties, so subscribers get the message the tenant
+ * sent, but a message expiry interval counts from when it is passed on.
+ *
+ * The last-seen times are kept in a fixed size, 4-way set associative table
+ * keyed by a hash of the stored topic, so memory is bounded by
+ * plugin_opt_downsample_slots no matter how many topics there are. When a set
+ * is full the least recently passed topic is evicted, and any message held
+ * back for it is published straight away.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define DS_WAYS 4
+#define DS_DEFAULT_SLOTS 16384
+
+struct ds_pending;
+
+struct ds_slot {
+	uint64_t hash;     /* 0 if the slot is unused */
+	uint64_t last_ns;  /* when a message was last passed on */
+	struct ds_pending *pending;
+};
+
+struct ds_pending {
+	struct ds_pending *prev;
+	struct ds_pending *next;
+	struct ds_slot *slot;
+	uint64_t interval_ns;
+	mosquitto_property *properties;
+	int payloadlen;
+	bool retain;
+	char *topic;       /* points after payload[] */
+	char payload[];
+};
+
+static struct ds_slot *slots = NULL;
+static size_t set_count = 0; /* always a power of two */
+static struct ds_pending *pending_head = NULL;
+static size_t slot_count = DS_DEFAULT_SLOTS;
+
+static void pending_unlink(struct ds_pending *p)
+{
+	if(p->prev){
+		p->prev->next = p->next;
+	}else{
+		pending_head = p->next;
+	}
+	if(p->next){
+		p->next->prev = p->prev;
+	}
+	p->slot->pending = NULL;
+}
+
+static void pending_free(struct ds_pending *p)
+{
+	mosquitto_property_free_all(&p->properties);
+	mosquitto_free(p);
+}
+
+static void pending_flush(struct ds_slot *slot, uint64_t now)
+{
+	struct ds_pending *p = slot->pending;
+
+	pending_unlink(p);
+	/* Published messages do not pass through message_in again, so the topic
+	 * already has the tenant prefix. The properties are freed by the broker. */
+	mt_publish_copy(NULL, p->topic, p->payloadlen, p->payload, 0, p->retain, p->properties);
+	slot->last_ns = now;
+	mosquitto_free(p);
+}
+
+static bool pending_set(struct ds_slot *slot, const struct tenant *t, const struct mosquitto_evt_message *ed, uint64_t interval_ns)
+{
+	struct ds_pending *p;
+	size_t topic_len = strlen(ed->topic);
+
+	p = mosquitto_malloc(sizeof(struct ds_pending) + ed->payloadlen + t->prefix_len + topic_len + 1);
+	if(p == NULL){
+		return false;
+	}
+	p->properties = NULL;
+	if(ed->properties && mosquitto_property_copy_all(&p->properties, ed->properties)){
+		mosquitto_free(p);
+		return false;
+	}
+	p->interval_ns = interval_ns;
+	p->payloadlen = (int)ed->payloadlen;
+	p->retain = ed->retain;
+	memcpy(p->payload, ed->payload, ed->payloadlen);
+	p->topic = p->payload + ed->payloadlen;
+	memcpy(p->topic, t->prefix, t->prefix_len);
+	memcpy(p->topic + t->prefix_len, ed->topic, topic_len + 1);
+
+	if(slot->pending){
+		/* Replaced by the newer message */
+		struct ds_pending *old = slot->pending;
+		pending_unlink(old);
+		pending_free(old);
+	}
+	p->slot = slot;
+	p->prev = NULL;
+	p->next = pending_head;
+	if(pending_head){
+		pending_head->prev = p;
+	}
+	pending_head = p;
+	slot->pending = p;
+	return true;
+}
+
+bool downsample_allow(const struct tenant *t, const struct mosquitto_evt_message *ed)
+{
+	struct ds_slot *set, *slot = NULL, *victim;
+	uint64_t hash, now, interval_ns;
+	int i;
+
+	if(slots == NULL){
+		return true;
+	}
+	now = mt_now_ns();
+	interval_ns = (uint64_t)t->limits->downsample_interval * 1000000ULL;
+	hash = mt_topic_hash(t->prefix, t->prefix_len, ed->topic);
+	if(hash == 0){
+		hash = 1;
+	}
+
+	set = &slots[(hash & (set_count-1)) * DS_WAYS];
+	victim = &set[0];
+	for(i=0; i<DS_WAYS; i++){
+		if(set[i].hash == hash){
+			slot = &set[i];
+			break;
+		}
+		if(set[i].hash == 0 || (victim->hash && set[i].last_ns < victim->last_ns)){
+			victim = &set[i];
+		}
+	}
+
+	if(slot == NULL){
+		if(victim->pending){
+			pending_flush(victim, now);
+		}
+		victim->hash = hash;
+		victim->last_ns = now;
+		return true;
+	}
+
+	if(now - slot->last_ns >= interval_ns){
+		if(slot->pending){
+			/* Superseded by this message */
+			struct ds_pending *old = slot->pending;
+			pending_unlink(old);
+			pending_free(old);
+		}
+		slot->last_ns = now;
+		return true;
+	}
+
+	/* Too soon, hold it back. If there is no memory to do that, let it
+	 * through rather than lose the latest value. */
+	return !pending_set(slot, t, ed, interval_ns);
+}
+
+static int downsample_tick_callback(int event, void *event_data, void *userdata)
+{
+	struct ds_pending *p, *next;
+	uint64_t now;
+
+	UNUSED(event);
+	UNUSED(event_data);
+	UNUSED(userdata);
+
+	if(pending_head == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	now = mt_now_ns();
+	for(p=pending_head; p; p=next){
+		next = p->next;
+		if(now - p->slot->last_ns >= p->interval_ns){
+			pending_flush(p->slot, now);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int downsample_start(void)
+{
+	/* Round down to a power of two number of sets */
+	set_count = 1;
+	while(set_count*2*DS_WAYS <= slot_count){
+		set_count *= 2;
+	}
+	slots = mosquitto_calloc(set_count*DS_WAYS, sizeof(struct ds_slot));
+	if(slots == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, downsample_tick_callback, NULL, NULL);
+}
+
+int downsample_limits_changed(void)
+{
+	if(slots || !limits_downsampling()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return downsample_start();
+}
+
+int downsample_init(struct mosquitto_opt *opts, int opt_count)
+{
+	char *endptr;
+	long v;
+	int i;
+
+	slot_count = DS_DEFAULT_SLOTS;
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "downsample_slots")){
+			v = strtol(opts[i].value, &endptr, 10);
+			if(endptr == opts[i].value || *endptr != 0 || v < DS_WAYS){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid downsample_slots '%s'.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+			slot_count = (size_t)v;
+		}
+	}
+
+	if(!limits_downsampling()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return downsample_start();
+}
+
+void downsample_cleanup(void)
+{
+	struct ds_pending *p, *next;
+
+	if(slots == NULL){
+		return;
+	}
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, downsample_tick_callback, NULL);
+	for(p=pending_head; p; p=next){
+		next = p->next;
+		pending_free(p);
+	}
+	pending_head = NULL;
+	mosquitto_free(slots);
+	slots = NULL;
+	set_count = 0;
+}
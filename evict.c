@@ -0,0 +1,316 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Idle client eviction under memory pressure.
+ *
+ * Once a second the resident size of the broker is read from
+ * /proc/self/statm. When it goes over plugin_opt_memory_high, idle clients
+ * are disconnected, plugin_opt_memory_evict_batch of them a second, until it
+ * is back under plugin_opt_memory_low. Freed memory is not always handed
+ * back to the system straight away, so the batches give it time to show up
+ * before more clients go.
+ *
+ * Each tenant is scored by the highest of its connections, subscriptions,
+ * retained and queued use over the limit for each, so 1.0 is at a limit.
+ * Tenants scoring at least plugin_opt_memory_evict_score (0.8 by default)
+ * lose clients first, highest score first. If that isn't a whole batch, the
+ * other tenants follow biggest first, including those with no limits at all,
+ * which always score 0. Within a tenant the longest idle clients go first,
+ * using the activity order the core keeps for every tenant: a client moves
+ * to the front when it publishes, subscribes, unsubscribes or is sent a
+ * message. Clients active in the last plugin_opt_memory_evict_idle seconds
+ * are never evicted, so the walk along a tenant's clients stops at the first
+ * one of those.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define EVICT_DEFAULT_BATCH 100
+#define EVICT_DEFAULT_SCORE 0.8
+#define EVICT_DEFAULT_IDLE 60
+
+struct evict_rank {
+	struct tenant *tenant;
+	double score;
+};
+
+static uint64_t memory_high = 0;
+static uint64_t memory_low = 0;
+static uint32_t evict_batch = EVICT_DEFAULT_BATCH;
+static double evict_min_score = EVICT_DEFAULT_SCORE;
+static uint64_t evict_idle_ns = (uint64_t)EVICT_DEFAULT_IDLE * 1000000000ULL;
+static int statm_fd = -1;
+static long page_size = 0;
+static time_t evict_next = 0;
+static bool evicting = false;
+
+static int parse_size(const char *str, uint64_t *value)
+{
+	char *end;
+	unsigned long long v;
+
+	if(str == NULL || *str == 0 || *str == '-'){
+		return MOSQ_ERR_INVAL;
+	}
+	v = strtoull(str, &end, 10);
+	switch(*end){
+		case 'k': case 'K': v <<= 10; end++; break;
+		case 'm': case 'M': v <<= 20; end++; break;
+		case 'g': case 'G': v <<= 30; end++; break;
+		default: break;
+	}
+	if(*end != 0){
+		return MOSQ_ERR_INVAL;
+	}
+	*value = v;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Resident set size in bytes, or 0 if it can't be read. */
+static uint64_t memory_rss(void)
+{
+	char buf[128];
+	unsigned long size, pages;
+	ssize_t len;
+
+	len = pread(statm_fd, buf, sizeof(buf)-1, 0);
+	if(len <= 0){
+		return 0;
+	}
+	buf[len] = 0;
+	/* "size resident shared ..." in pages */
+	if(sscanf(buf, "%lu %lu", &size, &pages) != 2){
+		return 0;
+	}
+	return (uint64_t)pages * (uint64_t)page_size;
+}
+
+static double limit_ratio(uint64_t used, uint32_t limit)
+{
+	return limit ? (double)used / limit : 0.0;
+}
+
+static double evict_score(const struct tenant *t)
+{
+	const struct tenant_limits *l = t->limits;
+	double score, r;
+
+	score = limit_ratio(t->stats.clients, l->max_connections);
+	if(t->subs){
+		r = limit_ratio(t->subs->subscriptions, l->max_subscriptions);
+		if(r > score) score = r;
+	}
+	if(t->retained){
+		r = limit_ratio(t->retained->count, l->max_retained_msgs);
+		if(r > score) score = r;
+		r = limit_ratio(t->retained->bytes, l->max_retained_bytes);
+		if(r > score) score = r;
+	}
+	if(t->queued){
+		r = limit_ratio(t->queued->bytes, l->max_queued_bytes);
+		if(r > score) score = r;
+	}
+	return score;
+}
+
+static int evict_rank_cmp(const void *a, const void *b)
+{
+	const struct evict_rank *ra = a, *rb = b;
+	bool over_a = ra->score >= evict_min_score, over_b = rb->score >= evict_min_score;
+
+	if(over_a != over_b){
+		return over_a ? -1 : 1;
+	}
+	if(over_a && ra->score != rb->score){
+		return ra->score < rb->score ? 1 : -1;
+	}
+	/* Without limits to go by, the biggest tenants go first */
+	if(ra->tenant->stats.clients != rb->tenant->stats.clients){
+		return ra->tenant->stats.clients < rb->tenant->stats.clients ? 1 : -1;
+	}
+	return 0;
+}
+
+static unsigned int evict_round(void)
+{
+	struct evict_rank *ranks;
+	struct team_client *tc;
+	char **ids;
+	uint32_t i, rank_count = 0, count = 0;
+	uint64_t now = mt_now_ns();
+
+	ranks = mosquitto_malloc(tenant_id_max*sizeof(struct evict_rank));
+	ids = mosquitto_calloc(evict_batch, sizeof(char *));
+	if(ranks == NULL || ids == NULL){
+		mosquitto_free(ranks);
+		mosquitto_free(ids);
+		return 0;
+	}
+	for(i=0; i<tenant_id_max; i++){
+		if(tenant_by_id[i] && tenant_by_id[i]->lru_tail){
+			ranks[rank_count].tenant = tenant_by_id[i];
+			ranks[rank_count].score = evict_score(tenant_by_id[i]);
+			rank_count++;
+		}
+	}
+	qsort(ranks, rank_count, sizeof(struct evict_rank), evict_rank_cmp);
+
+	/* Kicking a client runs the disconnect callback straight away, which can
+	 * free the tenant, so take a copy of the ids first. */
+	for(i=0; i<rank_count && count<evict_batch; i++){
+		for(tc=ranks[i].tenant->lru_tail; tc && count<evict_batch; tc=tc->lru_prev){
+			if(now - tc->active_ns < evict_idle_ns){
+				/* This one and all after it are still active */
+				break;
+			}
+			ids[count] = mosquitto_strdup(mosquitto_client_id(tc->client));
+			if(ids[count]){
+				ranks[i].tenant->stats.evicted++;
+				count++;
+			}
+		}
+	}
+	mosquitto_free(ranks);
+
+	for(i=0; i<count; i++){
+		mosquitto_kick_client_by_clientid(ids[i], false);
+		mosquitto_free(ids[i]);
+	}
+	mosquitto_free(ids);
+	return count;
+}
+
+static int evict_tick_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_tick *ed = event_data;
+	uint64_t rss;
+	unsigned int count;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->now_s < evict_next){
+		return MOSQ_ERR_SUCCESS;
+	}
+	evict_next = ed->now_s + 1;
+
+	rss = memory_rss();
+	if(rss == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(!evicting){
+		if(rss < memory_high){
+			return MOSQ_ERR_SUCCESS;
+		}
+		evicting = true;
+		mosquitto_log_printf(MOSQ_LOG_WARNING, PLUGIN_NAME ": Memory use of %llu MB is over memory_high, evicting idle clients.",
+				(unsigned long long)(rss >> 20));
+	}else if(rss <= memory_low){
+		evicting = false;
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, PLUGIN_NAME ": Memory use of %llu MB is under memory_low, eviction stopped.",
+				(unsigned long long)(rss >> 20));
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	count = evict_round();
+	if(count){
+		mosquitto_log_printf(MOSQ_LOG_NOTICE, PLUGIN_NAME ": Evicted %u idle clients.", count);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool evict_enabled(void)
+{
+	return memory_high > 0;
+}
+
+int evict_init(struct mosquitto_opt *opts, int opt_count)
+{
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "memory_high")){
+			if(parse_size(opts[i].value, &memory_high)){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid value '%s' for memory_high.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "memory_low")){
+			if(parse_size(opts[i].value, &memory_low)){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid value '%s' for memory_low.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "memory_evict_batch")){
+			if(atoi(opts[i].value) < 1){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": memory_evict_batch must be 1 or greater.");
+				return MOSQ_ERR_INVAL;
+			}
+			evict_batch = (uint32_t)atoi(opts[i].value);
+		}else if(!strcasecmp(opts[i].key, "memory_evict_score")){
+			evict_min_score = atof(opts[i].value);
+			if(evict_min_score < 0){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": memory_evict_score must be 0 or greater.");
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "memory_evict_idle")){
+			if(atoi(opts[i].value) < 0){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": memory_evict_idle must be 0 or greater.");
+				return MOSQ_ERR_INVAL;
+			}
+			evict_idle_ns = (uint64_t)(unsigned int)atoi(opts[i].value) * 1000000000ULL;
+		}
+	}
+	if(memory_high == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(memory_low == 0){
+		memory_low = memory_high - memory_high/10;
+	}
+	if(memory_low >= memory_high){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": memory_low must be less than memory_high.");
+		return MOSQ_ERR_INVAL;
+	}
+
+	statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	if(statm_fd < 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open /proc/self/statm, memory_high needs Linux.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+
+	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, evict_tick_callback, NULL, NULL);
+}
+
+void evict_cleanup(void)
+{
+	if(statm_fd >= 0){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, evict_tick_callback, NULL);
+		close(statm_fd);
+		statm_fd = -1;
+	}
+	memory_high = 0;
+	memory_low = 0;
+	evict_batch = EVICT_DEFAULT_BATCH;
+	evict_min_score = EVICT_DEFAULT_SCORE;
+	evict_idle_ns = (uint64_t)EVICT_DEFAULT_IDLE * 1000000000ULL;
+	evict_next = 0;
+	evicting = false;
+}
@@ -0,0 +1,576 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant limits.
+ *
+ * The default limits are set with plugin_opt_<limit> options. Individual
+ * tenants can override them in a file given by plugin_opt_tenant_config, in
+ * the same style as the broker's acl file:
+ *
+ *   # comment
+ *   tenant foo
+ *   rate_msgs 100
+ *   client_rate_msgs 10
+ *
+ * Only the values that differ from the defaults need to be listed. Each
+ * override records which limits were given, and takes the rest from the
+ * defaults, including when those are changed at runtime.
+ *
+ * A section can also give the tenant a "prefix_id", the number used for its
+ * topic prefix when plugin_opt_tenant_prefix is "id". These have to be
+ * configured rather than allocated so that they stay the same across broker
+ * restarts, otherwise retained and persisted messages would move between
+ * tenants.
+ *
+ * "node" pins the tenant to a node of the cluster, see placement.c.
+ *
+ * The limits can also be changed, and tenants turned off, at runtime through
+ * the control topic. Those changes are not written back to the file.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+struct tenant_override {
+	struct tenant_override *next;
+	char *name;
+	size_t name_len;
+	uint32_t hash;
+	int32_t prefix_id;
+	char *node;
+	uint32_t set_mask; /* bit i set if limit_fields[i] was given for this tenant */
+	struct tenant_limits limits;
+};
+
+#define OVERRIDE_TABLE_SIZE 256
+
+static struct tenant_limits default_limits;
+static uint32_t max_tenants = 0;
+static bool connections_limited = false;
+static bool subscriptions_limited = false;
+static bool downsampling = false;
+static bool queue_limited = false;
+static struct tenant_override *override_table[OVERRIDE_TABLE_SIZE];
+static uint64_t prefix_id_used[(TENANT_PREFIX_ID_MAX+1)/64];
+
+static int parse_u32(const char *value, uint32_t *out)
+{
+	char *endptr;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(value, &endptr, 10);
+	if(errno || endptr == value || *endptr != 0 || v > UINT32_MAX || value[0] == '-'){
+		return MOSQ_ERR_INVAL;
+	}
+	*out = (uint32_t)v;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void limits_update(struct tenant_limits *l)
+{
+	l->rate_enabled = l->rate_msgs || l->rate_bytes || l->client_rate_msgs || l->client_rate_bytes;
+	l->subs_enabled = l->max_subscriptions || l->max_wildcard_subscriptions || l->max_subscription_depth;
+}
+
+struct limit_field {
+	const char *name;
+	size_t offset;
+};
+
+static const struct limit_field limit_fields[] = {
+	{"rate_msgs", offsetof(struct tenant_limits, rate_msgs)},
+	{"rate_bytes", offsetof(struct tenant_limits, rate_bytes)},
+	{"client_rate_msgs", offsetof(struct tenant_limits, client_rate_msgs)},
+	{"client_rate_bytes", offsetof(struct tenant_limits, client_rate_bytes)},
+	{"max_connections", offsetof(struct tenant_limits, max_connections)},
+	{"max_subscriptions", offsetof(struct tenant_limits, max_subscriptions)},
+	{"max_wildcard_subscriptions", offsetof(struct tenant_limits, max_wildcard_subscriptions)},
+	{"max_subscription_depth", offsetof(struct tenant_limits, max_subscription_depth)},
+	{"max_payload_size", offsetof(struct tenant_limits, max_payload_size)},
+	{"max_retained_msgs", offsetof(struct tenant_limits, max_retained_msgs)},
+	{"max_retained_bytes", offsetof(struct tenant_limits, max_retained_bytes)},
+	{"downsample_interval", offsetof(struct tenant_limits, downsample_interval)},
+	{"max_queued_bytes", offsetof(struct tenant_limits, max_queued_bytes)},
+	{"tap_sample", offsetof(struct tenant_limits, tap_sample)},
+};
+#define LIMIT_FIELD_COUNT (sizeof(limit_fields)/sizeof(limit_fields[0]))
+
+/* Set a single limit by name, and mark it in *set_mask if that isn't NULL.
+ * Returns MOSQ_ERR_NOT_FOUND if the key is not a limit. */
+static int limits_set(struct tenant_limits *l, uint32_t *set_mask, const char *key, const char *value)
+{
+	uint32_t *field = NULL;
+	size_t i;
+
+	for(i=0; i<LIMIT_FIELD_COUNT; i++){
+		if(!strcasecmp(key, limit_fields[i].name)){
+			field = (uint32_t *)((char *)l + limit_fields[i].offset);
+			break;
+		}
+	}
+	if(field == NULL){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+
+	if(parse_u32(value, field)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid value '%s' for %s.", value, key);
+		return MOSQ_ERR_INVAL;
+	}
+	if(set_mask){
+		*set_mask |= (uint32_t)1 << i;
+	}
+	limits_update(l);
+	if(l->max_connections){
+		connections_limited = true;
+	}
+	if(l->subs_enabled){
+		subscriptions_limited = true;
+	}
+	if(l->downsample_interval){
+		downsampling = true;
+	}
+	if(l->max_queued_bytes){
+		queue_limited = true;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Take the limits that weren't given for the tenant from the defaults */
+static void override_resolve(struct tenant_override *o)
+{
+	size_t i;
+
+	for(i=0; i<LIMIT_FIELD_COUNT; i++){
+		if(!(o->set_mask & ((uint32_t)1 << i))){
+			*(uint32_t *)((char *)&o->limits + limit_fields[i].offset) =
+					*(const uint32_t *)((const char *)&default_limits + limit_fields[i].offset);
+		}
+	}
+	limits_update(&o->limits);
+}
+
+static void override_resolve_all(void)
+{
+	struct tenant_override *o;
+	int i;
+
+	for(i=0; i<OVERRIDE_TABLE_SIZE; i++){
+		for(o=override_table[i]; o; o=o->next){
+			override_resolve(o);
+		}
+	}
+}
+
+static struct tenant_override *override_find(const char *name, size_t name_len, uint32_t hash)
+{
+	struct tenant_override *o;
+
+	for(o=override_table[hash % OVERRIDE_TABLE_SIZE]; o; o=o->next){
+		if(o->hash == hash && o->name_len == name_len && !memcmp(o->name, name, name_len)){
+			return o;
+		}
+	}
+	return NULL;
+}
+
+static struct tenant_override *override_add(const char *name)
+{
+	struct tenant_override *o;
+	size_t name_len = strlen(name);
+	uint32_t hash = mt_hash(name, name_len);
+
+	o = override_find(name, name_len, hash);
+	if(o){
+		return o;
+	}
+
+	o = mosquitto_calloc(1, sizeof(struct tenant_override));
+	if(o == NULL){
+		return NULL;
+	}
+	o->name = mosquitto_strdup(name);
+	if(o->name == NULL){
+		mosquitto_free(o);
+		return NULL;
+	}
+	o->name_len = name_len;
+	o->hash = hash;
+	o->prefix_id = -1;
+	o->limits = default_limits;
+
+	o->next = override_table[hash % OVERRIDE_TABLE_SIZE];
+	override_table[hash % OVERRIDE_TABLE_SIZE] = o;
+	return o;
+}
+
+static char *strip(char *s)
+{
+	char *end;
+
+	while(*s == ' ' || *s == '\t'){
+		s++;
+	}
+	end = s + strlen(s);
+	while(end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')){
+		end--;
+	}
+	*end = 0;
+	return s;
+}
+
+static int limits_load_file(const char *path)
+{
+	FILE *fptr;
+	char buf[1024];
+	char *line, *key, *value;
+	struct tenant_override *o = NULL;
+	int lineno = 0;
+	int rc;
+
+	fptr = fopen(path, "rt");
+	if(fptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open tenant_config file '%s'.", path);
+		return MOSQ_ERR_INVAL;
+	}
+
+	while(fgets(buf, sizeof(buf), fptr)){
+		lineno++;
+		line = strip(buf);
+		if(line[0] == 0 || line[0] == '#'){
+			continue;
+		}
+
+		key = line;
+		value = key + strcspn(key, " \t");
+		if(*value){
+			*value = 0;
+			value = strip(value + 1);
+		}
+		if(*value == 0){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Missing value for '%s'.", path, lineno, key);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+
+		if(!strcasecmp(key, "tenant")){
+			o = override_add(value);
+			if(o == NULL){
+				fclose(fptr);
+				return MOSQ_ERR_NOMEM;
+			}
+			continue;
+		}
+		if(o == NULL){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: '%s' outside of a tenant section.", path, lineno, key);
+			fclose(fptr);
+			return MOSQ_ERR_INVAL;
+		}
+		if(!strcasecmp(key, "prefix_id")){
+			uint32_t id;
+
+			if(parse_u32(value, &id) || id > TENANT_PREFIX_ID_MAX){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: prefix_id must be between 0 and %d.", path, lineno, TENANT_PREFIX_ID_MAX);
+				fclose(fptr);
+				return MOSQ_ERR_INVAL;
+			}
+			if(o->prefix_id != (int32_t)id && (prefix_id_used[id/64] & ((uint64_t)1 << (id%64)))){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: prefix_id %u is already in use.", path, lineno, id);
+				fclose(fptr);
+				return MOSQ_ERR_INVAL;
+			}
+			if(o->prefix_id >= 0){
+				prefix_id_used[o->prefix_id/64] &= ~((uint64_t)1 << (o->prefix_id%64));
+			}
+			prefix_id_used[id/64] |= (uint64_t)1 << (id%64);
+			o->prefix_id = (int32_t)id;
+			continue;
+		}
+		if(!strcasecmp(key, "node")){
+			mosquitto_free(o->node);
+			o->node = mosquitto_strdup(value);
+			if(o->node == NULL){
+				fclose(fptr);
+				return MOSQ_ERR_NOMEM;
+			}
+			continue;
+		}
+		rc = limits_set(&o->limits, &o->set_mask, key, value);
+		if(rc == MOSQ_ERR_NOT_FOUND){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Unknown option '%s'.", path, lineno, key);
+			rc = MOSQ_ERR_INVAL;
+		}
+		if(rc){
+			fclose(fptr);
+			return rc;
+		}
+	}
+	fclose(fptr);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+const struct tenant_limits *limits_find(const char *name, size_t name_len)
+{
+	struct tenant_override *o;
+
+	o = override_find(name, name_len, mt_hash(name, name_len));
+	if(o){
+		return &o->limits;
+	}
+	return &default_limits;
+}
+
+int32_t limits_prefix_id(const char *name, size_t name_len)
+{
+	struct tenant_override *o;
+
+	o = override_find(name, name_len, mt_hash(name, name_len));
+	if(o){
+		return o->prefix_id;
+	}
+	return -1;
+}
+
+/* Apply "key=value" settings to the limits of a tenant, or to the defaults
+ * if name is NULL, and turn the tenant on if enable is set. Every setting is
+ * checked, and the override allocated, before anything is changed, so either
+ * all of it takes effect or none does. Returns MOSQ_ERR_NOT_FOUND for an
+ * unknown limit. */
+static int limits_tenant_apply(const char *name, int count, char **settings, bool enable)
+{
+	struct tenant_limits new_limits;
+	struct tenant_override *o = NULL;
+	uint32_t new_mask = 0;
+	char key[64];
+	const char *value;
+	size_t key_len;
+	int i, rc;
+
+	if(name){
+		o = override_find(name, strlen(name), mt_hash(name, strlen(name)));
+	}
+	new_limits = o ? o->limits : default_limits;
+	new_limits.disabled = o ? o->limits.disabled : false;
+
+	for(i=0; i<count; i++){
+		value = strchr(settings[i], '=');
+		if(value == NULL){
+			return MOSQ_ERR_INVAL;
+		}
+		key_len = (size_t)(value - settings[i]);
+		if(key_len >= sizeof(key)){
+			return MOSQ_ERR_NOT_FOUND;
+		}
+		memcpy(key, settings[i], key_len);
+		key[key_len] = 0;
+		rc = limits_set(&new_limits, &new_mask, key, value + 1);
+		if(rc){
+			return rc;
+		}
+	}
+
+	if(name == NULL){
+		default_limits = new_limits;
+		override_resolve_all();
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(o == NULL){
+		if(count == 0){
+			/* Nothing to record, the tenant follows the defaults */
+			return MOSQ_ERR_SUCCESS;
+		}
+		o = override_add(name);
+		if(o == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	o->limits = new_limits;
+	o->set_mask |= new_mask;
+	if(enable){
+		o->limits.disabled = false;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int limits_tenant_set(const char *name, int count, char **settings)
+{
+	return limits_tenant_apply(name, count, settings, false);
+}
+
+int limits_tenant_add(const char *name, int count, char **settings)
+{
+	return limits_tenant_apply(name, count, settings, true);
+}
+
+/* Turn a tenant off, so that its clients are refused, or back on. */
+int limits_tenant_enable(const char *name, bool enabled)
+{
+	struct tenant_override *o;
+
+	o = override_find(name, strlen(name), mt_hash(name, strlen(name)));
+	if(o == NULL){
+		if(enabled){
+			return MOSQ_ERR_SUCCESS;
+		}
+		o = override_add(name);
+		if(o == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	o->limits.disabled = !enabled;
+	if(!enabled){
+		connections_limited = true;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Write the limits of a tenant, or the defaults if name is NULL, as
+ * "\nkey value" lines. */
+void limits_format(const char *name, char *buf, size_t len)
+{
+	const struct tenant_limits *l = &default_limits;
+	size_t i, n = 0;
+	int rc;
+
+	buf[0] = 0;
+	if(name){
+		l = limits_find(name, strlen(name));
+	}
+	for(i=0; i<LIMIT_FIELD_COUNT && n<len; i++){
+		rc = snprintf(buf + n, len - n, "\n%s %u", limit_fields[i].name,
+				*(const uint32_t *)((const char *)l + limit_fields[i].offset));
+		if(rc < 0){
+			break;
+		}
+		n += (size_t)rc;
+	}
+	if(l->disabled && n < len){
+		snprintf(buf + n, len - n, "\ndisabled");
+	}
+}
+
+/* The cluster node a tenant is pinned to, or NULL. */
+const char *limits_node(const char *name, size_t name_len)
+{
+	struct tenant_override *o;
+
+	o = override_find(name, name_len, mt_hash(name, name_len));
+	if(o){
+		return o->node;
+	}
+	return NULL;
+}
+
+/* Call check for every tenant that is pinned to a node, stopping at the
+ * first error. */
+int limits_check_nodes(int (*check)(const char *tenant, const char *node))
+{
+	struct tenant_override *o;
+	int i, rc;
+
+	for(i=0; i<OVERRIDE_TABLE_SIZE; i++){
+		for(o=override_table[i]; o; o=o->next){
+			if(o->node){
+				rc = check(o->name, o->node);
+				if(rc) return rc;
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+uint32_t limits_max_tenants(void)
+{
+	return max_tenants;
+}
+
+bool limits_connections_limited(void)
+{
+	return connections_limited || max_tenants;
+}
+
+bool limits_subscriptions_limited(void)
+{
+	return subscriptions_limited;
+}
+
+bool limits_downsampling(void)
+{
+	return downsampling;
+}
+
+bool limits_queue_limited(void)
+{
+	return queue_limited;
+}
+
+int limits_init(struct mosquitto_opt *opts, int opt_count)
+{
+	const char *config_file = NULL;
+	int i, rc;
+
+	memset(&default_limits, 0, sizeof(default_limits));
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "tenant_config")){
+			config_file = opts[i].value;
+			continue;
+		}else if(!strcasecmp(opts[i].key, "max_tenants")){
+			if(parse_u32(opts[i].value, &max_tenants)){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid value '%s' for max_tenants.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
+			continue;
+		}
+		rc = limits_set(&default_limits, NULL, opts[i].key, opts[i].value);
+		if(rc && rc != MOSQ_ERR_NOT_FOUND){
+			return rc;
+		}
+	}
+
+	if(config_file){
+		return limits_load_file(config_file);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void limits_cleanup(void)
+{
+	struct tenant_override *o, *next;
+	int i;
+
+	for(i=0; i<OVERRIDE_TABLE_SIZE; i++){
+		for(o=override_table[i]; o; o=next){
+			next = o->next;
+			mosquitto_free(o->name);
+			mosquitto_free(o->node);
+			mosquitto_free(o);
+		}
+		override_table[i] = NULL;
+	}
+	memset(prefix_id_used, 0, sizeof(prefix_id_used));
+	max_tenants = 0;
+	connections_limited = false;
+	subscriptions_limited = false;
+	downsampling = false;
+	queue_limited = false;
+}
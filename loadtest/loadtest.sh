@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+# End-to-end load test for the multi-tenant plugin.
+#
+# Generates a password file, acl file and broker configs for TENANTS x USERS
+# users, then runs the mt_load generator against the broker twice: once with
+# the plugin loaded and once without it. For each run the throughput,
+# p50/p99/p999 delivery latency and broker peak RSS are reported.
+#
+# All settings are environment variables, e.g.
+#
+#   TENANTS=100 USERS=20 RATE=20000 SHARED=50 ./loadtest/loadtest.sh
+#
+# Set ACL=1 to also load a generated acl file, in the same style as the
+# top level acl file.
+
+set -e
+
+MOSQUITTO_SRC=${MOSQUITTO_SRC:-../mosquitto}
+BROKER=${BROKER:-${MOSQUITTO_SRC}/src/mosquitto}
+MOSQUITTO_PASSWD=${MOSQUITTO_PASSWD:-${MOSQUITTO_SRC}/apps/mosquitto_passwd/mosquitto_passwd}
+PLUGIN=${PLUGIN:-$(pwd)/mosquitto_multi_tenant.so}
+LOAD=${LOAD:-$(pwd)/loadtest/mt_load}
+
+PORT=${PORT:-1890}
+TENANTS=${TENANTS:-10}
+USERS=${USERS:-10}
+PUBLISHERS=${PUBLISHERS:-1}
+RATE=${RATE:-1000}
+SIZE=${SIZE:-64}
+QOS=${QOS:-0}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+SHARED=${SHARED:-0}
+SHARE_GROUPS=${SHARE_GROUPS:-1}
+PASSWORD=${PASSWORD:-password}
+ACL=${ACL:-0}
+MODES=${MODES:-"plugin noplugin"}
+
+for f in "${BROKER}" "${MOSQUITTO_PASSWD}" "${PLUGIN}" "${LOAD}"; do
+	if [ ! -x "$f" ] && [ ! -f "$f" ]; then
+		echo "Error: $f not found, run 'make loadtest' and check MOSQUITTO_SRC." >&2
+		exit 1
+	fi
+done
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "${WORKDIR}"' EXIT
+
+# Hash the whole password file in one pass rather than running
+# mosquitto_passwd once per user.
+echo "Generating ${TENANTS} tenants x ${USERS} users in ${WORKDIR}"
+t=0
+while [ $t -lt "${TENANTS}" ]; do
+	u=0
+	while [ $u -lt "${USERS}" ]; do
+		echo "user$u@tenant$t:${PASSWORD}"
+		u=$((u+1))
+	done
+	t=$((t+1))
+done > "${WORKDIR}/passwd"
+"${MOSQUITTO_PASSWD}" -U "${WORKDIR}/passwd"
+
+# acl files for both modes. With the plugin, writes are checked against the
+# original topic and reads against the prefixed topic.
+t=0
+while [ $t -lt "${TENANTS}" ]; do
+	u=0
+	while [ $u -lt "${USERS}" ]; do
+		printf 'user user%s@tenant%s\ntopic write load/#\ntopic read tenant%s/load/#\n\n' $u $t $t >> "${WORKDIR}/acl.plugin"
+		printf 'user user%s@tenant%s\ntopic readwrite tenant%s/load/#\n\n' $u $t $t >> "${WORKDIR}/acl.noplugin"
+		u=$((u+1))
+	done
+	t=$((t+1))
+done
+
+write_conf()
+{
+	mode=$1
+	conf="${WORKDIR}/${mode}.conf"
+	echo "listener ${PORT}" > "${conf}"
+	if [ "${mode}" = "plugin" ]; then
+		echo "plugin ${PLUGIN}" >> "${conf}"
+		echo "plugin_opt_regex ^[a-z0-9]+@([a-z0-9]+)$" >> "${conf}"
+	fi
+	echo "allow_anonymous false" >> "${conf}"
+	echo "password_file ${WORKDIR}/passwd" >> "${conf}"
+	if [ "${ACL}" = "1" ]; then
+		echo "acl_file ${WORKDIR}/acl.${mode}" >> "${conf}"
+	fi
+	echo "max_queued_messages 100000" >> "${conf}"
+}
+
+run()
+{
+	mode=$1
+	write_conf "${mode}"
+
+	"${BROKER}" -c "${WORKDIR}/${mode}.conf" > "${WORKDIR}/${mode}.log" 2>&1 &
+	broker_pid=$!
+	sleep 1
+	if ! kill -0 ${broker_pid} 2>/dev/null; then
+		echo "Error: broker failed to start, see below." >&2
+		cat "${WORKDIR}/${mode}.log" >&2
+		exit 1
+	fi
+
+	extra=""
+	if [ "${mode}" = "noplugin" ]; then
+		extra="-x"
+	fi
+
+	result=$("${LOAD}" -p "${PORT}" -t "${TENANTS}" -u "${USERS}" -P "${PUBLISHERS}" \
+		-r "${RATE}" -s "${SIZE}" -q "${QOS}" -d "${DURATION}" -w "${WARMUP}" \
+		-S "${SHARED}" -g "${SHARE_GROUPS}" -k "${PASSWORD}" ${extra}) || result="failed"
+
+	rss=$(awk '/VmRSS/ {print $2}' /proc/${broker_pid}/status)
+	hwm=$(awk '/VmHWM/ {print $2}' /proc/${broker_pid}/status)
+	kill ${broker_pid}
+	wait ${broker_pid} 2>/dev/null || true
+
+	printf '%-9s %s rss_kb=%s peak_rss_kb=%s\n' "${mode}" "${result}" "${rss}" "${hwm}"
+}
+
+echo "tenants=${TENANTS} users=${USERS} publishers=${PUBLISHERS} rate=${RATE} size=${SIZE} qos=${QOS} shared=${SHARED}% acl=${ACL}"
+for mode in ${MODES}; do
+	run "${mode}"
+done
@@ -0,0 +1,388 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Load generator for the multi-tenant plugin.
+ *
+ * Connects N tenants x M users to a broker, with the first users of each
+ * tenant publishing and the rest subscribing, optionally through $share/
+ * groups. Each payload carries its send time, so subscribers can record the
+ * delivery latency. At the end the throughput and the p50/p99/p999 latency
+ * are printed.
+ *
+ * When the broker runs without the plugin, use -x so that the generator puts
+ * the tenant on the front of each topic itself and the routing work done by
+ * the broker is the same in both runs.
+ *
+ * This is normally run through loadtest/loadtest.sh.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+
+#define UNUSED(A) (void)(A)
+
+/* Latency histogram: values are in ns, bucketed with 16 sub-buckets per
+ * power of two, so the reported percentiles are within ~6%. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS (64*HIST_SUB)
+
+static uint64_t histogram[HIST_BUCKETS];
+static uint64_t received = 0;
+static uint64_t sent = 0;
+static volatile int running = 1;
+static volatile int measuring = 0;
+
+static struct {
+	const char *host;
+	int port;
+	unsigned int tenants;
+	unsigned int users;
+	unsigned int publishers;
+	unsigned int rate;
+	unsigned int payload_size;
+	unsigned int duration;
+	unsigned int warmup;
+	unsigned int shared_percent;
+	unsigned int groups;
+	int qos;
+	bool prefix_topics;
+	const char *password;
+} cfg = {
+	.host = "localhost",
+	.port = 1883,
+	.tenants = 10,
+	.users = 10,
+	.publishers = 1,
+	.rate = 1000,
+	.payload_size = 64,
+	.duration = 10,
+	.warmup = 2,
+	.shared_percent = 0,
+	.groups = 1,
+	.qos = 0,
+	.prefix_topics = false,
+	.password = "password",
+};
+
+struct client {
+	struct mosquitto *mosq;
+	unsigned int tenant;
+	unsigned int user;
+	bool publisher;
+	bool connected;
+	char topic[128];
+};
+
+static struct client *clients = NULL;
+static unsigned int client_count = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if(v < HIST_SUB){
+		return (unsigned int)v;
+	}
+	msb = 63 - (unsigned int)__builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1)*HIST_SUB + (unsigned int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB-1));
+}
+
+static uint64_t hist_value(unsigned int bucket)
+{
+	unsigned int major = bucket / HIST_SUB;
+	uint64_t minor = bucket % HIST_SUB;
+
+	if(major == 0){
+		return minor;
+	}
+	return (HIST_SUB + minor) << (major - 1);
+}
+
+static uint64_t hist_percentile(uint64_t total, double pc)
+{
+	uint64_t target = (uint64_t)((double)total * pc / 100.0);
+	uint64_t count = 0;
+	unsigned int i;
+
+	for(i=0; i<HIST_BUCKETS; i++){
+		count += histogram[i];
+		if(count > target){
+			return hist_value(i);
+		}
+	}
+	return 0;
+}
+
+static void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct client *c = obj;
+	char filter[160];
+	char prefix[64] = "";
+
+	if(rc){
+		fprintf(stderr, "Error: tenant%u user%u connect failed: %s\n", c->tenant, c->user, mosquitto_strerror(rc));
+		return;
+	}
+	c->connected = true;
+	if(c->publisher){
+		return;
+	}
+
+	if(cfg.prefix_topics){
+		snprintf(prefix, sizeof(prefix), "tenant%u/", c->tenant);
+	}
+	if(cfg.shared_percent && (c->user * 100 / cfg.users) < cfg.shared_percent){
+		snprintf(filter, sizeof(filter), "$share/g%u/%sload/#", c->user % cfg.groups, prefix);
+	}else{
+		snprintf(filter, sizeof(filter), "%sload/#", prefix);
+	}
+	mosquitto_subscribe(mosq, NULL, filter, cfg.qos);
+}
+
+static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	uint64_t sent_ns, latency;
+
+	UNUSED(mosq);
+	UNUSED(obj);
+
+	if(!measuring || msg->payloadlen < (int)sizeof(uint64_t)){
+		return;
+	}
+	memcpy(&sent_ns, msg->payload, sizeof(sent_ns));
+	latency = now_ns() - sent_ns;
+	__atomic_fetch_add(&histogram[hist_bucket(latency)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&received, 1, __ATOMIC_RELAXED);
+}
+
+static int clients_start(void)
+{
+	unsigned int t, u, i;
+	char id[64], username[64];
+	struct client *c;
+	int rc;
+
+	client_count = cfg.tenants * cfg.users;
+	clients = calloc(client_count, sizeof(struct client));
+	if(clients == NULL){
+		return 1;
+	}
+
+	for(t=0; t<cfg.tenants; t++){
+		for(u=0; u<cfg.users; u++){
+			i = t*cfg.users + u;
+			c = &clients[i];
+			c->tenant = t;
+			c->user = u;
+			c->publisher = u < cfg.publishers;
+			if(cfg.prefix_topics){
+				snprintf(c->topic, sizeof(c->topic), "tenant%u/load/%u/data", t, u);
+			}else{
+				snprintf(c->topic, sizeof(c->topic), "load/%u/data", u);
+			}
+
+			snprintf(id, sizeof(id), "load-%u-%u", t, u);
+			snprintf(username, sizeof(username), "user%u@tenant%u", u, t);
+			c->mosq = mosquitto_new(id, true, c);
+			if(c->mosq == NULL){
+				return 1;
+			}
+			mosquitto_int_option(c->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+			mosquitto_username_pw_set(c->mosq, username, cfg.password);
+			mosquitto_connect_callback_set(c->mosq, on_connect);
+			mosquitto_message_callback_set(c->mosq, on_message);
+			rc = mosquitto_connect(c->mosq, cfg.host, cfg.port, 60);
+			if(rc){
+				fprintf(stderr, "Error: %s connect: %s\n", username, mosquitto_strerror(rc));
+				return 1;
+			}
+			mosquitto_loop_start(c->mosq);
+		}
+	}
+	return 0;
+}
+
+static void clients_stop(void)
+{
+	unsigned int i;
+
+	for(i=0; i<client_count; i++){
+		mosquitto_disconnect(clients[i].mosq);
+		mosquitto_loop_stop(clients[i].mosq, false);
+		mosquitto_destroy(clients[i].mosq);
+	}
+	free(clients);
+}
+
+/* Publish at cfg.rate messages/s in total, spread across all publishers. */
+static void *publish_thread(void *arg)
+{
+	unsigned int pub_count = cfg.tenants * cfg.publishers;
+	struct client **pubs;
+	unsigned int i, p = 0;
+	uint64_t interval_ns, next;
+	struct timespec ts;
+	uint8_t *payload;
+
+	UNUSED(arg);
+
+	pubs = calloc(pub_count, sizeof(struct client *));
+	payload = calloc(1, cfg.payload_size);
+	if(pubs == NULL || payload == NULL){
+		return NULL;
+	}
+	for(i=0; i<client_count; i++){
+		if(clients[i].publisher){
+			pubs[p++] = &clients[i];
+		}
+	}
+
+	interval_ns = 1000000000ULL / cfg.rate;
+	next = now_ns();
+	p = 0;
+	while(running){
+		uint64_t t = now_ns();
+
+		if(t < next){
+			ts.tv_sec = 0;
+			ts.tv_nsec = (long)(next - t);
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		memcpy(payload, &t, sizeof(t));
+		if(mosquitto_publish(pubs[p]->mosq, NULL, pubs[p]->topic, (int)cfg.payload_size, payload, cfg.qos, false) == MOSQ_ERR_SUCCESS
+				&& measuring){
+
+			sent++;
+		}
+		p = (p + 1) % pub_count;
+		next += interval_ns;
+	}
+	free(payload);
+	free(pubs);
+	return NULL;
+}
+
+static void print_usage(void)
+{
+	printf("mt_load - multi-tenant broker load generator\n\n");
+	printf("Usage: mt_load [-h host] [-p port] [-t tenants] [-u users] [-P publishers]\n");
+	printf("               [-r rate] [-s size] [-q qos] [-d duration] [-w warmup]\n");
+	printf("               [-S shared percent] [-g groups] [-k password] [-x]\n\n");
+	printf(" -t : tenants, default 10\n");
+	printf(" -u : users per tenant, default 10\n");
+	printf(" -P : publishing users per tenant, the rest subscribe, default 1\n");
+	printf(" -r : total publish rate in messages/s, default 1000\n");
+	printf(" -s : payload size in bytes, minimum 8, default 64\n");
+	printf(" -q : QoS for publish and subscribe, default 0\n");
+	printf(" -d : measurement duration in seconds, default 10\n");
+	printf(" -w : warmup in seconds before measuring, default 2\n");
+	printf(" -S : percentage of subscribers using $share/ groups, default 0\n");
+	printf(" -g : number of share groups per tenant, default 1\n");
+	printf(" -k : password for all users, default 'password'\n");
+	printf(" -x : prefix topics with the tenant in the client, for runs without the plugin\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t pub_thread;
+	unsigned int connected, i, wait;
+	int opt;
+
+	while((opt = getopt(argc, argv, "h:p:t:u:P:r:s:q:d:w:S:g:k:x")) != -1){
+		switch(opt){
+			case 'h': cfg.host = optarg; break;
+			case 'p': cfg.port = atoi(optarg); break;
+			case 't': cfg.tenants = (unsigned int)atoi(optarg); break;
+			case 'u': cfg.users = (unsigned int)atoi(optarg); break;
+			case 'P': cfg.publishers = (unsigned int)atoi(optarg); break;
+			case 'r': cfg.rate = (unsigned int)atoi(optarg); break;
+			case 's': cfg.payload_size = (unsigned int)atoi(optarg); break;
+			case 'q': cfg.qos = atoi(optarg); break;
+			case 'd': cfg.duration = (unsigned int)atoi(optarg); break;
+			case 'w': cfg.warmup = (unsigned int)atoi(optarg); break;
+			case 'S': cfg.shared_percent = (unsigned int)atoi(optarg); break;
+			case 'g': cfg.groups = (unsigned int)atoi(optarg); break;
+			case 'k': cfg.password = optarg; break;
+			case 'x': cfg.prefix_topics = true; break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if(cfg.tenants == 0 || cfg.users == 0 || cfg.publishers == 0 || cfg.publishers > cfg.users
+			|| cfg.rate == 0 || cfg.payload_size < sizeof(uint64_t) || cfg.groups == 0
+			|| cfg.qos < 0 || cfg.qos > 2){
+
+		print_usage();
+		return 1;
+	}
+
+	mosquitto_lib_init();
+	if(clients_start()){
+		fprintf(stderr, "Error: Unable to start clients.\n");
+		return 1;
+	}
+
+	/* Wait up to 30s for everyone to connect */
+	for(wait=0; wait<300; wait++){
+		connected = 0;
+		for(i=0; i<client_count; i++){
+			if(clients[i].connected) connected++;
+		}
+		if(connected == client_count) break;
+		usleep(100000);
+	}
+	if(connected != client_count){
+		fprintf(stderr, "Error: Only %u of %u clients connected.\n", connected, client_count);
+		return 1;
+	}
+
+	pthread_create(&pub_thread, NULL, publish_thread, NULL);
+	sleep(cfg.warmup);
+	measuring = 1;
+	sleep(cfg.duration);
+	measuring = 0;
+	running = 0;
+	pthread_join(pub_thread, NULL);
+
+	printf("sent=%llu received=%llu throughput=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f\n",
+			(unsigned long long)sent, (unsigned long long)received,
+			(double)received / cfg.duration,
+			(double)hist_percentile(received, 50.0)/1000.0,
+			(double)hist_percentile(received, 99.0)/1000.0,
+			(double)hist_percentile(received, 99.9)/1000.0);
+
+	clients_stop();
+	mosquitto_lib_cleanup();
+
+	return 0;
+}
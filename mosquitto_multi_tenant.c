@@ -27,9 +27,19 @@ Contributors:
  * with a default '[a-z0-9]+@([a-z0-9]+)'
  * 
  * e.g. username 'foo@bar' would give a team of 'bar'
+ *
+ * plugin_opt_regex may be given more than once, the regexes are tried in
+ * order and the first match wins.
+ *
+ * Alternatively, plugin_opt_tenant_delimiter selects a regex free mode that
+ * splits the username on a single delimiter character, and
+ * plugin_opt_tenant_map maps individual usernames to tenants before either
+ * is tried.
  * 
  * Compile with:
- *   gcc -I<path to mosquitto-repo/include> -fPIC -shared mosquitto_multi_tenant.c -o mosquitto_multi_tenant.so
+ *   gcc -I<path to mosquitto-repo/include> -fPIC -shared mosquitto_multi_tenant.c *.c -o mosquitto_multi_tenant.so
+ *
+ * or just run make.
  *
  * Use in config with:
  *
@@ -37,122 +47,1108 @@ Contributors:
  *
  * Note that this only works on Mosquitto 2.1 or later.
  */
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <regex.h>
 
 #include "mosquitto.h"
+#include "mqtt_protocol.h"
+#include "mosquitto_multi_tenant.h"
 
-#define PLUGIN_NAME "multi-tenant"
 #define PLUGIN_VERSION "1.1.0"
 
-#define UNUSED(A) (void)(A)
-
 MOSQUITTO_PLUGIN_DECLARE_VERSION(5);
 
-static mosquitto_plugin_id_t *mosq_pid = NULL;
+mosquitto_plugin_id_t *mosq_pid = NULL;
+
+/* Regex rules, tried in the order they were configured. Each rule has a
+ * literal prefilter pulled out of its pattern - characters that any match
+ * must contain, and an anchored literal prefix - so that usernames which
+ * cannot match are rejected without running regexec(). */
+#define TENANT_RULE_PREFIX_MAX 16
+
+struct tenant_rule {
+	regex_t re;
+	uint64_t required[4]; /* bitmap of bytes that must appear */
+	char prefix[TENANT_RULE_PREFIX_MAX];
+	size_t prefix_len;
+};
+
+static struct tenant_rule *tenant_rules = NULL;
+static int tenant_rule_count = 0;
+
+/* Delimiter mode: extract the team with a simple scanner rather than a regex,
+ * e.g. with a delimiter of '@' the username 'foo@bar' gives a team of 'bar'
+ * (tenant_side "right", the default) or 'foo' (tenant_side "left"). */
+static char tenant_delimiter = 0;
+static bool tenant_side_left = false;
+static bool tenant_charset[256];
+
+/* plugin_opt_tenant_prefix id: use "$t/<prefix_id>/" rather than "team/" as
+ * the topic prefix for tenants that have a prefix_id configured. */
+static bool tenant_prefix_id = false;
+
+/* plugin_opt_global_namespace: a topic tree shared by all tenants, e.g.
+ * "$global". Tenant subscriptions to it are left without the tenant prefix,
+ * so a single publish from a platform service reaches the subscribers of
+ * every tenant, and tenants can't publish to it. */
+static char *global_namespace = NULL;
+static size_t global_namespace_len = 0;
+
+#define TENANT_TABLE_MIN_SIZE 256
+
+static struct tenant **tenant_table = NULL;
+static size_t tenant_table_size = 0; /* always a power of two */
+static size_t tenant_count = 0;
+
+/* Tenants with short enough names come from a pool, see slab.c, room for
+ * the name and prefix is included in the pool object. */
+#define TENANT_POOL_NAMES 64
+static struct slab_pool tenant_pool;
+
+/* Tenants indexed by id, and a stack of ids released by freed tenants so that
+ * ids stay small. */
+struct tenant **tenant_by_id = NULL;
+uint32_t tenant_id_max = 0;
+static uint32_t *tenant_free_ids = NULL;
+static uint32_t tenant_free_id_count = 0;
+
+#define CLIENT_TABLE_MIN_SIZE 1024
+
+static struct team_client **client_table = NULL;
+static size_t client_table_size = 0; /* always a power of two */
+static size_t client_count = 0;
+static bool clients_tracked = false; /* keep the activity order up to date */
+static struct slab_pool client_pool;
+
+/* Outgoing fan-out memo.
+ *
+ * A message is usually delivered to many clients of the same tenant one after
+ * the other, with the broker calling the message out callback once per
+ * recipient for the same stored topic. Remember the result of the prefix check
+ * and the length of the stripped topic for the last message, so that the
+ * topic is only scanned once per message rather than once per recipient. The
+ * broker frees the topic we hand back after each delivery, so each recipient
+ * still gets its own copy. The memo is reset whenever a new message enters the
+ * broker, a subscription (and so a retained delivery) is made, or the plugin
+ * publishes a message itself.
+ *
+ * A stored message is freed once it has been delivered, and a message that
+ * did not come through message_in, such as a will, can get the same topic
+ * and payload addresses. Pointers alone are not enough, so a hit is only used
+ * if the prefix still matches and the topic is still the remembered length.
+ * When eviction is on, the memo also holds the time of the delivery, so the
+ * clock is read once per message rather than once per subscriber.
+ */
+#define OUT_MEMO_NO_MATCH SIZE_MAX
+
+static struct {
+	const char *topic;
+	const void *payload;
+	uint32_t payloadlen;
+	const struct tenant *tenant;
+	size_t stripped_len;
+	uint64_t now_ns;
+} out_memo;
+
+static void out_memo_reset(void)
+{
+	out_memo.topic = NULL;
+	out_memo.tenant = NULL;
+}
 
-static regex_t username_match;
-static regex_t shared_sub_match;
+int mt_publish_copy(const char *clientid, const char *topic, int payloadlen, const void *payload, int qos, bool retain,
+		mosquitto_property *properties)
+{
+	/* Delivered without going through message_in */
+	out_memo_reset();
+	return mosquitto_broker_publish_copy(clientid, topic, payloadlen, payload, qos, retain, properties);
+}
 
-static char* get_team( const char *str) {
-	regmatch_t pmatch[2];
-	char *team;
-	size_t size;
-
-	int result = regexec(&username_match, str, 2, pmatch, 0);
-	if (result == 0) {
-		size = (size_t)(pmatch[1].rm_eo - pmatch[1].rm_so);
-		team = mosquitto_malloc(size+1);
-		strncpy(team, str+pmatch[1].rm_so, size);
-		team[size] = 0;
-		return team;
-	} else {
+static int tenant_table_resize(size_t new_size)
+{
+	struct tenant **new_table;
+	struct tenant *t, *next;
+	size_t i, slot;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct tenant *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	for(i=0; i<tenant_table_size; i++){
+		for(t=tenant_table[i]; t; t=next){
+			next = t->next;
+			slot = t->hash & (new_size - 1);
+			t->next = new_table[slot];
+			new_table[slot] = t;
+		}
+	}
+	mosquitto_free(tenant_table);
+	tenant_table = new_table;
+	tenant_table_size = new_size;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct tenant *tenant_find(const char *name, size_t name_len)
+{
+	struct tenant *t;
+	uint32_t hash = mt_hash(name, name_len);
+
+	for(t=tenant_table[hash & (tenant_table_size - 1)]; t; t=t->next){
+		if(t->hash == hash && t->name_len == name_len && !memcmp(t->name, name, name_len)){
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static int tenant_id_alloc(uint32_t *id)
+{
+	struct tenant **new_by_id;
+	uint32_t *new_free_ids;
+	uint32_t new_max;
+
+	if(tenant_free_id_count > 0){
+		tenant_free_id_count--;
+		*id = tenant_free_ids[tenant_free_id_count];
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	new_max = tenant_id_max ? tenant_id_max*2 : TENANT_TABLE_MIN_SIZE;
+	new_by_id = mosquitto_realloc(tenant_by_id, new_max*sizeof(struct tenant *));
+	if(new_by_id == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	tenant_by_id = new_by_id;
+	new_free_ids = mosquitto_realloc(tenant_free_ids, new_max*sizeof(uint32_t));
+	if(new_free_ids == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	tenant_free_ids = new_free_ids;
+
+	/* Push the new ids in reverse so the lowest is handed out first */
+	for(uint32_t i=new_max; i>tenant_id_max; i--){
+		tenant_by_id[i-1] = NULL;
+		tenant_free_ids[tenant_free_id_count++] = i-1;
+	}
+	tenant_id_max = new_max;
+
+	tenant_free_id_count--;
+	*id = tenant_free_ids[tenant_free_id_count];
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void tenant_free(struct tenant *t)
+{
+	if(t->name_len + 1 + t->prefix_len + 1 <= TENANT_POOL_NAMES){
+		slab_free(&tenant_pool, t);
+	}else{
+		mosquitto_free(t);
+	}
+}
+
+/* Return the interned tenant for a name, creating it if needed. The caller
+ * holds a reference which must be released with tenant_release(). */
+static struct tenant *tenant_acquire(const char *name, size_t name_len)
+{
+	struct tenant *t;
+	size_t slot, prefix_len;
+	int32_t prefix_id = -1;
+
+	t = tenant_find(name, name_len);
+	if(t){
+		t->refcount++;
+		return t;
+	}
+
+	if(tenant_count >= tenant_table_size - tenant_table_size/4){
+		if(tenant_table_resize(tenant_table_size*2)){
+			return NULL;
+		}
+	}
+
+	if(tenant_prefix_id){
+		prefix_id = limits_prefix_id(name, name_len);
+	}
+	prefix_len = prefix_id >= 0 ? TENANT_PREFIX_ID_LEN : name_len + 1;
+
+	/* name + NUL + prefix + NUL in one allocation */
+	if(name_len + 1 + prefix_len + 1 <= TENANT_POOL_NAMES){
+		t = slab_alloc(&tenant_pool);
+	}else{
+		t = mosquitto_malloc(sizeof(struct tenant) + name_len + 1 + prefix_len + 1);
+	}
+	if(t == NULL){
 		return NULL;
 	}
+	t->name_len = name_len;
+	t->prefix_len = prefix_len;
+	if(tenant_id_alloc(&t->id)){
+		tenant_free(t);
+		return NULL;
+	}
+	t->name = (char *)(t + 1);
+	memcpy(t->name, name, name_len);
+	t->name[name_len] = 0;
+	t->prefix = t->name + name_len + 1;
+	if(prefix_id >= 0){
+		snprintf(t->prefix, prefix_len + 1, TENANT_PREFIX_ID_FMT, (unsigned int)prefix_id);
+	}else{
+		memcpy(t->prefix, name, name_len);
+		t->prefix[name_len] = '/';
+		t->prefix[name_len+1] = 0;
+	}
+	t->hash = mt_hash(name, name_len);
+	t->refcount = 1;
+	t->limits = limits_find(name, name_len);
+	t->latency = NULL;
+	t->queued = NULL;
+	t->tap_count = 0;
+	t->lru_head = NULL;
+	t->lru_tail = NULL;
+	if(t->limits->max_retained_msgs || t->limits->max_retained_bytes){
+		/* Without usage, shortage of memory means no retained quota */
+		t->retained = retain_usage_get(name, name_len);
+	}else{
+		t->retained = NULL;
+	}
+	t->subs = limits_subscriptions_limited() ? subs_usage_get(name, name_len) : NULL;
+	memset(&t->rate, 0, sizeof(t->rate));
+	ratelimit_restore(name, name_len, true, &t->rate);
+	memset(&t->stats, 0, sizeof(t->stats));
+	stats_tenant_restore(t);
+
+	slot = t->hash & (tenant_table_size - 1);
+	t->next = tenant_table[slot];
+	tenant_table[slot] = t;
+	tenant_by_id[t->id] = t;
+	tenant_count++;
+
+	return t;
+}
+
+static void tenant_release(struct tenant *tenant)
+{
+	struct tenant **prev, *t;
+
+	tenant->refcount--;
+	if(tenant->refcount > 0){
+		return;
+	}
+
+	prev = &tenant_table[tenant->hash & (tenant_table_size - 1)];
+	for(t=*prev; t; t=t->next){
+		if(t == tenant){
+			*prev = t->next;
+			break;
+		}
+		prev = &t->next;
+	}
+	tenant_by_id[tenant->id] = NULL;
+	tenant_free_ids[tenant_free_id_count++] = tenant->id;
+	tenant_count--;
+	if(out_memo.tenant == tenant){
+		out_memo_reset();
+	}
+	ratelimit_park(tenant->name, tenant->name_len, true, &tenant->rate,
+			tenant->limits->rate_msgs, tenant->limits->rate_bytes);
+	stats_tenant_park(tenant);
+	latency_tenant_free(tenant);
+	tenant_free(tenant);
+}
+
+static void tenant_table_cleanup(void)
+{
+	struct tenant *t, *next;
+	size_t i;
+
+	for(i=0; i<tenant_table_size; i++){
+		for(t=tenant_table[i]; t; t=next){
+			next = t->next;
+			latency_tenant_free(t);
+			tenant_free(t);
+		}
+	}
+	slab_pool_cleanup(&tenant_pool);
+	mosquitto_free(tenant_table);
+	tenant_table = NULL;
+	tenant_table_size = 0;
+	tenant_count = 0;
+
+	mosquitto_free(tenant_by_id);
+	tenant_by_id = NULL;
+	mosquitto_free(tenant_free_ids);
+	tenant_free_ids = NULL;
+	tenant_id_max = 0;
+	tenant_free_id_count = 0;
+}
+
+static size_t client_hash(const struct mosquitto *client)
+{
+	uint64_t h = (uint64_t)(uintptr_t)client;
+
+	/* Clients are heap allocated, so the low bits carry very little
+	 * information. A multiplicative hash spreads the rest across the table. */
+	h ^= h >> 17;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h >> 32) & (client_table_size - 1);
+}
+
+static int client_table_resize(size_t new_size)
+{
+	struct team_client **new_table;
+	struct team_client *tc, *next;
+	size_t i, old_size, slot;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct team_client *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	old_size = client_table_size;
+	client_table_size = new_size;
+	for(i=0; i<old_size; i++){
+		for(tc=client_table[i]; tc; tc=next){
+			next = tc->next;
+			slot = client_hash(tc->client);
+			tc->next = new_table[slot];
+			new_table[slot] = tc;
+		}
+	}
+	mosquitto_free(client_table);
+	client_table = new_table;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct team_client *client_find(const struct mosquitto *client)
+{
+	struct team_client *tc;
+
+	if(client_count == 0){
+		return NULL;
+	}
+	for(tc=client_table[client_hash(client)]; tc; tc=tc->next){
+		if(tc->client == client){
+			/* NULL for clients known to have no tenant */
+			return tc->tenant ? tc : NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Each tenant keeps its clients in order of activity, so the eviction
+ * watchdog can find the longest idle ones without a scan. */
+static void client_lru_unlink(struct team_client *tc)
+{
+	struct tenant *t = tc->tenant;
+
+	if(tc->lru_prev){
+		tc->lru_prev->lru_next = tc->lru_next;
+	}else{
+		t->lru_head = tc->lru_next;
+	}
+	if(tc->lru_next){
+		tc->lru_next->lru_prev = tc->lru_prev;
+	}else{
+		t->lru_tail = tc->lru_prev;
+	}
+}
+
+static void client_lru_push(struct team_client *tc)
+{
+	struct tenant *t = tc->tenant;
+
+	tc->lru_prev = NULL;
+	tc->lru_next = t->lru_head;
+	if(t->lru_head){
+		t->lru_head->lru_prev = tc;
+	}else{
+		t->lru_tail = tc;
+	}
+	t->lru_head = tc;
+}
+
+static void client_touch_at(struct team_client *tc, uint64_t now_ns)
+{
+	tc->active_ns = now_ns;
+	if(tc->lru_prev){
+		client_lru_unlink(tc);
+		client_lru_push(tc);
+	}
+}
+
+static void client_touch(struct team_client *tc)
+{
+	if(clients_tracked){
+		client_touch_at(tc, mt_now_ns());
+	}
+}
+
+static void client_remove(const struct mosquitto *client)
+{
+	struct team_client **prev, *tc;
+	const char *id;
+
+	if(client_count == 0){
+		return;
+	}
+	prev = &client_table[client_hash(client)];
+	for(tc=*prev; tc; tc=tc->next){
+		if(tc->client == client){
+			*prev = tc->next;
+			if(tc->tenant){
+				id = mosquitto_client_id(client);
+				ratelimit_park(id, strlen(id), false, &tc->rate,
+						tc->tenant->limits->client_rate_msgs, tc->tenant->limits->client_rate_bytes);
+				client_lru_unlink(tc);
+				subs_client_cleanup(tc);
+				queue_client_cleanup(tc);
+				tc->tenant->stats.clients--;
+				tenant_release(tc->tenant);
+			}
+			slab_free(&client_pool, tc);
+			client_count--;
+			return;
+		}
+		prev = &tc->next;
+	}
+}
+
+/* Add a client to the table, taking over the caller's reference to the
+ * tenant. With a NULL tenant the entry records that the client has none, so
+ * later lookups for it stop there. */
+static int client_add(const struct mosquitto *client, struct tenant *tenant)
+{
+	struct team_client *tc;
+	size_t slot;
+
+	/* A client pointer can only be reused once the broker has freed the
+	 * previous client, but be defensive about stale entries. */
+	client_remove(client);
+
+	if(client_count >= client_table_size - client_table_size/4){
+		if(client_table_resize(client_table_size*2)){
+			goto error;
+		}
+	}
+
+	tc = slab_alloc(&client_pool);
+	if(tc == NULL){
+		goto error;
+	}
+	tc->tenant = tenant;
+	tc->client = client;
+	tc->lru_prev = NULL;
+	tc->lru_next = NULL;
+	tc->active_ns = clients_tracked ? mt_now_ns() : 0;
+	memset(&tc->rate, 0, sizeof(tc->rate));
+	tc->session = NULL;
+	if(tc->tenant){
+		tc->tenant->stats.clients++;
+		client_lru_push(tc);
+	}
+
+	slot = client_hash(client);
+	tc->next = client_table[slot];
+	client_table[slot] = tc;
+	client_count++;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	if(tenant){
+		tenant_release(tenant);
+	}
+	return MOSQ_ERR_NOMEM;
+}
+
+unsigned int tenant_kick(struct tenant *t)
+{
+	struct team_client *tc;
+	char **ids;
+	unsigned int count = 0, i;
+
+	if(t->stats.clients == 0){
+		return 0;
+	}
+	/* Kicking a client runs the disconnect callback straight away, which
+	 * changes the client table, so take a copy of the ids first. */
+	ids = mosquitto_calloc(t->stats.clients, sizeof(char *));
+	if(ids == NULL){
+		return 0;
+	}
+	for(tc=t->lru_head; tc && count<t->stats.clients; tc=tc->lru_next){
+		ids[count] = mosquitto_strdup(mosquitto_client_id(tc->client));
+		if(ids[count]){
+			count++;
+		}
+	}
+	for(i=0; i<count; i++){
+		mosquitto_kick_client_by_clientid(ids[i], false);
+		mosquitto_free(ids[i]);
+	}
+	mosquitto_free(ids);
+	return count;
+}
+
+static void client_table_cleanup(void)
+{
+	struct team_client *tc, *next;
+	size_t i;
+
+	for(i=0; i<client_table_size; i++){
+		for(tc=client_table[i]; tc; tc=next){
+			next = tc->next;
+			if(tc->tenant){
+				subs_client_cleanup(tc);
+			}
+		}
+	}
+	slab_pool_cleanup(&client_pool);
+	mosquitto_free(client_table);
+	client_table = NULL;
+	client_table_size = 0;
+	client_count = 0;
+}
+
+/* Parse a character set of the form "a-z0-9_-" into tenant_charset. */
+static int tenant_charset_parse(const char *spec)
+{
+	const unsigned char *c = (const unsigned char *)spec;
+	unsigned int i;
+
+	memset(tenant_charset, 0, sizeof(tenant_charset));
+	while(*c){
+		if(c[1] == '-' && c[2]){
+			if(c[0] > c[2]){
+				return MOSQ_ERR_INVAL;
+			}
+			for(i=c[0]; i<=c[2]; i++){
+				tenant_charset[i] = true;
+			}
+			c += 3;
+		}else{
+			tenant_charset[*c] = true;
+			c++;
+		}
+	}
+	/* Never allow characters that would change the meaning of a topic. */
+	tenant_charset['/'] = false;
+	tenant_charset['+'] = false;
+	tenant_charset['#'] = false;
+	tenant_charset['$'] = false;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Work out the literal prefilter for an extended regex. This only has to be
+ * conservative: anything it is unsure of (groups, bracket expressions,
+ * optional atoms, alternation) is simply not required. */
+static void tenant_rule_prefilter(struct tenant_rule *r, const char *pattern)
+{
+	const char *p, *next;
+	bool in_prefix = false;
+	int depth = 0, literal;
+
+	memset(r->required, 0, sizeof(r->required));
+	r->prefix_len = 0;
+
+	for(p=pattern; *p; p++){
+		if(*p == '\\' && p[1]){
+			p++;
+		}else if(*p == '|'){
+			/* Alternation, nothing is required */
+			return;
+		}
+	}
+
+	p = pattern;
+	if(*p == '^'){
+		in_prefix = true;
+		p++;
+	}
+	while(*p){
+		literal = -1;
+		next = p + 1;
+		if(*p == '\\' && p[1]){
+			if(!isalnum((unsigned char)p[1])){
+				literal = (unsigned char)p[1];
+			}
+			next = p + 2;
+		}else if(*p == '['){
+			next = p + 1;
+			if(*next == '^') next++;
+			if(*next == ']') next++;
+			while(*next && *next != ']'){
+				if(next[0] == '[' && (next[1] == ':' || next[1] == '.' || next[1] == '=')){
+					const char *close = strchr(next + 2, next[1]);
+					next = (close && close[1] == ']') ? close + 1 : next + 1;
+				}
+				next++;
+			}
+			if(*next) next++;
+		}else if(*p == '('){
+			depth++;
+		}else if(*p == ')'){
+			depth--;
+		}else if(*p == '{'){
+			next = strchr(p, '}');
+			next = next ? next + 1 : p + strlen(p);
+		}else if(!strchr(".^$*+?", *p)){
+			literal = (unsigned char)*p;
+		}
+
+		if(literal >= 0 && depth == 0 && *next != '*' && *next != '?' && *next != '{'){
+			r->required[literal >> 6] |= (uint64_t)1 << (literal & 63);
+			if(in_prefix && r->prefix_len < TENANT_RULE_PREFIX_MAX){
+				r->prefix[r->prefix_len++] = (char)literal;
+			}
+			if(*next == '+'){
+				in_prefix = false;
+			}
+		}else{
+			in_prefix = false;
+		}
+		p = next;
+	}
+}
+
+static int tenant_rule_add(const char *pattern)
+{
+	struct tenant_rule *new_rules, *r;
+
+	new_rules = mosquitto_realloc(tenant_rules, (size_t)(tenant_rule_count+1)*sizeof(struct tenant_rule));
+	if(new_rules == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	tenant_rules = new_rules;
+	r = &tenant_rules[tenant_rule_count];
+
+	if(regcomp(&r->re, pattern, REG_EXTENDED)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid regex '%s'.", pattern);
+		return MOSQ_ERR_INVAL;
+	}
+	tenant_rule_prefilter(r, pattern);
+	tenant_rule_count++;
+
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, PLUGIN_NAME ": regex %d '%s', prefix '%.*s'.",
+			tenant_rule_count, pattern, (int)r->prefix_len, r->prefix);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void tenant_rules_cleanup(void)
+{
+	int i;
+
+	for(i=0; i<tenant_rule_count; i++){
+		regfree(&tenant_rules[i].re);
+	}
+	mosquitto_free(tenant_rules);
+	tenant_rules = NULL;
+	tenant_rule_count = 0;
+}
+
+static bool get_team_delimiter(const char *str, const char **team, size_t *team_len)
+{
+	const char *start, *end, *c;
+	size_t len = strlen(str);
+
+	if(tenant_side_left){
+		start = str;
+		end = memchr(str, tenant_delimiter, len);
+		if(end == NULL || end[1] == 0){
+			return false;
+		}
+	}else{
+		end = str + len;
+		for(start=end; start>str; start--){
+			if(start[-1] == tenant_delimiter){
+				break;
+			}
+		}
+		if(start == str || start == str+1){
+			/* No delimiter, or nothing before it */
+			return false;
+		}
+	}
+	if(start == end){
+		return false;
+	}
+	for(c=start; c<end; c++){
+		if(!tenant_charset[(unsigned char)*c]){
+			return false;
+		}
+	}
+	*team = start;
+	*team_len = (size_t)(end - start);
+	return true;
+}
+
+/* Extract the team from a username. On success, *team is *team_len bytes
+ * long and not NUL terminated. It points into str, or into the tenant map for
+ * mapped usernames, so is only good until the map is next reloaded. */
+static bool get_team(const char *str, const char **team, size_t *team_len)
+{
+	regmatch_t pmatch[2];
+
+	if(tenantmap_lookup(str, team, team_len)){
+		return true;
+	}
+	if(tenant_delimiter && get_team_delimiter(str, team, team_len)){
+		return true;
+	}
+	if(tenant_rule_count == 0){
+		return false;
+	}
+
+	uint64_t present[4] = {0, 0, 0, 0};
+	const struct tenant_rule *r;
+	const unsigned char *c;
+	size_t len;
+	int i;
+
+	for(c=(const unsigned char *)str; *c; c++){
+		present[*c >> 6] |= (uint64_t)1 << (*c & 63);
+	}
+	len = (size_t)((const char *)c - str);
+
+	for(i=0; i<tenant_rule_count; i++){
+		r = &tenant_rules[i];
+		if((r->required[0] & ~present[0]) || (r->required[1] & ~present[1])
+				|| (r->required[2] & ~present[2]) || (r->required[3] & ~present[3])){
+			continue;
+		}
+		if(r->prefix_len > len || memcmp(str, r->prefix, r->prefix_len)){
+			continue;
+		}
+		if(regexec(&r->re, str, 2, pmatch, 0) == 0 && pmatch[1].rm_so >= 0){
+			*team = str + pmatch[1].rm_so;
+			*team_len = (size_t)(pmatch[1].rm_eo - pmatch[1].rm_so);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Connection admission, registered when there are connection limits,
+ * password files or cluster nodes. Clients of a tenant are refused if the
+ * tenant is disabled or placed on another cluster node, if they would take it
+ * over max_connections, or if they would add a tenant beyond max_tenants.
+ * The live count is the tenant's client count, so this is a team lookup and a
+ * few compares. Only then is the password checked, by auth.c against the
+ * tenant's password file or the global one. Bypass clients and clients
+ * without a team just have their password checked, and users auth.c has no
+ * credentials for are left to the other authentication methods. */
+static struct {
+	const struct mosquitto *client;
+	const char *username;
+	uint32_t username_hash;
+	struct tenant *tenant; /* holds a reference */
+} auth_hint;
+
+static void auth_hint_clear(void)
+{
+	if(auth_hint.tenant){
+		tenant_release(auth_hint.tenant);
+	}
+	memset(&auth_hint, 0, sizeof(auth_hint));
+}
+
+static int basic_auth_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_basic_auth *ed = event_data;
+	const struct tenant_limits *limits;
+	struct tenant *t;
+	const char *team;
+	size_t team_len;
+	uint32_t max_tenants;
+	int rc;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	/* Whatever happened to the last client, its hint is of no use now */
+	auth_hint_clear();
+
+	if(ed->username == NULL){
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+	if(bypass_client(ed->client, ed->username) || !get_team(ed->username, &team, &team_len)){
+		return auth_check(ed->username, ed->password, NULL, 0);
+	}
+
+	t = tenant_find(team, team_len);
+	limits = t ? t->limits : limits_find(team, team_len);
+	if(limits->disabled){
+		return MOSQ_ERR_AUTH;
+	}
+	if(!placement_local(team, team_len)){
+		/* Belongs on another node of the cluster */
+		return MOSQ_ERR_AUTH;
+	}
+	if(t){
+		if(t->limits->max_connections && t->stats.clients >= t->limits->max_connections){
+			t->stats.connections_rejected++;
+			return MOSQ_ERR_AUTH;
+		}
+	}else{
+		max_tenants = limits_max_tenants();
+		if(max_tenants && tenant_count >= max_tenants){
+			return MOSQ_ERR_AUTH;
+		}
+	}
+
+	rc = auth_check(ed->username, ed->password, team, team_len);
+	if(rc == MOSQ_ERR_SUCCESS){
+		/* The connect event follows straight on if the client is accepted,
+		 * so save it from resolving the team again. The tenant is held
+		 * rather than the team, which may point into the tenant map. Not
+		 * for deferred clients, which may yet be refused: a tenant made for
+		 * each of those would leave usage records behind. */
+		auth_hint.tenant = tenant_acquire(team, team_len);
+		if(auth_hint.tenant){
+			auth_hint.client = ed->client;
+			auth_hint.username = ed->username;
+			auth_hint.username_hash = mt_hash(ed->username, strlen(ed->username));
+		}
+	}
+	return rc;
+}
+
+static bool basic_auth_registered = false;
+
+int tenant_limits_changed(void)
+{
+	struct tenant *t;
+	uint32_t i;
+	int rc;
+
+	for(i=0; i<tenant_id_max; i++){
+		t = tenant_by_id[i];
+		if(t == NULL){
+			continue;
+		}
+		t->limits = limits_find(t->name, t->name_len);
+		if(t->retained == NULL && (t->limits->max_retained_msgs || t->limits->max_retained_bytes)){
+			/* Only retained messages from now on are counted */
+			t->retained = retain_usage_get(t->name, t->name_len);
+		}
+		if(t->subs == NULL && limits_subscriptions_limited()){
+			/* Counted from each client's next connect */
+			t->subs = subs_usage_get(t->name, t->name_len);
+		}
+	}
+
+	if(limits_connections_limited() && !basic_auth_registered){
+		rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_BASIC_AUTH, basic_auth_callback, NULL, NULL);
+		if(rc) return rc;
+		basic_auth_registered = true;
+	}
+	rc = acl_limits_changed();
+	if(rc) return rc;
+	rc = queue_limits_changed();
+	if(rc) return rc;
+	rc = subs_limits_changed();
+	if(rc) return rc;
+	return downsample_limits_changed();
 }
 
 static int connect_callback(int event, void *event_data, void *userdata)
 {
-	struct mosquitto_evt_message *ed = event_data;
-	const char *id, *username;
+	struct mosquitto_evt_connect *ed = event_data;
+	const char *id, *username, *team;
+	struct team_client *tc;
+	struct tenant *tenant;
 	char *new_id;
-	size_t idlen, new_id_len;
+	size_t idlen, new_id_len, team_len;
 
 	UNUSED(event);
 	UNUSED(userdata);
 	username = mosquitto_client_username(ed->client);
 
 	if (!username) {
+		auth_hint_clear();
+		client_add(ed->client, NULL);
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	id = mosquitto_client_id(ed->client);
-	idlen = strlen(id);
+	if(auth_hint.tenant && auth_hint.client == ed->client && auth_hint.username == username
+			&& auth_hint.username_hash == mt_hash(username, strlen(username))){
+
+		tenant = auth_hint.tenant;
+		auth_hint.tenant = NULL;
+		auth_hint_clear();
+		MT_PROBE3(tenant__resolve, tenant->name, tenant->name_len, 1);
+	}else{
+		/* Not from the basic auth just before, so not for this client */
+		auth_hint_clear();
+		if(bypass_client(ed->client, username) || !get_team(username, &team, &team_len)){
+			/* will only modify the client id of team clients. Remember that
+			 * this one has no tenant, so the other callbacks can give up on
+			 * it straight away. */
+			MT_PROBE3(tenant__resolve, NULL, 0, 0);
+			client_add(ed->client, NULL);
+			return MOSQ_ERR_SUCCESS;
+		}
+		MT_PROBE3(tenant__resolve, team, team_len, 0);
+		tenant = tenant_acquire(team, team_len);
+		if(tenant == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
 
-	const char *team = get_team(username);
-	if(!team){
-		/* will only modify the client id of team clients */
-		return MOSQ_ERR_SUCCESS;
+	if(client_add(ed->client, tenant)){
+		return MOSQ_ERR_NOMEM;
 	}
+	tc = client_find(ed->client);
 
-	/* calculate new client id length */
-	new_id_len = strlen(team) + sizeof('@') + idlen + 1;
+	id = mosquitto_client_id(ed->client);
+	idlen = strlen(id);
+
+	/* calculate new client id length, id + '@' + team + terminator */
+	new_id_len = idlen + 1 + tc->tenant->name_len + 1;
 
 	new_id = mosquitto_calloc(1, new_id_len);
 	if(new_id == NULL){
+		tc->tenant->stats.rewrite_failures++;
 		return MOSQ_ERR_NOMEM;
 	}
 
 	/* generate new client id with team name */
-	snprintf(new_id, new_id_len, "%s@%s", id, team);
-
-	mosquitto_free((void *)team);
+	memcpy(new_id, id, idlen);
+	new_id[idlen] = '@';
+	memcpy(new_id + idlen + 1, tc->tenant->name, tc->tenant->name_len);
 
+	ratelimit_restore(new_id, new_id_len - 1, false, &tc->rate);
 	mosquitto_set_clientid(ed->client, new_id);
+	subs_client_attach(tc);
+	queue_client_attach(tc);
+	audit_connect(tc);
+	MT_PROBE4(connect__rewrite, tc->tenant->name, tc->tenant->name_len, idlen, new_id_len);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int disconnect_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_disconnect *ed = event_data;
+	const struct team_client *tc;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	tc = client_find(ed->client);
+	if(tc){
+		audit_disconnect(tc);
+	}
+	/* Also drops the entries of clients without a tenant */
+	client_remove(ed->client);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
 
+/* Fires once per callback with the result of the client table lookup, which
+ * is where the tenant of a client is found after connecting. */
+#define MT_PROBE_LOOKUP(tc, event) \
+	MT_PROBE4(client__lookup, (tc) ? (tc)->tenant->name : NULL, (tc) ? (tc)->tenant->name_len : 0, event, (tc) != NULL)
+
+/* Refuse a publish. MQTT v5 clients get the reason in the PUBACK/PUBREC. */
+static int publish_reject(struct mosquitto_evt_message *ed)
+{
+	if(mosquitto_client_protocol_version(ed->client) == 5){
+		ed->reason_code = MQTT_RC_QUOTA_EXCEEDED;
+	}
+	return MOSQ_ERR_ACL_DENIED;
+}
+
 static int callback_message_in(int event, void *event_data, void *userdata)
 {
 	struct mosquitto_evt_message *ed = event_data;
+	struct team_client *tc;
+	const struct tenant_limits *limits;
 	char *new_topic;
-	size_t new_topic_len;
+	size_t topic_len, new_topic_len;
 
 	UNUSED(event);
 	UNUSED(userdata);
 
-	const char *username = mosquitto_client_username(ed->client);
-	if (!username) {
-		return MOSQ_ERR_SUCCESS;
-	}
+	/* A new message is about to be fanned out */
+	out_memo_reset();
 
-	const char *team = get_team(username);
-	if(!team){
+	tc = client_find(ed->client);
+	MT_PROBE_LOOKUP(tc, MOSQ_EVT_MESSAGE_IN);
+	if(!tc){
 		/* will only modify the topic of team clients */
 		return MOSQ_ERR_SUCCESS;
 	}
+	client_touch(tc);
+
+	if(global_topic(ed->topic)){
+		/* The global namespace is read only for tenants */
+		tc->tenant->stats.global_rejected++;
+		return MOSQ_ERR_ACL_DENIED;
+	}
+
+	limits = tc->tenant->limits;
+	if(limits->max_payload_size && ed->payloadlen > limits->max_payload_size){
+		tc->tenant->stats.payload_rejected++;
+		return publish_reject(ed);
+	}
+	if(limits->rate_enabled && !ratelimit_allow(tc, ed->payloadlen)){
+		tc->tenant->stats.rate_limited++;
+		return publish_reject(ed);
+	}
+	if(limits->max_queued_bytes && !queue_allow(tc->tenant, ed)){
+		if(ed->qos == 0){
+			/* Nobody is keeping up, dropping it is what QoS 0 allows */
+			tc->tenant->stats.queue_dropped++;
+			return MOSQ_ERR_ACL_DENIED;
+		}
+		tc->tenant->stats.queue_rejected++;
+		return publish_reject(ed);
+	}
+	if(ed->retain && tc->tenant->retained && !retain_allow(tc->tenant, ed->topic, ed->payloadlen)){
+		tc->tenant->stats.retained_rejected++;
+		return publish_reject(ed);
+	}
+	if(limits->downsample_interval && ed->qos == 0 && !downsample_allow(tc->tenant, ed)){
+		/* Held back, it will be published when the interval is up */
+		tc->tenant->stats.downsampled++;
+		return MOSQ_ERR_ACL_DENIED;
+	}
+
+	tc->tenant->stats.messages_in++;
+	tc->tenant->stats.bytes_in += ed->payloadlen;
+	audit_publish(tc, ed);
+	if(limits->tap_sample){
+		tap_message(tc->tenant, ed);
+	}
 
 	/* put the team on front of the topic */
 
 	/* calculate the length of the new payload */
-	new_topic_len = strlen(team) + sizeof('/') + strlen(ed->topic) + 1;
+	topic_len = strlen(ed->topic);
+	new_topic_len = tc->tenant->prefix_len + topic_len + 1;
 
 	/* Allocate some memory - use
 	 * mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
 	 * allow the broker to track memory usage */
-	new_topic = mosquitto_calloc(1, new_topic_len);
+	new_topic = mosquitto_malloc(new_topic_len);
 	if(new_topic == NULL){
+		tc->tenant->stats.rewrite_failures++;
 		return MOSQ_ERR_NOMEM;
 	}
 
 	/* prepend the team to the topic */
-	snprintf(new_topic, new_topic_len, "%s/%s", team, ed->topic);
-
-	mosquitto_free((void *)team);
+	memcpy(new_topic, tc->tenant->prefix, tc->tenant->prefix_len);
+	memcpy(new_topic + tc->tenant->prefix_len, ed->topic, topic_len + 1);
+	MT_PROBE4(topic__rewrite, tc->tenant->name, tc->tenant->name_len, topic_len, new_topic_len);
 
 	/* Assign the new topic to the event data structure. You
 	 * must *not* free the original topic, it will be handled by the
@@ -162,127 +1158,192 @@ static int callback_message_in(int event, void *event_data, void *userdata)
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Check a memo hit against the topic itself. strnlen() stops at the
+ * remembered length, so this never reads past the end of a shorter topic. */
+static bool out_memo_valid(const char *topic, const struct tenant *tenant)
+{
+	if(strncmp(topic, tenant->prefix, tenant->prefix_len)){
+		return out_memo.stripped_len == OUT_MEMO_NO_MATCH;
+	}
+	if(out_memo.stripped_len == OUT_MEMO_NO_MATCH){
+		return topic[tenant->prefix_len] == 0;
+	}
+	return strnlen(topic + tenant->prefix_len, out_memo.stripped_len + 1) == out_memo.stripped_len;
+}
+
 static int callback_message_out(int event, void *event_data, void *userdata)
 {
 	struct mosquitto_evt_message *ed = event_data;
-	size_t team_len;
+	struct team_client *tc;
+	size_t prefix_len, stripped_len;
+	char *new_topic;
 
 	UNUSED(event);
 	UNUSED(userdata);
 
-	const char *username = mosquitto_client_username(ed->client);
-	if (!username) {
-		return MOSQ_ERR_SUCCESS;
-	}
-
-	const char *team = get_team(username);
-	if(!team){
+	tc = client_find(ed->client);
+	MT_PROBE_LOOKUP(tc, MOSQ_EVT_MESSAGE_OUT);
+	if(!tc){
 		/* will only modify the topic of team clients */
 		return MOSQ_ERR_SUCCESS;
 	}
 
+	tc->tenant->stats.messages_out++;
+	tc->tenant->stats.bytes_out += ed->payloadlen;
+
 	/* remove the team from the front of the topic */
-	team_len = strlen(team);
+	prefix_len = tc->tenant->prefix_len;
+
+	if(out_memo.topic == ed->topic && out_memo.tenant == tc->tenant
+			&& out_memo.payload == ed->payload && out_memo.payloadlen == ed->payloadlen
+			&& out_memo_valid(ed->topic, tc->tenant)){
+
+		stripped_len = out_memo.stripped_len;
+	}else{
+		/* Compare the prefix before measuring the topic, so topics from
+		 * other teams are rejected without walking the whole string. The
+		 * prefix has no NUL in it, so a match means the topic is at least
+		 * prefix_len long. */
+		if(strncmp(ed->topic, tc->tenant->prefix, prefix_len)){
+			stripped_len = OUT_MEMO_NO_MATCH;
+		}else{
+			stripped_len = strlen(ed->topic + prefix_len);
+			if(stripped_len == 0){
+				/* nothing after the team + '/' */
+				stripped_len = OUT_MEMO_NO_MATCH;
+			}
+		}
+		out_memo.topic = ed->topic;
+		out_memo.payload = ed->payload;
+		out_memo.payloadlen = ed->payloadlen;
+		out_memo.tenant = tc->tenant;
+		out_memo.stripped_len = stripped_len;
+		if(clients_tracked){
+			out_memo.now_ns = mt_now_ns();
+		}
+	}
+	if(clients_tracked){
+		/* Receiving counts, or subscribe-only clients would look idle */
+		client_touch_at(tc, out_memo.now_ns);
+	}
 
-	if(strlen(ed->topic) <= team_len + 1){
-		/* the topic is not long enough to contain the
-		 * team + '/' */
+	if(stripped_len == OUT_MEMO_NO_MATCH){
+		MT_PROBE4(topic__strip, tc->tenant->name, tc->tenant->name_len, 0, 0);
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	if(!strncmp(team, ed->topic, team_len) && ed->topic[team_len] == '/'){
-		/* Allocate some memory - use
-		 * mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
-		 * allow the broker to track memory usage */
+	/* Allocate some memory - use
+	 * mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
+	 * allow the broker to track memory usage */
 
-		/* skip the team + '/' */
-		char *new_topic = mosquitto_strdup(ed->topic + team_len + 1);
+	/* skip the team + '/' */
+	new_topic = mosquitto_malloc(stripped_len + 1);
+	if(new_topic == NULL){
+		tc->tenant->stats.rewrite_failures++;
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(new_topic, ed->topic + prefix_len, stripped_len + 1);
+	MT_PROBE4(topic__strip, tc->tenant->name, tc->tenant->name_len, stripped_len, stripped_len + 1);
 
-		if(new_topic == NULL){
-			return MOSQ_ERR_NOMEM;
-		}
+	/* Assign the new topic to the event data structure. You
+	 * must *not* free the original topic, it will be handled by the
+	 * broker. */
+	ed->topic = new_topic;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool global_topic(const char *topic)
+{
+	if(global_namespace_len == 0){
+		return false;
+	}
+	return !strncmp(topic, global_namespace, global_namespace_len)
+			&& (topic[global_namespace_len] == '/' || topic[global_namespace_len] == 0);
+}
 
-		/* Assign the new topic to the event data structure. You
-		 * must *not* free the original topic, it will be handled by the
-		 * broker. */
-		ed->topic = new_topic;
+/* Put the tenant prefix on a subscription topic filter. Shared subscriptions
+ * keep the share name at the front, so "$share/<group>/<filter>" becomes
+ * "$share/<group>/<team>/<filter>". The result is written straight into a
+ * single buffer of the right size, which the broker takes ownership of.
+ * Filters in the global namespace are left alone, with *new_filter set to
+ * NULL. */
+static int topic_filter_add_prefix(const struct tenant *tenant, const char *filter, char **new_filter)
+{
+	const char *group_end;
+	size_t head_len = 0, tail_len;
+	char *out;
+
+	if(!strncmp(filter, "$share/", 7)){
+		group_end = strchr(filter + 7, '/');
+		if(group_end == NULL || group_end == filter + 7 || group_end[1] == 0){
+			/* No share name, or no topic filter after it */
+			return MOSQ_ERR_INVAL;
+		}
+		head_len = (size_t)(group_end - filter) + 1;
 	}
+	if(global_topic(filter + head_len)){
+		*new_filter = NULL;
+		return MOSQ_ERR_SUCCESS;
+	}
+	tail_len = strlen(filter + head_len);
 
-	mosquitto_free((void *)team);
+	/* Allocate some memory - use
+	 * mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
+	 * allow the broker to track memory usage */
+	out = mosquitto_malloc(head_len + tenant->prefix_len + tail_len + 1);
+	if(out == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(out, filter, head_len);
+	memcpy(out + head_len, tenant->prefix, tenant->prefix_len);
+	memcpy(out + head_len + tenant->prefix_len, filter + head_len, tail_len + 1);
 
+	*new_filter = out;
 	return MOSQ_ERR_SUCCESS;
 }
 
 static int callback_subscribe(int event, void *event_data, void *userdata)
 {
 	struct mosquitto_evt_subscribe *ed = event_data;
-	char *new_sub, *share_group, *topic;
-	regmatch_t pmatch[3];
-	size_t new_sub_len, group_size, topic_size;
+	struct team_client *tc;
+	char *new_sub;
+	int rc;
 
 	UNUSED(event);
 	UNUSED(userdata);
 
-	const char *username = mosquitto_client_username(ed->client);
-	if (!username) {
-		return MOSQ_ERR_SUCCESS;
-	}
+	/* Retained messages delivered for this subscription are a new fan-out */
+	out_memo_reset();
 
-	const char *team = get_team(username);
-	if(!team){
+	tc = client_find(ed->client);
+	MT_PROBE_LOOKUP(tc, MOSQ_EVT_SUBSCRIBE);
+	if(!tc){
 		/* will only modify the topic of team clients */
 		return MOSQ_ERR_SUCCESS;
 	}
+	client_touch(tc);
 
-	if (!strncmp(ed->data.topic_filter, "$share/", 7)) {
-		new_sub_len = strlen(team) + (sizeof('/') * 2) + strlen(ed->data.topic_filter) + 1;
-
-		new_sub = mosquitto_calloc(1, new_sub_len);
-		if(new_sub == NULL){
-			return MOSQ_ERR_NOMEM;
-		}
-
-		int rc = regexec(&shared_sub_match, ed->data.topic_filter, 3, pmatch, 0);
-		if (rc == 0) {
-			group_size = (size_t)(pmatch[1].rm_eo - pmatch[1].rm_so);
-			topic_size = (size_t)(pmatch[2].rm_eo - pmatch[2].rm_so);
-			share_group = mosquitto_malloc(group_size+1);
-			topic = mosquitto_malloc(topic_size+1);
-			strncpy(share_group, ed->data.topic_filter + pmatch[1].rm_so, group_size);
-			share_group[group_size] = 0;
-			strncpy(topic, ed->data.topic_filter + pmatch[2].rm_so, topic_size);
-			topic[topic_size+1] = 0;
-			snprintf(new_sub, new_sub_len, "%s/%s/%s", share_group, team, topic);
-			
-			mosquitto_free((void *)share_group);
-			mosquitto_free((void *)topic);
-		} else {
-			return MOSQ_ERR_NOMEM;
-		}
-		
-	} else {
-		/* put the team on front of the topic */
-
-		/* calculate the length of the new payload */
-		new_sub_len = strlen(team) + sizeof('/') + strlen(ed->data.topic_filter) + 1;
-
-		/* Allocate some memory - use
-		* mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
-		* allow the broker to track memory usage */
-		new_sub = mosquitto_calloc(1, new_sub_len);
-		if(new_sub == NULL){
-			return MOSQ_ERR_NOMEM;
-		}
-
-		/* prepend the team to the subscription */
-		snprintf(new_sub, new_sub_len, "%s/%s", team, ed->data.topic_filter);
+	rc = topic_filter_add_prefix(tc->tenant, ed->data.topic_filter, &new_sub);
+	if(rc){
+		tc->tenant->stats.rewrite_failures++;
+		return rc;
+	}
+	rc = subs_add(tc, ed->data.topic_filter);
+	if(rc){
+		mosquitto_free(new_sub);
+		return rc;
 	}
+	audit_subscribe(tc, ed->data.topic_filter, false);
+	MT_PROBE5(subscribe__rewrite, tc->tenant->name, tc->tenant->name_len,
+			strlen(ed->data.topic_filter), new_sub ? strlen(new_sub) + 1 : 0, 0);
+
 	/* Assign the new topic to the event data structure. You
 	 * must *not* free the original topic, it will be handled by the
 	 * broker. */
-	ed->data.topic_filter = new_sub;
-
-	mosquitto_free((void *) team);
+	if(new_sub){
+		ed->data.topic_filter = new_sub;
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -290,112 +1351,375 @@ static int callback_subscribe(int event, void *event_data, void *userdata)
 static int callback_unsubscribe(int event, void *event_data, void *userdata)
 {
 	struct mosquitto_evt_unsubscribe *ed = event_data;
-	char *new_sub, *share_group, *topic;
-	regmatch_t pmatch[3];
-	size_t new_sub_len, group_size, topic_size;
+	struct team_client *tc;
+	char *new_sub;
+	int rc;
 
 	UNUSED(event);
 	UNUSED(userdata);
 
-	const char *username = mosquitto_client_username(ed->client);
-	if (!username) {
+	tc = client_find(ed->client);
+	MT_PROBE_LOOKUP(tc, MOSQ_EVT_UNSUBSCRIBE);
+	if(!tc){
+		/* will only modify the topic of team clients */
 		return MOSQ_ERR_SUCCESS;
 	}
+	client_touch(tc);
 
-	const char *team = get_team(username);
-	if(!team){
-		/* will only modify the topic of team clients */
-		// mosquitto_free((void *)team);
-		return MOSQ_ERR_SUCCESS;
+	rc = topic_filter_add_prefix(tc->tenant, ed->data.topic_filter, &new_sub);
+	if(rc){
+		tc->tenant->stats.rewrite_failures++;
+		return rc;
+	}
+
+	/* Assign the new topic to the event data structure. You
+	 * must *not* free the original topic, it will be handled by the
+	 * broker. */
+	subs_remove(tc, ed->data.topic_filter);
+	audit_subscribe(tc, ed->data.topic_filter, true);
+	MT_PROBE5(subscribe__rewrite, tc->tenant->name, tc->tenant->name_len,
+			strlen(ed->data.topic_filter), new_sub ? strlen(new_sub) + 1 : 0, 1);
+	if(new_sub){
+		ed->data.topic_filter = new_sub;
 	}
 
-		if (!strncmp(ed->data.topic_filter, "$share/", 7)) {
-		new_sub_len = strlen(team) + (sizeof('/') * 2) + strlen(ed->data.topic_filter) + 1;
+	return MOSQ_ERR_SUCCESS;
+}
 
-		new_sub = mosquitto_calloc(1, new_sub_len);
-		if(new_sub == NULL){
-			return MOSQ_ERR_NOMEM;
+/* The rewrite callbacks. They are registered either directly, or through
+ * timed_callback() when latency tracking is on, so tracking costs nothing
+ * while it is off. */
+struct plugin_callback {
+	int event;
+	MOSQ_FUNC_generic_callback cb;
+	enum latency_event latency_event;
+};
+
+static struct plugin_callback plugin_callbacks[] = {
+	{MOSQ_EVT_CONNECT, connect_callback, LATENCY_CONNECT},
+	{MOSQ_EVT_DISCONNECT, disconnect_callback, LATENCY_DISCONNECT},
+	{MOSQ_EVT_MESSAGE_IN, callback_message_in, LATENCY_MESSAGE_IN},
+	{MOSQ_EVT_MESSAGE_OUT, callback_message_out, LATENCY_MESSAGE_OUT},
+	{MOSQ_EVT_SUBSCRIBE, callback_subscribe, LATENCY_SUBSCRIBE},
+	{MOSQ_EVT_UNSUBSCRIBE, callback_unsubscribe, LATENCY_UNSUBSCRIBE},
+};
+#define PLUGIN_CALLBACK_COUNT (sizeof(plugin_callbacks)/sizeof(plugin_callbacks[0]))
+
+static bool callbacks_timed = false;
+
+static struct mosquitto *event_client(int event, void *event_data)
+{
+	switch(event){
+		case MOSQ_EVT_CONNECT:
+			return ((struct mosquitto_evt_connect *)event_data)->client;
+		case MOSQ_EVT_DISCONNECT:
+			return ((struct mosquitto_evt_disconnect *)event_data)->client;
+		case MOSQ_EVT_MESSAGE_IN:
+		case MOSQ_EVT_MESSAGE_OUT:
+			return ((struct mosquitto_evt_message *)event_data)->client;
+		case MOSQ_EVT_SUBSCRIBE:
+			return ((struct mosquitto_evt_subscribe *)event_data)->client;
+		case MOSQ_EVT_UNSUBSCRIBE:
+			return ((struct mosquitto_evt_unsubscribe *)event_data)->client;
+	}
+	return NULL;
+}
+
+static int timed_callback(int event, void *event_data, void *userdata)
+{
+	const struct plugin_callback *pcb = userdata;
+	struct mosquitto *client = NULL;
+	const struct team_client *tc;
+	struct tenant *t = NULL;
+	uint64_t start;
+	int rc;
+
+	if(latency_get_mode() == LATENCY_TENANT){
+		client = event_client(event, event_data);
+		tc = client_find(client);
+		if(tc){
+			/* Keep the tenant alive if this is its last client disconnecting */
+			t = tc->tenant;
+			t->refcount++;
 		}
+	}
 
-		int rc = regexec(&shared_sub_match, ed->data.topic_filter, 3, pmatch, 0);
-		if (rc == 0) {
-			group_size = (size_t)(pmatch[1].rm_eo - pmatch[1].rm_so);
-			topic_size = (size_t)(pmatch[2].rm_eo - pmatch[2].rm_so);
-			share_group = mosquitto_malloc(group_size+1);
-			topic = mosquitto_malloc(topic_size+1);
-			strncpy(share_group, ed->data.topic_filter + pmatch[1].rm_so, group_size);
-			share_group[group_size] = 0;
-			strncpy(topic, ed->data.topic_filter + pmatch[2].rm_so, topic_size);
-			topic[topic_size+1] = 0;
-			snprintf(new_sub, new_sub_len, "%s/%s/%s", share_group, team, topic);
-			
-			mosquitto_free((void *)share_group);
-			mosquitto_free((void *)topic);
-		} else {
-			return MOSQ_ERR_NOMEM;
+	start = mt_precise_ns();
+	rc = pcb->cb(event, event_data, NULL);
+	if(t == NULL && client && event == MOSQ_EVT_CONNECT){
+		tc = client_find(client);
+		if(tc){
+			t = tc->tenant;
+			t->refcount++;
 		}
-		
-	} else {
+	}
+	latency_record(pcb->latency_event, t, mt_precise_ns() - start);
 
-		/* put the team on front of the topic */
+	if(t){
+		tenant_release(t);
+	}
+	return rc;
+}
 
-		/* calculate the length of the new payload */
-		new_sub_len = strlen(team) + sizeof('/') + strlen(ed->data.topic_filter) + 1;
+static void callbacks_unregister_set(bool timed, size_t count)
+{
+	size_t i;
 
-		/* Allocate some memory - use
-		* mosquitto_calloc/mosquitto_malloc/mosquitto_strdup when allocating, to
-		* allow the broker to track memory usage */
-		new_sub = mosquitto_calloc(1, new_sub_len);
-		if(new_sub == NULL){
-			return MOSQ_ERR_NOMEM;
+	for(i=0; i<count; i++){
+		mosquitto_callback_unregister(mosq_pid, plugin_callbacks[i].event,
+				timed ? timed_callback : plugin_callbacks[i].cb, NULL);
+	}
+}
+
+static void callbacks_unregister(void)
+{
+	callbacks_unregister_set(callbacks_timed, PLUGIN_CALLBACK_COUNT);
+}
+
+/* Register either the timed or the direct set. On failure, the part of the
+ * set that was registered is removed again. */
+static int callbacks_register_set(bool timed)
+{
+	size_t i;
+	int rc;
+
+	for(i=0; i<PLUGIN_CALLBACK_COUNT; i++){
+		if(timed){
+			rc = mosquitto_callback_register(mosq_pid, plugin_callbacks[i].event,
+					timed_callback, NULL, &plugin_callbacks[i]);
+		}else{
+			rc = mosquitto_callback_register(mosq_pid, plugin_callbacks[i].event,
+					plugin_callbacks[i].cb, NULL, NULL);
 		}
+		if(rc){
+			callbacks_unregister_set(timed, i);
+			return rc;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
 
-		/* prepend the team to the subscription */
-		snprintf(new_sub, new_sub_len, "%s/%s", team, ed->data.topic_filter);
+static int callbacks_register(void)
+{
+	return callbacks_register_set(callbacks_timed);
+}
+
+int callbacks_set_timed(bool timed)
+{
+	int rc;
+
+	if(timed == callbacks_timed){
+		return MOSQ_ERR_SUCCESS;
 	}
-	/* Assign the new topic to the event data structure. You
-	 * must *not* free the original topic, it will be handled by the
-	 * broker. */
-	ed->data.topic_filter = new_sub;
+	/* Register the new set before removing the old one, so that a failure
+	 * leaves the old set in place rather than clients with no rewriting.
+	 * Callbacks all run on the broker thread, so no event sees both. */
+	rc = callbacks_register_set(timed);
+	if(rc){
+		return rc;
+	}
+	callbacks_unregister();
+	callbacks_timed = timed;
+	return MOSQ_ERR_SUCCESS;
+}
+
 
-	mosquitto_free((void *)team);
+static int global_namespace_set(const char *value)
+{
+	size_t len = strlen(value);
 
+	while(len > 0 && value[len-1] == '/'){
+		len--;
+	}
+	if(len == 0 || strpbrk(value, "+#")){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid global_namespace '%s'.", value);
+		return MOSQ_ERR_INVAL;
+	}
+	mosquitto_free(global_namespace);
+	global_namespace = mosquitto_malloc(len + 1);
+	if(global_namespace == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(global_namespace, value, len);
+	global_namespace[len] = 0;
+	global_namespace_len = len;
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* The global namespace must not be somewhere a tenant prefix, or a topic the
+ * broker treats specially, could start. A tenant name is made only of
+ * tenant_charset characters, so checking the first character covers every
+ * "team/" prefix. Called once all the options have been read, as
+ * tenant_charset may come after global_namespace. */
+static int global_namespace_check(void)
+{
+	static const char *reserved[] = {"$t", "$share", "$SYS"};
+	size_t i, len;
+
+	if(global_namespace == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(tenant_charset[(unsigned char)global_namespace[0]]){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": global_namespace '%s' could clash with a tenant prefix, "
+				"it must not start with a tenant_charset character.", global_namespace);
+		return MOSQ_ERR_INVAL;
+	}
+	for(i=0; i<sizeof(reserved)/sizeof(reserved[0]); i++){
+		len = strlen(reserved[i]);
+		if(!strncmp(global_namespace, reserved[i], len)
+				&& (global_namespace[len] == '/' || global_namespace[len] == 0)){
+
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": global_namespace must not be under %s.", reserved[i]);
+			return MOSQ_ERR_INVAL;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
 
 int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *opts, int opt_count)
 {
-	int i, found = 0;
+	int i, rc, found = 0;
 	UNUSED(user_data);
 
 	mosq_pid = identifier;
 	mosquitto_plugin_set_info(identifier, PLUGIN_NAME, PLUGIN_VERSION);
 
+	tenant_charset_parse("a-z0-9");
+
 	/* Find the configuration regex*/
 	for(i=0; i<opt_count; i++) {
 		if (!strcasecmp(opts[i].key, "regex")) {
-			regcomp(&username_match, opts[i].value, REG_EXTENDED);
+			rc = tenant_rule_add(opts[i].value);
+			if(rc) return rc;
 			found = 1;
+		}else if(!strcasecmp(opts[i].key, "tenant_delimiter")){
+			if(strlen(opts[i].value) != 1){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tenant_delimiter must be a single character.");
+				return MOSQ_ERR_INVAL;
+			}
+			tenant_delimiter = opts[i].value[0];
+		}else if(!strcasecmp(opts[i].key, "tenant_side")){
+			if(!strcasecmp(opts[i].value, "left")){
+				tenant_side_left = true;
+			}else if(!strcasecmp(opts[i].value, "right")){
+				tenant_side_left = false;
+			}else{
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tenant_side must be 'left' or 'right'.");
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "tenant_prefix")){
+			if(!strcasecmp(opts[i].value, "id")){
+				tenant_prefix_id = true;
+			}else if(!strcasecmp(opts[i].value, "name")){
+				tenant_prefix_id = false;
+			}else{
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tenant_prefix must be 'name' or 'id'.");
+				return MOSQ_ERR_INVAL;
+			}
+		}else if(!strcasecmp(opts[i].key, "global_namespace")){
+			rc = global_namespace_set(opts[i].value);
+			if(rc) return rc;
+		}else if(!strcasecmp(opts[i].key, "tenant_charset")){
+			if(tenant_charset_parse(opts[i].value)){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Invalid tenant_charset '%s'.", opts[i].value);
+				return MOSQ_ERR_INVAL;
+			}
 		}
 	}
 
-	/* If not found use the default */
-	if (!found) {
-		regcomp(&username_match, "^[a-z0-9]+@([a-z0-9]+)$", REG_EXTENDED);
+	rc = global_namespace_check();
+	if(rc) return rc;
+
+	/* If not found use the default, unless delimiter mode replaces it */
+	if (!found && !tenant_delimiter) {
+		rc = tenant_rule_add("^[a-z0-9]+@([a-z0-9]+)$");
+		if(rc) return rc;
 	}
 
-	regcomp(&shared_sub_match, "^(\\$share/[^/]+)/(.+)$", REG_EXTENDED);
+	slab_pool_init(&tenant_pool, sizeof(struct tenant) + TENANT_POOL_NAMES);
+	slab_pool_init(&client_pool, sizeof(struct team_client));
+	if(tenant_table_resize(TENANT_TABLE_MIN_SIZE) || client_table_resize(CLIENT_TABLE_MIN_SIZE)){
+		return MOSQ_ERR_NOMEM;
+	}
 
-	int rc;
-	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_CONNECT, connect_callback, NULL, NULL);
+	rc = bypass_init(opts, opt_count);
 	if(rc) return rc;
-	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_MESSAGE_IN, callback_message_in, NULL, NULL);
+	rc = limits_init(opts, opt_count);
 	if(rc) return rc;
-	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_MESSAGE_OUT, callback_message_out, NULL, NULL);
+	rc = stats_init(opts, opt_count);
 	if(rc) return rc;
-	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_SUBSCRIBE, callback_subscribe, NULL, NULL);
+	rc = acl_init(opts, opt_count);
 	if(rc) return rc;
-	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_UNSUBSCRIBE, callback_unsubscribe, NULL, NULL);
-	return rc;
+	rc = tenantmap_init(opts, opt_count);
+	if(rc) return rc;
+	rc = downsample_init(opts, opt_count);
+	if(rc) return rc;
+	rc = queue_init();
+	if(rc) return rc;
+	rc = subs_init();
+	if(rc) return rc;
+	rc = latency_init(opts, opt_count);
+	if(rc) return rc;
+	rc = audit_init(opts, opt_count);
+	if(rc) return rc;
+	rc = tap_init(opts, opt_count);
+	if(rc) return rc;
+	rc = control_init();
+	if(rc) return rc;
+	rc = auth_init(opts, opt_count);
+	if(rc) return rc;
+	rc = placement_init(opts, opt_count);
+	if(rc) return rc;
+	rc = evict_init(opts, opt_count);
+	if(rc) return rc;
+	if(limits_connections_limited() || auth_enabled() || placement_enabled()){
+		rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_BASIC_AUTH, basic_auth_callback, NULL, NULL);
+		if(rc) return rc;
+		basic_auth_registered = true;
+	}
+	callbacks_timed = latency_get_mode() != LATENCY_OFF;
+	clients_tracked = evict_enabled();
+	return callbacks_register();
+}
+
+
+int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int opt_count)
+{
+	UNUSED(user_data);
+	UNUSED(opts);
+	UNUSED(opt_count);
+
+	if(basic_auth_registered){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_BASIC_AUTH, basic_auth_callback, NULL);
+		basic_auth_registered = false;
+	}
+	callbacks_unregister();
+	callbacks_timed = false;
+	clients_tracked = false;
+	control_cleanup();
+
+	auth_hint_clear();
+	auth_cleanup();
+	placement_cleanup();
+	evict_cleanup();
+	stats_cleanup();
+	acl_cleanup();
+	tenantmap_cleanup();
+	downsample_cleanup();
+	queue_cleanup();
+	audit_cleanup();
+	tap_cleanup();
+	client_table_cleanup();
+	subs_cleanup();
+	tenant_table_cleanup();
+	ratelimit_cleanup();
+	retain_cleanup();
+	limits_cleanup();
+	bypass_cleanup();
+	tenant_rules_cleanup();
+	mosquitto_free(global_namespace);
+	global_namespace = NULL;
+	global_namespace_len = 0;
+
+	return MOSQ_ERR_SUCCESS;
 }
@@ -0,0 +1,513 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+#ifndef MOSQUITTO_MULTI_TENANT_H
+#define MOSQUITTO_MULTI_TENANT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mosquitto.h"
+
+#define PLUGIN_NAME "multi-tenant"
+
+#define UNUSED(A) (void)(A)
+
+/* Per-tenant limits. A value of 0 means unlimited. The defaults come from
+ * plugin_opt_<name> options and can be overridden per tenant in the
+ * plugin_opt_tenant_config file. */
+struct tenant_limits {
+	uint32_t rate_msgs;
+	uint32_t rate_bytes;
+	uint32_t client_rate_msgs;
+	uint32_t client_rate_bytes;
+	uint32_t max_connections;
+	uint32_t max_subscriptions;
+	uint32_t max_wildcard_subscriptions;
+	uint32_t max_subscription_depth;
+	uint32_t max_payload_size;
+	uint32_t max_retained_msgs;
+	uint32_t max_retained_bytes;
+	uint32_t downsample_interval; /* ms */
+	uint32_t max_queued_bytes;
+	uint32_t tap_sample; /* tap one in every tap_sample publishes */
+	bool rate_enabled; /* any of the rate limits are set */
+	bool subs_enabled; /* any of the subscription limits are set */
+	bool disabled; /* turned off through the control topic */
+};
+
+/* Token bucket for publish rate limiting, holding up to one second's worth
+ * of messages and bytes. */
+struct rate_bucket {
+	double msgs;
+	double bytes;
+	uint64_t last_ns;
+};
+
+/* Per-tenant traffic counters. These are only touched from the broker
+ * thread, so are plain increments. */
+struct tenant_stats {
+	uint64_t messages_in;
+	uint64_t messages_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t subscriptions_rejected;
+	uint64_t clients;
+	uint64_t rewrite_failures;
+	uint64_t rate_limited;
+	uint64_t connections_rejected;
+	uint64_t payload_rejected;
+	uint64_t retained_rejected;
+	uint64_t downsampled;
+	uint64_t audit_dropped;
+	uint64_t queue_dropped;
+	uint64_t queue_rejected;
+	uint64_t evicted;
+	uint64_t tapped;
+	uint64_t tap_dropped;
+	uint64_t global_rejected;
+};
+
+/* Retained messages held by a tenant, see retain.c. These outlive the
+ * tenant entry, which goes when its last client disconnects. */
+struct retain_usage {
+	struct retain_usage *next;
+	char *name;
+	size_t name_len;
+	uint32_t hash;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+/* Outgoing messages queued for a tenant's persistent sessions, see queue.c.
+ * Like retain_usage these outlive the tenant entry. */
+struct queue_usage {
+	struct queue_usage *next;
+	char *name;
+	size_t name_len;
+	uint32_t hash;
+	uint64_t msgs;
+	uint64_t bytes;    /* estimated from avg_payload */
+	uint32_t avg_payload;
+};
+
+/* Subscriptions held by a tenant's sessions, see subs.c. Sessions can
+ * outlive their connection, so like retain_usage these outlive the tenant
+ * entry. */
+struct subs_usage {
+	struct subs_usage *next;
+	char *name;
+	size_t name_len;
+	uint32_t hash;
+	uint64_t subscriptions;
+	uint64_t wildcard_subscriptions;
+};
+
+/* Tenant registry.
+ *
+ * Every team is interned once, no matter how many clients belong to it. The
+ * entry holds the name, the precomputed "team/" topic prefix and a small
+ * integer id, and is shared by all clients of the team through a reference
+ * count. It is freed when the last client of the team disconnects.
+ *
+ * The id is only for indexing while the broker runs and is reused, so it is
+ * never put in topics. The compact "$t/00af/" prefix uses the prefix_id from
+ * the tenant config file instead.
+ */
+#define TENANT_PREFIX_ID_MAX 0xFFFF
+#define TENANT_PREFIX_ID_FMT "$t/%04x/"
+#define TENANT_PREFIX_ID_LEN 8
+
+struct latency_hist;
+struct team_client;
+
+struct tenant {
+	struct tenant *next;
+	char *name;
+	size_t name_len;
+	char *prefix;
+	size_t prefix_len;
+	uint32_t hash;
+	uint32_t id;
+	uint32_t refcount;
+	uint32_t tap_count;
+	const struct tenant_limits *limits;
+	struct retain_usage *retained; /* NULL if the tenant has no retained quota */
+	struct queue_usage *queued;    /* set on the first connect or publish with a queue cap */
+	struct subs_usage *subs;       /* NULL if out of memory, subscriptions are then not counted */
+	struct team_client *lru_head;  /* connected clients, most recently active first */
+	struct team_client *lru_tail;
+	struct latency_hist *latency;  /* per event type, only in "tenant" mode */
+	struct rate_bucket rate;
+	struct tenant_stats stats;
+};
+
+/* Per-client team cache.
+ *
+ * The team is resolved once, when the client connects, and stored in a table
+ * keyed by the client pointer. The message and subscription callbacks then
+ * only need a hash lookup to find the team, rather than running the username
+ * regex and allocating a copy of the team name for every message. Clients
+ * without a tenant get an entry too, with a NULL tenant, so a lookup for them
+ * ends at their own entry; client_find() returns NULL for them. Entries are
+ * removed when the client disconnects.
+ */
+/* The session a client is using, and the filters it is subscribed to, see
+ * subs.c */
+struct subs_session;
+
+struct team_client {
+	struct team_client *next;
+	struct team_client *lru_prev;
+	struct team_client *lru_next;
+	const struct mosquitto *client;
+	struct tenant *tenant;
+	struct rate_bucket rate;
+	struct subs_session *session;
+	uint64_t active_ns; /* last connect, publish, delivery or (un)subscribe, when eviction is on */
+};
+
+extern mosquitto_plugin_id_t *mosq_pid;
+
+/* USDT probes for bpftrace and perf, built in with "make WITH_USDT=yes" and
+ * compiled out otherwise. Each is a single nop until something attaches to
+ * it. The tenant is always the first two arguments, as name and length, or
+ * NULL and 0 if there is none. See trace/ for scripts that use them. */
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+#define MT_PROBE3(name, a, b, c) DTRACE_PROBE3(multi_tenant, name, a, b, c)
+#define MT_PROBE4(name, a, b, c, d) DTRACE_PROBE4(multi_tenant, name, a, b, c, d)
+#define MT_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(multi_tenant, name, a, b, c, d, e)
+#else
+#define MT_PROBE3(name, a, b, c)
+#define MT_PROBE4(name, a, b, c, d)
+#define MT_PROBE5(name, a, b, c, d, e)
+#endif
+
+/* FNV-1a, used for hashing tenant names and usernames. */
+static inline uint32_t mt_hash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		h ^= (uint8_t)str[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* 64 bit FNV-1a of a topic as the broker stores it, i.e. prefix + topic,
+ * without having to build the prefixed string. */
+static inline uint64_t mt_topic_hash(const char *prefix, size_t prefix_len, const char *topic)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for(i=0; i<prefix_len; i++){
+		h ^= (uint8_t)prefix[i];
+		h *= 1099511628211ULL;
+	}
+	for(; *topic; topic++){
+		h ^= (uint8_t)*topic;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* The coarse monotonic clock is used since it is cheap to read, and its ~4ms
+ * resolution is plenty for rate limits and intervals. */
+static inline uint64_t mt_now_ns(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* A fine grained monotonic clock, for timing callbacks. */
+static inline uint64_t mt_precise_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Find the cache entry for a client, or NULL if it is not a team client. */
+struct team_client *client_find(const struct mosquitto *client);
+
+/* Tenants indexed by id, entries are NULL for unused ids. */
+extern struct tenant **tenant_by_id;
+extern uint32_t tenant_id_max;
+
+struct tenant *tenant_find(const char *name, size_t name_len);
+
+/* mosquitto_broker_publish_copy() for messages from the plugin itself, which
+ * don't pass through the message in callback. The properties, if any, are
+ * freed by the broker. */
+int mt_publish_copy(const char *clientid, const char *topic, int payloadlen, const void *payload, int qos, bool retain,
+		mosquitto_property *properties);
+
+/* True if the topic or filter is in plugin_opt_global_namespace. */
+bool global_topic(const char *topic);
+
+/* Disconnect every client of a tenant, returns how many were kicked. The
+ * tenant may be freed by the time this returns. */
+unsigned int tenant_kick(struct tenant *t);
+
+/* Switch between the plain and timed rewrite callbacks. */
+int callbacks_set_timed(bool timed);
+
+/* Bring the tenants and callbacks up to date with limits changed at runtime. */
+int tenant_limits_changed(void);
+
+/* ==================================================
+ * Object pools
+ * ================================================== */
+struct slab;
+struct slab_pool {
+	size_t size;     /* object size, rounded up for alignment */
+	size_t per_slab;
+	void *free_list;
+	struct slab *slabs;
+	uint64_t in_use;
+	uint64_t capacity;
+};
+
+void slab_pool_init(struct slab_pool *pool, size_t size);
+void slab_pool_cleanup(struct slab_pool *pool);
+void *slab_alloc(struct slab_pool *pool);
+void slab_free(struct slab_pool *pool, void *ptr);
+
+/* ==================================================
+ * Stats
+ * ================================================== */
+int stats_init(struct mosquitto_opt *opts, int opt_count);
+void stats_cleanup(void);
+/* Write the counters of a tenant as "\nname value" lines. */
+void stats_format(const struct tenant *t, char *buf, size_t len);
+/* Keep a tenant's counters when its entry is freed, and give them back to
+ * the next entry for the same name. */
+void stats_tenant_park(const struct tenant *t);
+void stats_tenant_restore(struct tenant *t);
+
+/* ==================================================
+ * Latency histograms
+ * ================================================== */
+enum latency_event {
+	LATENCY_CONNECT,
+	LATENCY_DISCONNECT,
+	LATENCY_MESSAGE_IN,
+	LATENCY_MESSAGE_OUT,
+	LATENCY_SUBSCRIBE,
+	LATENCY_UNSUBSCRIBE,
+	LATENCY_EVENT_COUNT
+};
+
+enum latency_mode {
+	LATENCY_OFF,
+	LATENCY_GLOBAL,
+	LATENCY_TENANT,
+};
+
+int latency_init(struct mosquitto_opt *opts, int opt_count);
+int latency_mode_parse(const char *value, enum latency_mode *out);
+enum latency_mode latency_get_mode(void);
+int latency_set_mode(enum latency_mode mode);
+void latency_record(enum latency_event event, struct tenant *t, uint64_t ns);
+void latency_publish(void);
+void latency_publish_tenant(struct tenant *t);
+void latency_tenant_free(struct tenant *t);
+
+/* ==================================================
+ * Control topic
+ * ================================================== */
+int control_init(void);
+void control_cleanup(void);
+
+/* ==================================================
+ * ACL
+ * ================================================== */
+int acl_init(struct mosquitto_opt *opts, int opt_count);
+void acl_cleanup(void);
+/* Register the ACL check if subscription limits have been set at runtime. */
+int acl_limits_changed(void);
+
+/* ==================================================
+ * Tenant map
+ * ================================================== */
+int tenantmap_init(struct mosquitto_opt *opts, int opt_count);
+void tenantmap_cleanup(void);
+bool tenantmap_lookup(const char *username, const char **team, size_t *team_len);
+int tenantmap_reload(void);
+/* Compile a text map into a snapshot, see snapshot/mt_snapshot. */
+int tenantmap_compile(const char *in, const char *out);
+
+/* ==================================================
+ * Limits
+ * ================================================== */
+int limits_init(struct mosquitto_opt *opts, int opt_count);
+void limits_cleanup(void);
+const struct tenant_limits *limits_find(const char *name, size_t name_len);
+/* The configured prefix_id for a tenant, or -1 if it has none. */
+int32_t limits_prefix_id(const char *name, size_t name_len);
+const char *limits_node(const char *name, size_t name_len);
+int limits_check_nodes(int (*check)(const char *tenant, const char *node));
+/* Global cap on the number of tenants with connected clients, 0 if unset. */
+uint32_t limits_max_tenants(void);
+/* True if max_connections is set for any tenant, or max_tenants is set. */
+bool limits_connections_limited(void);
+/* True if any subscription limit is set for any tenant. */
+bool limits_subscriptions_limited(void);
+/* True if downsample_interval is set for any tenant. */
+bool limits_downsampling(void);
+/* True if max_queued_bytes is set for any tenant. */
+bool limits_queue_limited(void);
+int limits_tenant_set(const char *name, int count, char **settings);
+/* As limits_tenant_set(), and turn the tenant back on in the same step. */
+int limits_tenant_add(const char *name, int count, char **settings);
+int limits_tenant_enable(const char *name, bool enabled);
+void limits_format(const char *name, char *buf, size_t len);
+
+/* ==================================================
+ * Rate limiting
+ * ================================================== */
+bool ratelimit_allow(struct team_client *tc, uint32_t payloadlen);
+/* Keep a bucket that isn't full yet when its client (keyed by client id) or
+ * tenant (keyed by name) goes, until it would have refilled. */
+void ratelimit_park(const char *key, size_t key_len, bool tenant, const struct rate_bucket *b,
+		uint32_t rate_msgs, uint32_t rate_bytes);
+/* Take back a parked bucket. b is left alone if there isn't one. */
+void ratelimit_restore(const char *key, size_t key_len, bool tenant, struct rate_bucket *b);
+void ratelimit_cleanup(void);
+
+/* ==================================================
+ * Retained quotas
+ * ================================================== */
+struct retain_usage *retain_usage_get(const char *name, size_t name_len);
+/* Account for a retained publish to topic (without the tenant prefix).
+ * Returns false if it would take the tenant over its retained quota. */
+bool retain_allow(struct tenant *t, const char *topic, uint32_t payloadlen);
+void retain_cleanup(void);
+
+/* ==================================================
+ * Downsampling
+ * ================================================== */
+int downsample_init(struct mosquitto_opt *opts, int opt_count);
+void downsample_cleanup(void);
+/* Start the downsampler if downsample_interval has been set at runtime. */
+int downsample_limits_changed(void);
+/* Returns false if the publish should be held back for now. */
+bool downsample_allow(const struct tenant *t, const struct mosquitto_evt_message *ed);
+
+/* ==================================================
+ * Queued messages
+ * ================================================== */
+int queue_init(void);
+void queue_cleanup(void);
+/* Start counting queued messages if max_queued_bytes has been set at runtime. */
+int queue_limits_changed(void);
+/* Returns false if the tenant has too much queued to take this publish. */
+bool queue_allow(struct tenant *t, const struct mosquitto_evt_message *ed);
+/* Count the session of a tenant client that has just connected. */
+void queue_client_attach(const struct team_client *tc);
+/* The client has disconnected. Its session is only forgotten if the broker
+ * doesn't keep it. */
+void queue_client_cleanup(const struct team_client *tc);
+
+/* ==================================================
+ * Subscription budget
+ * ================================================== */
+int subs_init(void);
+void subs_cleanup(void);
+/* Start tracking sessions if a subscription limit has been set at runtime. */
+int subs_limits_changed(void);
+/* Find the usage record for a tenant, creating it if needed. Returns NULL if
+ * out of memory. */
+struct subs_usage *subs_usage_get(const char *name, size_t name_len);
+/* Pick up the client's session, by its rewritten client id, on connect. */
+void subs_client_attach(struct team_client *tc);
+bool subs_allowed(const struct team_client *tc, const char *filter);
+int subs_add(struct team_client *tc, const char *filter);
+void subs_remove(struct team_client *tc, const char *filter);
+/* The client has disconnected. Its session's subscriptions are only counted
+ * off if the broker doesn't keep the session. */
+void subs_client_cleanup(struct team_client *tc);
+
+/* ==================================================
+ * Authentication
+ * ================================================== */
+int auth_init(struct mosquitto_opt *opts, int opt_count);
+void auth_cleanup(void);
+/* True if plugin_opt_password_file or plugin_opt_password_dir is set. */
+bool auth_enabled(void);
+/* Check a username and password, team is NULL for clients without a team.
+ * Returns MOSQ_ERR_PLUGIN_DEFER for users this plugin has no password for. */
+int auth_check(const char *username, const char *password, const char *team, size_t team_len);
+
+/* ==================================================
+ * Cluster placement
+ * ================================================== */
+int placement_init(struct mosquitto_opt *opts, int opt_count);
+void placement_cleanup(void);
+/* True if plugin_opt_cluster_nodes is set. */
+bool placement_enabled(void);
+/* True if the tenant belongs on this node. */
+bool placement_local(const char *team, size_t team_len);
+/* Write the node a tenant belongs on as "\n<node> <address>". */
+void placement_format(const char *team, size_t team_len, char *buf, size_t len);
+
+/* ==================================================
+ * Listener scope and bypass
+ * ================================================== */
+int bypass_init(struct mosquitto_opt *opts, int opt_count);
+void bypass_cleanup(void);
+/* True if the client is not on one of plugin_opt_listeners, or is one of the
+ * bypass users, and so is never given a tenant. */
+bool bypass_client(const struct mosquitto *client, const char *username);
+
+/* ==================================================
+ * Idle eviction
+ * ================================================== */
+int evict_init(struct mosquitto_opt *opts, int opt_count);
+void evict_cleanup(void);
+/* True if plugin_opt_memory_high is set. */
+bool evict_enabled(void);
+
+/* ==================================================
+ * Audit log
+ * ================================================== */
+int audit_init(struct mosquitto_opt *opts, int opt_count);
+void audit_cleanup(void);
+void audit_connect(const struct team_client *tc);
+void audit_disconnect(const struct team_client *tc);
+void audit_subscribe(const struct team_client *tc, const char *filter, bool unsubscribe);
+void audit_publish(const struct team_client *tc, const struct mosquitto_evt_message *ed);
+
+/* ==================================================
+ * Message tap
+ * ================================================== */
+int tap_init(struct mosquitto_opt *opts, int opt_count);
+void tap_cleanup(void);
+/* Copy a publish to the tap sink, subject to the tenant's tap_sample. The
+ * topic must not have the tenant prefix yet. */
+void tap_message(struct tenant *t, const struct mosquitto_evt_message *ed);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Tenant placement across a cluster of brokers.
+ *
+ * plugin_opt_cluster_nodes lists the brokers as <name>=<address> pairs, and
+ * plugin_opt_cluster_self says which of them this one is:
+ *
+ *   plugin_opt_cluster_nodes a=mqtt-a:1883 b=mqtt-b:1883 c=mqtt-c:1883
+ *   plugin_opt_cluster_self a
+ *
+ * Each tenant belongs on exactly one node. Tenants with a "node" in the
+ * tenant config file stay on that node, the rest are placed by consistent
+ * hashing: every node has CLUSTER_VNODES points on a 64 bit ring, and a
+ * tenant belongs to the node of the first point after its own hash. Adding
+ * or removing a node only moves the tenants next to its points.
+ *
+ * Clients of tenants that belong on another node are refused when they
+ * authenticate. The broker gives plugins no way to send an MQTT v5 Server
+ * Reference with the CONNACK, so the "placement" control command tells a
+ * connection router or provisioning service where a tenant lives instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define CLUSTER_VNODES 128
+
+struct cluster_node {
+	char *name;
+	char *address;
+};
+
+struct ring_point {
+	uint64_t hash;
+	uint32_t node;
+};
+
+static struct cluster_node *nodes = NULL;
+static uint32_t node_count = 0;
+static uint32_t self = 0;
+static struct ring_point *ring = NULL;
+static size_t ring_count = 0;
+
+/* FNV-1a mixes the low bits poorly, which would bunch up the ring points
+ * of names that only differ at the end. */
+static uint64_t ring_hash(const char *str, size_t len)
+{
+	uint64_t h = mt_topic_hash(str, len, "");
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+	const struct ring_point *pa = a, *pb = b;
+
+	if(pa->hash < pb->hash) return -1;
+	if(pa->hash > pb->hash) return 1;
+	return 0;
+}
+
+static int node_find(const char *name)
+{
+	uint32_t i;
+
+	for(i=0; i<node_count; i++){
+		if(!strcmp(nodes[i].name, name)){
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static const struct cluster_node *placement_owner(const char *team, size_t team_len)
+{
+	const char *pin;
+	uint64_t hash;
+	size_t lo, hi, mid;
+	int n;
+
+	pin = limits_node(team, team_len);
+	if(pin){
+		/* Pins are checked at startup */
+		n = node_find(pin);
+		if(n >= 0){
+			return &nodes[n];
+		}
+	}
+
+	hash = ring_hash(team, team_len);
+	lo = 0;
+	hi = ring_count;
+	while(lo < hi){
+		mid = lo + (hi - lo)/2;
+		if(ring[mid].hash < hash){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	if(lo == ring_count){
+		/* Wrap around */
+		lo = 0;
+	}
+	return &nodes[ring[lo].node];
+}
+
+bool placement_enabled(void)
+{
+	return node_count > 0;
+}
+
+bool placement_local(const char *team, size_t team_len)
+{
+	if(node_count == 0){
+		return true;
+	}
+	return placement_owner(team, team_len) == &nodes[self];
+}
+
+void placement_format(const char *team, size_t team_len, char *buf, size_t len)
+{
+	const struct cluster_node *n;
+	size_t i, used = 0;
+	int rc;
+
+	buf[0] = 0;
+	if(team){
+		n = placement_owner(team, team_len);
+		snprintf(buf, len, "\n%s %s", n->name, n->address);
+		return;
+	}
+	for(i=0; i<node_count && used<len; i++){
+		rc = snprintf(buf + used, len - used, "\n%s %s%s", nodes[i].name, nodes[i].address, i == self ? " self" : "");
+		if(rc < 0){
+			return;
+		}
+		used += (size_t)rc;
+	}
+}
+
+static int placement_add_node(char *spec)
+{
+	struct cluster_node *new_nodes;
+	char *address;
+
+	address = strchr(spec, '=');
+	if(address == NULL || address == spec || address[1] == 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": cluster_nodes entries must be <name>=<address>, not '%s'.", spec);
+		return MOSQ_ERR_INVAL;
+	}
+	*address = 0;
+	address++;
+	if(node_find(spec) >= 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Duplicate cluster node '%s'.", spec);
+		return MOSQ_ERR_INVAL;
+	}
+
+	new_nodes = mosquitto_realloc(nodes, (node_count+1)*sizeof(struct cluster_node));
+	if(new_nodes == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	nodes = new_nodes;
+	nodes[node_count].name = mosquitto_strdup(spec);
+	nodes[node_count].address = mosquitto_strdup(address);
+	node_count++;
+	if(nodes[node_count-1].name == NULL || nodes[node_count-1].address == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int placement_check_pin(const char *tenant, const char *node)
+{
+	if(node_find(node) < 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Tenant '%s' is pinned to unknown node '%s'.", tenant, node);
+		return MOSQ_ERR_INVAL;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int placement_init(struct mosquitto_opt *opts, int opt_count)
+{
+	const char *self_name = NULL;
+	char *list = NULL, *tok, *saveptr = NULL;
+	char point[300];
+	uint32_t i, v;
+	int n, rc;
+
+	for(i=0; i<(uint32_t)opt_count; i++){
+		if(!strcasecmp(opts[i].key, "cluster_nodes")){
+			list = opts[i].value;
+		}else if(!strcasecmp(opts[i].key, "cluster_self")){
+			self_name = opts[i].value;
+		}
+	}
+	if(list == NULL && self_name == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(list == NULL || self_name == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": cluster_nodes and cluster_self must be set together.");
+		return MOSQ_ERR_INVAL;
+	}
+
+	list = mosquitto_strdup(list);
+	if(list == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	rc = MOSQ_ERR_SUCCESS;
+	for(tok=strtok_r(list, " \t,", &saveptr); tok && rc == MOSQ_ERR_SUCCESS; tok=strtok_r(NULL, " \t,", &saveptr)){
+		rc = placement_add_node(tok);
+	}
+	mosquitto_free(list);
+	if(rc){
+		return rc;
+	}
+
+	n = node_find(self_name);
+	if(n < 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": cluster_self '%s' is not in cluster_nodes.", self_name);
+		return MOSQ_ERR_INVAL;
+	}
+	self = (uint32_t)n;
+
+	rc = limits_check_nodes(placement_check_pin);
+	if(rc){
+		return rc;
+	}
+
+	ring = mosquitto_malloc(node_count*CLUSTER_VNODES*sizeof(struct ring_point));
+	if(ring == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<node_count; i++){
+		for(v=0; v<CLUSTER_VNODES; v++){
+			n = snprintf(point, sizeof(point), "%s#%u", nodes[i].name, v);
+			ring[ring_count].hash = ring_hash(point, (size_t)n < sizeof(point) ? (size_t)n : sizeof(point) - 1);
+			ring[ring_count].node = i;
+			ring_count++;
+		}
+	}
+	qsort(ring, ring_count, sizeof(struct ring_point), ring_point_cmp);
+
+	mosquitto_log_printf(MOSQ_LOG_INFO, PLUGIN_NAME ": Cluster of %u nodes, this is '%s'.", node_count, nodes[self].name);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void placement_cleanup(void)
+{
+	uint32_t i;
+
+	for(i=0; i<node_count; i++){
+		mosquitto_free(nodes[i].name);
+		mosquitto_free(nodes[i].address);
+	}
+	mosquitto_free(nodes);
+	nodes = NULL;
+	node_count = 0;
+	self = 0;
+	mosquitto_free(ring);
+	ring = NULL;
+	ring_count = 0;
+}
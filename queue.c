@@ -0,0 +1,365 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant caps on queued messages.
+ *
+ * The broker tells plugins about every message it queues for, and removes
+ * from, a persistent session through the persistence events, so those are
+ * used to count the outgoing messages each tenant's clients have waiting,
+ * queued or inflight. The events only carry the id of the stored message,
+ * not its size, so each queued message is counted at the tenant's average
+ * publish payload size (a moving average over its recent publishes) and the
+ * bytes are approximate.
+ *
+ * Only sessions the plugin rewrote are counted. A tenant client's session is
+ * attached to its tenant when the client connects and kept until the broker
+ * deletes it, or until a clean session client disconnects with nothing
+ * queued. Events for any other client id are ignored, so a client without a
+ * tenant can't charge a tenant by connecting as <id>@<team>. Sessions
+ * restored from persistence, or of tenants that get max_queued_bytes at
+ * runtime, are counted from their client's next connect.
+ *
+ * Once a tenant with max_queued_bytes reaches 3/4 of it, its QoS 0 publishes
+ * are dropped; at the cap, QoS 1 and 2 publishes are refused as well, until
+ * the consumers catch up. Counts are kept per session so that a session that
+ * is removed returns all of its messages, and per tenant, for the life of the
+ * plugin, since sessions outlive the tenant's connected clients.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define QUEUE_TABLE_MIN_SIZE 1024
+#define USAGE_TABLE_SIZE 256
+#define QUEUE_DIRECTION_OUT 1 /* mosq_md_out */
+
+struct queue_client {
+	struct queue_client *next;
+	struct queue_usage *usage;
+	uint64_t msgs;
+	uint64_t bytes;
+	uint32_t hash;
+	char clientid[];
+};
+
+static struct queue_client **client_table = NULL;
+static size_t client_table_size = 0; /* always a power of two */
+static size_t client_count = 0;
+
+static struct queue_usage *usage_table[USAGE_TABLE_SIZE];
+static bool queue_registered = false;
+
+static struct queue_usage *queue_usage_get(const char *name, size_t name_len)
+{
+	struct queue_usage *u;
+	uint32_t hash = mt_hash(name, name_len);
+
+	for(u=usage_table[hash % USAGE_TABLE_SIZE]; u; u=u->next){
+		if(u->hash == hash && u->name_len == name_len && !memcmp(u->name, name, name_len)){
+			return u;
+		}
+	}
+
+	u = mosquitto_calloc(1, sizeof(struct queue_usage) + name_len + 1);
+	if(u == NULL){
+		return NULL;
+	}
+	u->name = (char *)(u + 1);
+	memcpy(u->name, name, name_len);
+	u->name_len = name_len;
+	u->hash = hash;
+	u->next = usage_table[hash % USAGE_TABLE_SIZE];
+	usage_table[hash % USAGE_TABLE_SIZE] = u;
+	return u;
+}
+
+static int client_table_resize(size_t new_size)
+{
+	struct queue_client **new_table, *c, *next;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct queue_client *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<client_table_size; i++){
+		for(c=client_table[i]; c; c=next){
+			next = c->next;
+			c->next = new_table[c->hash & (new_size-1)];
+			new_table[c->hash & (new_size-1)] = c;
+		}
+	}
+	mosquitto_free(client_table);
+	client_table = new_table;
+	client_table_size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct queue_client **queue_client_find(const char *clientid)
+{
+	struct queue_client **prev;
+	uint32_t hash;
+
+	if(client_count == 0){
+		return NULL;
+	}
+	hash = mt_hash(clientid, strlen(clientid));
+	for(prev=&client_table[hash & (client_table_size-1)]; *prev; prev=&(*prev)->next){
+		if((*prev)->hash == hash && !strcmp((*prev)->clientid, clientid)){
+			return prev;
+		}
+	}
+	return NULL;
+}
+
+static void queue_client_remove(struct queue_client **prev)
+{
+	struct queue_client *c = *prev;
+
+	c->usage->msgs -= c->msgs;
+	c->usage->bytes -= c->bytes;
+	*prev = c->next;
+	mosquitto_free(c);
+	client_count--;
+}
+
+void queue_client_attach(const struct team_client *tc)
+{
+	struct queue_client **prev, *c;
+	struct queue_usage *u;
+	const char *clientid;
+	size_t len;
+	uint32_t hash;
+
+	if(!tc->tenant->limits->max_queued_bytes){
+		return;
+	}
+	u = queue_usage_get(tc->tenant->name, tc->tenant->name_len);
+	if(u == NULL){
+		return;
+	}
+	tc->tenant->queued = u;
+	clientid = mosquitto_client_id(tc->client);
+	prev = queue_client_find(clientid);
+	if(prev){
+		if((*prev)->usage == u){
+			return;
+		}
+		/* Only possible if the tenant map changed the team */
+		queue_client_remove(prev);
+	}
+
+	if(client_count >= client_table_size - client_table_size/4){
+		if(client_table_resize(client_table_size ? client_table_size*2 : QUEUE_TABLE_MIN_SIZE)){
+			return;
+		}
+	}
+	len = strlen(clientid);
+	hash = mt_hash(clientid, len);
+	c = mosquitto_malloc(sizeof(struct queue_client) + len + 1);
+	if(c == NULL){
+		return;
+	}
+	memcpy(c->clientid, clientid, len + 1);
+	c->hash = hash;
+	c->usage = u;
+	c->msgs = 0;
+	c->bytes = 0;
+	c->next = client_table[hash & (client_table_size-1)];
+	client_table[hash & (client_table_size-1)] = c;
+	client_count++;
+}
+
+void queue_client_cleanup(const struct team_client *tc)
+{
+	struct queue_client **prev;
+
+	if(!mosquitto_client_clean_session(tc->client)){
+		return;
+	}
+	prev = queue_client_find(mosquitto_client_id(tc->client));
+	if(prev && (*prev)->msgs == 0){
+		queue_client_remove(prev);
+	}
+}
+
+static int queue_msg_add_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_persist_client_msg *ed = event_data;
+	struct queue_client **prev, *c;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->direction != QUEUE_DIRECTION_OUT || ed->clientid == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	prev = queue_client_find(ed->clientid);
+	if(prev == NULL){
+		/* Not a session of a tenant client */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	c = *prev;
+	c->msgs++;
+	c->bytes += c->usage->avg_payload;
+	c->usage->msgs++;
+	c->usage->bytes += c->usage->avg_payload;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int queue_msg_delete_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_persist_client_msg *ed = event_data;
+	struct queue_client **prev, *c;
+	uint64_t bytes;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->direction != QUEUE_DIRECTION_OUT || ed->clientid == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	prev = queue_client_find(ed->clientid);
+	if(prev == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	c = *prev;
+	if(c->msgs == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+	/* Give back the session's average, the size of this one isn't known */
+	bytes = c->msgs == 1 ? c->bytes : c->bytes / c->msgs;
+	c->msgs--;
+	c->bytes -= bytes;
+	c->usage->msgs--;
+	c->usage->bytes -= bytes;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int queue_client_delete_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_persist_client *ed = event_data;
+	struct queue_client **prev;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->clientid == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	prev = queue_client_find(ed->clientid);
+	if(prev){
+		queue_client_remove(prev);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool queue_allow(struct tenant *t, const struct mosquitto_evt_message *ed)
+{
+	struct queue_usage *u = t->queued;
+	uint32_t cap = t->limits->max_queued_bytes;
+
+	if(u == NULL){
+		u = queue_usage_get(t->name, t->name_len);
+		if(u == NULL){
+			return true;
+		}
+		t->queued = u;
+		if(u->avg_payload == 0){
+			u->avg_payload = ed->payloadlen;
+		}
+	}
+	/* Moving average over about the last 8 publishes */
+	u->avg_payload = (uint32_t)(((uint64_t)u->avg_payload*7 + ed->payloadlen)/8);
+
+	if(ed->qos == 0){
+		return u->bytes < cap - cap/4;
+	}
+	return u->bytes < cap;
+}
+
+static const struct {
+	int event;
+	MOSQ_FUNC_generic_callback cb;
+} queue_callbacks[] = {
+	{MOSQ_EVT_PERSIST_CLIENT_MSG_ADD, queue_msg_add_callback},
+	{MOSQ_EVT_PERSIST_CLIENT_MSG_DELETE, queue_msg_delete_callback},
+	{MOSQ_EVT_PERSIST_CLIENT_DELETE, queue_client_delete_callback},
+};
+#define QUEUE_CALLBACK_COUNT (sizeof(queue_callbacks)/sizeof(queue_callbacks[0]))
+
+int queue_limits_changed(void)
+{
+	size_t i;
+	int rc;
+
+	if(queue_registered || !limits_queue_limited()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	for(i=0; i<QUEUE_CALLBACK_COUNT; i++){
+		rc = mosquitto_callback_register(mosq_pid, queue_callbacks[i].event, queue_callbacks[i].cb, NULL, NULL);
+		if(rc){
+			while(i > 0){
+				i--;
+				mosquitto_callback_unregister(mosq_pid, queue_callbacks[i].event, queue_callbacks[i].cb, NULL);
+			}
+			return rc;
+		}
+	}
+	queue_registered = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int queue_init(void)
+{
+	return queue_limits_changed();
+}
+
+void queue_cleanup(void)
+{
+	struct queue_client *c, *next;
+	struct queue_usage *u, *u_next;
+	size_t i;
+
+	if(queue_registered){
+		for(i=0; i<QUEUE_CALLBACK_COUNT; i++){
+			mosquitto_callback_unregister(mosq_pid, queue_callbacks[i].event, queue_callbacks[i].cb, NULL);
+		}
+		queue_registered = false;
+	}
+
+	for(i=0; i<client_table_size; i++){
+		for(c=client_table[i]; c; c=next){
+			next = c->next;
+			mosquitto_free(c);
+		}
+	}
+	mosquitto_free(client_table);
+	client_table = NULL;
+	client_table_size = 0;
+	client_count = 0;
+
+	for(i=0; i<USAGE_TABLE_SIZE; i++){
+		for(u=usage_table[i]; u; u=u_next){
+			u_next = u->next;
+			mosquitto_free(u);
+		}
+		usage_table[i] = NULL;
+	}
+}
@@ -0,0 +1,251 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Token bucket publish rate limiting, per tenant and per client.
+ *
+ * Each bucket refills at the configured rate and holds at most one second's
+ * worth of tokens, so a tenant can burst up to its per-second limit.
+ *
+ * The buckets live on the client and tenant entries, which go when the
+ * client disconnects and when the tenant's last client does. A bucket that
+ * isn't full yet is parked, keyed by the client id or tenant name, until it
+ * would have refilled, so that reconnecting doesn't hand out a full bucket.
+ * Parked buckets are kept in the order they were parked and dropped from the
+ * oldest end. A bucket in debt from a message larger than the whole bucket
+ * is kept for at most RATE_PARK_MAX_NS.
+ */
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define RATE_PARK_TABLE_SIZE 1024
+#define RATE_PARK_MAX_NS 60000000000ULL
+
+struct rate_park {
+	struct rate_park *next;       /* hash chain */
+	struct rate_park *age_prev;   /* towards older */
+	struct rate_park *age_next;   /* towards newer */
+	struct rate_bucket rate;
+	uint64_t expires_ns;
+	uint32_t hash;
+	bool tenant;
+	size_t key_len;
+	char key[];
+};
+
+static struct rate_park *park_table[RATE_PARK_TABLE_SIZE];
+static struct rate_park *park_oldest = NULL;
+static struct rate_park *park_newest = NULL;
+
+static void bucket_refill(struct rate_bucket *b, uint32_t rate_msgs, uint32_t rate_bytes, uint64_t now)
+{
+	double elapsed;
+
+	if(b->last_ns == 0){
+		/* New bucket, start full */
+		b->msgs = rate_msgs;
+		b->bytes = rate_bytes;
+	}else if(now > b->last_ns){
+		elapsed = (double)(now - b->last_ns) / 1e9;
+		b->msgs += elapsed * rate_msgs;
+		if(b->msgs > rate_msgs) b->msgs = rate_msgs;
+		b->bytes += elapsed * rate_bytes;
+		if(b->bytes > rate_bytes) b->bytes = rate_bytes;
+	}
+	b->last_ns = now;
+}
+
+static bool bucket_has(const struct rate_bucket *b, uint32_t rate_msgs, uint32_t rate_bytes, uint32_t payloadlen)
+{
+	if(rate_msgs && b->msgs < 1.0){
+		return false;
+	}
+	/* A message larger than the whole bucket is allowed through when the
+	 * bucket is full, otherwise it could never be sent at all. */
+	if(rate_bytes && b->bytes < payloadlen && b->bytes < rate_bytes){
+		return false;
+	}
+	return true;
+}
+
+/* Only the limited dimensions are taken from, so a limit set later through
+ * the control topic starts from a full bucket rather than a large debt. */
+static void bucket_take(struct rate_bucket *b, uint32_t rate_msgs, uint32_t rate_bytes, uint32_t payloadlen)
+{
+	if(rate_msgs){
+		b->msgs -= 1.0;
+	}
+	if(rate_bytes){
+		b->bytes -= payloadlen;
+	}
+}
+
+/* Returns true if the client may publish a message of payloadlen bytes,
+ * and takes the tokens for it from the tenant and client buckets. */
+bool ratelimit_allow(struct team_client *tc, uint32_t payloadlen)
+{
+	const struct tenant_limits *l = tc->tenant->limits;
+	struct rate_bucket *tb = &tc->tenant->rate;
+	struct rate_bucket *cb = &tc->rate;
+	bool tenant_limited = l->rate_msgs || l->rate_bytes;
+	bool client_limited = l->client_rate_msgs || l->client_rate_bytes;
+	uint64_t now = mt_now_ns();
+
+	if(tenant_limited){
+		bucket_refill(tb, l->rate_msgs, l->rate_bytes, now);
+		if(!bucket_has(tb, l->rate_msgs, l->rate_bytes, payloadlen)){
+			return false;
+		}
+	}
+	if(client_limited){
+		bucket_refill(cb, l->client_rate_msgs, l->client_rate_bytes, now);
+		if(!bucket_has(cb, l->client_rate_msgs, l->client_rate_bytes, payloadlen)){
+			return false;
+		}
+		bucket_take(cb, l->client_rate_msgs, l->client_rate_bytes, payloadlen);
+	}
+	if(tenant_limited){
+		bucket_take(tb, l->rate_msgs, l->rate_bytes, payloadlen);
+	}
+	return true;
+}
+
+/* Time until the bucket is full again */
+static uint64_t bucket_refill_ns(const struct rate_bucket *b, uint32_t rate_msgs, uint32_t rate_bytes)
+{
+	double secs = 0.0, s;
+
+	if(rate_msgs && b->msgs < rate_msgs){
+		secs = (rate_msgs - b->msgs) / rate_msgs;
+	}
+	if(rate_bytes && b->bytes < rate_bytes){
+		s = (rate_bytes - b->bytes) / rate_bytes;
+		if(s > secs) secs = s;
+	}
+	if(secs * 1e9 >= (double)RATE_PARK_MAX_NS){
+		return RATE_PARK_MAX_NS;
+	}
+	return (uint64_t)(secs * 1e9);
+}
+
+static void park_unlink(struct rate_park *p)
+{
+	struct rate_park **prev;
+
+	for(prev=&park_table[p->hash % RATE_PARK_TABLE_SIZE]; *prev; prev=&(*prev)->next){
+		if(*prev == p){
+			*prev = p->next;
+			break;
+		}
+	}
+	if(p->age_prev){
+		p->age_prev->age_next = p->age_next;
+	}else{
+		park_oldest = p->age_next;
+	}
+	if(p->age_next){
+		p->age_next->age_prev = p->age_prev;
+	}else{
+		park_newest = p->age_prev;
+	}
+	mosquitto_free(p);
+}
+
+static void park_expire(uint64_t now)
+{
+	while(park_oldest && park_oldest->expires_ns <= now){
+		park_unlink(park_oldest);
+	}
+}
+
+static struct rate_park *park_find(const char *key, size_t key_len, bool tenant, uint32_t hash)
+{
+	struct rate_park *p;
+
+	for(p=park_table[hash % RATE_PARK_TABLE_SIZE]; p; p=p->next){
+		if(p->hash == hash && p->tenant == tenant && p->key_len == key_len && !memcmp(p->key, key, key_len)){
+			return p;
+		}
+	}
+	return NULL;
+}
+
+void ratelimit_park(const char *key, size_t key_len, bool tenant, const struct rate_bucket *b,
+		uint32_t rate_msgs, uint32_t rate_bytes)
+{
+	struct rate_park *p;
+	uint64_t now = mt_now_ns(), refill_ns;
+	uint32_t hash;
+
+	park_expire(now);
+	if(b->last_ns == 0 || (rate_msgs == 0 && rate_bytes == 0)){
+		return;
+	}
+	refill_ns = bucket_refill_ns(b, rate_msgs, rate_bytes);
+	if(b->last_ns + refill_ns <= now){
+		/* Full again already */
+		return;
+	}
+
+	hash = mt_hash(key, key_len);
+	p = park_find(key, key_len, tenant, hash);
+	if(p){
+		park_unlink(p);
+	}
+	p = mosquitto_malloc(sizeof(struct rate_park) + key_len);
+	if(p == NULL){
+		return;
+	}
+	memcpy(p->key, key, key_len);
+	p->key_len = key_len;
+	p->tenant = tenant;
+	p->hash = hash;
+	p->rate = *b;
+	p->expires_ns = b->last_ns + refill_ns;
+	p->next = park_table[hash % RATE_PARK_TABLE_SIZE];
+	park_table[hash % RATE_PARK_TABLE_SIZE] = p;
+	p->age_next = NULL;
+	p->age_prev = park_newest;
+	if(park_newest){
+		park_newest->age_next = p;
+	}else{
+		park_oldest = p;
+	}
+	park_newest = p;
+}
+
+void ratelimit_restore(const char *key, size_t key_len, bool tenant, struct rate_bucket *b)
+{
+	struct rate_park *p;
+
+	if(park_oldest == NULL){
+		return;
+	}
+	park_expire(mt_now_ns());
+	p = park_find(key, key_len, tenant, mt_hash(key, key_len));
+	if(p){
+		*b = p->rate;
+		park_unlink(p);
+	}
+}
+
+void ratelimit_cleanup(void)
+{
+	while(park_oldest){
+		park_unlink(park_oldest);
+	}
+}
@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant retained message quotas.
+ *
+ * The size of every retained message published by a tenant with a retained
+ * quota is remembered, keyed by a 64 bit hash of the stored topic, so that
+ * replacing or clearing a retained message gives back its share of the
+ * quota. Only the hash is kept, not the topic, so this costs a few bytes per
+ * retained message rather than a second copy of the retained store.
+ *
+ * Usage is kept for the life of the plugin rather than on the tenant entry,
+ * because retained messages outlive the tenant's connected clients. It only
+ * covers messages retained since the broker started; retained messages
+ * loaded from persistence, expired, or removed by an admin are not seen.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define RETAIN_TABLE_MIN_SIZE 1024
+#define USAGE_TABLE_SIZE 256
+
+struct retain_entry {
+	struct retain_entry *next;
+	uint64_t hash;
+	uint32_t size;
+};
+
+static struct retain_entry **retain_table = NULL;
+static size_t retain_table_size = 0; /* always a power of two */
+static size_t retain_count = 0;
+
+static struct retain_usage *usage_table[USAGE_TABLE_SIZE];
+
+static int retain_table_resize(size_t new_size)
+{
+	struct retain_entry **new_table, *e, *next;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct retain_entry *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<retain_table_size; i++){
+		for(e=retain_table[i]; e; e=next){
+			next = e->next;
+			e->next = new_table[e->hash & (new_size-1)];
+			new_table[e->hash & (new_size-1)] = e;
+		}
+	}
+	mosquitto_free(retain_table);
+	retain_table = new_table;
+	retain_table_size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct retain_usage *retain_usage_get(const char *name, size_t name_len)
+{
+	struct retain_usage *u;
+	uint32_t hash = mt_hash(name, name_len);
+
+	for(u=usage_table[hash % USAGE_TABLE_SIZE]; u; u=u->next){
+		if(u->hash == hash && u->name_len == name_len && !memcmp(u->name, name, name_len)){
+			return u;
+		}
+	}
+
+	u = mosquitto_calloc(1, sizeof(struct retain_usage) + name_len + 1);
+	if(u == NULL){
+		return NULL;
+	}
+	u->name = (char *)(u + 1);
+	memcpy(u->name, name, name_len);
+	u->name_len = name_len;
+	u->hash = hash;
+	u->next = usage_table[hash % USAGE_TABLE_SIZE];
+	usage_table[hash % USAGE_TABLE_SIZE] = u;
+	return u;
+}
+
+bool retain_allow(struct tenant *t, const char *topic, uint32_t payloadlen)
+{
+	const struct tenant_limits *l = t->limits;
+	struct retain_usage *u = t->retained;
+	struct retain_entry **prev, *e;
+	uint64_t hash;
+
+	hash = mt_topic_hash(t->prefix, t->prefix_len, topic);
+	if(retain_count){
+		prev = &retain_table[hash & (retain_table_size-1)];
+		for(e=*prev; e; e=e->next){
+			if(e->hash == hash){
+				break;
+			}
+			prev = &e->next;
+		}
+	}else{
+		prev = NULL;
+		e = NULL;
+	}
+
+	if(payloadlen == 0){
+		/* Clearing a retained message is always allowed */
+		if(e){
+			*prev = e->next;
+			u->count--;
+			u->bytes -= e->size;
+			mosquitto_free(e);
+			retain_count--;
+		}
+		return true;
+	}
+
+	if(l->max_retained_msgs && e == NULL && u->count >= l->max_retained_msgs){
+		return false;
+	}
+	if(l->max_retained_bytes && u->bytes - (e ? e->size : 0) + payloadlen > l->max_retained_bytes){
+		return false;
+	}
+
+	if(e){
+		u->bytes = u->bytes - e->size + payloadlen;
+		e->size = payloadlen;
+		return true;
+	}
+
+	if(retain_count >= retain_table_size - retain_table_size/4){
+		if(retain_table_resize(retain_table_size ? retain_table_size*2 : RETAIN_TABLE_MIN_SIZE)){
+			/* Allow it, quotas are best effort when out of memory */
+			return true;
+		}
+	}
+	e = mosquitto_malloc(sizeof(struct retain_entry));
+	if(e == NULL){
+		return true;
+	}
+	e->hash = hash;
+	e->size = payloadlen;
+	e->next = retain_table[hash & (retain_table_size-1)];
+	retain_table[hash & (retain_table_size-1)] = e;
+	retain_count++;
+	u->count++;
+	u->bytes += payloadlen;
+
+	return true;
+}
+
+void retain_cleanup(void)
+{
+	struct retain_entry *e, *next;
+	struct retain_usage *u, *u_next;
+	size_t i;
+
+	for(i=0; i<retain_table_size; i++){
+		for(e=retain_table[i]; e; e=next){
+			next = e->next;
+			mosquitto_free(e);
+		}
+	}
+	mosquitto_free(retain_table);
+	retain_table = NULL;
+	retain_table_size = 0;
+	retain_count = 0;
+
+	for(i=0; i<USAGE_TABLE_SIZE; i++){
+		for(u=usage_table[i]; u; u=u_next){
+			u_next = u->next;
+			mosquitto_free(u);
+		}
+		usage_table[i] = NULL;
+	}
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Fixed size object pools.
+ *
+ * Clients and tenants come and go all the time, and with one heap
+ * allocation each, a reconnect storm of 100k+ clients leaves the heap
+ * fragmented. A pool hands out objects of one size from slabs of
+ * SLAB_BYTES, and freed objects go on a free list to be reused, so memory
+ * use levels off at the peak number of objects and allocating is a couple
+ * of pointer moves.
+ *
+ * Slabs are allocated with mosquitto_malloc, so the broker's memory
+ * accounting and $SYS heap figures include them. They are only given back
+ * when the pool is cleaned up.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define SLAB_BYTES 65536
+#define SLAB_ALIGN 16
+
+struct slab {
+	struct slab *next;
+	uint64_t pad; /* keep the objects SLAB_ALIGN aligned */
+	char objects[];
+};
+
+struct slab_free {
+	struct slab_free *next;
+};
+
+void slab_pool_init(struct slab_pool *pool, size_t size)
+{
+	memset(pool, 0, sizeof(struct slab_pool));
+	pool->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	pool->per_slab = (SLAB_BYTES - sizeof(struct slab)) / pool->size;
+	if(pool->per_slab == 0){
+		pool->per_slab = 1;
+	}
+}
+
+static int slab_grow(struct slab_pool *pool)
+{
+	struct slab *s;
+	struct slab_free *f;
+	size_t i;
+
+	s = mosquitto_malloc(sizeof(struct slab) + pool->per_slab*pool->size);
+	if(s == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	s->next = pool->slabs;
+	pool->slabs = s;
+	/* Threaded backwards so that objects are handed out in address order */
+	for(i=pool->per_slab; i>0; i--){
+		f = (struct slab_free *)(s->objects + (i-1)*pool->size);
+		f->next = pool->free_list;
+		pool->free_list = f;
+	}
+	pool->capacity += pool->per_slab;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void *slab_alloc(struct slab_pool *pool)
+{
+	struct slab_free *f;
+
+	if(pool->free_list == NULL && slab_grow(pool)){
+		return NULL;
+	}
+	f = pool->free_list;
+	pool->free_list = f->next;
+	pool->in_use++;
+	return f;
+}
+
+void slab_free(struct slab_pool *pool, void *ptr)
+{
+	struct slab_free *f = ptr;
+
+	if(ptr == NULL){
+		return;
+	}
+	f->next = pool->free_list;
+	pool->free_list = f;
+	pool->in_use--;
+}
+
+void slab_pool_cleanup(struct slab_pool *pool)
+{
+	struct slab *s, *next;
+
+	for(s=pool->slabs; s; s=next){
+		next = s->next;
+		mosquitto_free(s);
+	}
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+	pool->in_use = 0;
+	pool->capacity = 0;
+}
@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Offline compiler for tenant_map snapshots.
+ *
+ * Reads a text tenant_map with the same parser as the plugin and writes the
+ * binary snapshot the plugin maps into memory, see tenantmap.c. The map
+ * module is linked against stub versions of the broker functions it uses.
+ *
+ * Build and run with:
+ *   make snapshot
+ *   ./snapshot/mt_snapshot tenant-map.conf tenant-map.snap
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+mosquitto_plugin_id_t *mosq_pid = NULL;
+
+/* ==================================================
+ * Broker stubs
+ * ================================================== */
+
+void *mosquitto_calloc(size_t nmemb, size_t size)
+{
+	return calloc(nmemb, size);
+}
+
+void *mosquitto_malloc(size_t size)
+{
+	return malloc(size);
+}
+
+void *mosquitto_realloc(void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+char *mosquitto_strdup(const char *s)
+{
+	return strdup(s);
+}
+
+void mosquitto_free(void *mem)
+{
+	free(mem);
+}
+
+void mosquitto_log_printf(int level, const char *fmt, ...)
+{
+	va_list va;
+
+	UNUSED(level);
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fputc('\n', stderr);
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data, void *userdata)
+{
+	UNUSED(identifier);
+	UNUSED(event);
+	UNUSED(cb_func);
+	UNUSED(event_data);
+	UNUSED(userdata);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data)
+{
+	UNUSED(identifier);
+	UNUSED(event);
+	UNUSED(cb_func);
+	UNUSED(event_data);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc != 3){
+		fprintf(stderr, "Usage: %s <tenant_map> <snapshot>\n", argv[0]);
+		return 1;
+	}
+	return tenantmap_compile(argv[1], argv[2]) ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant $SYS statistics.
+ *
+ * The counters are kept on each tenant registry entry by the rewrite
+ * callbacks. When plugin_opt_stats_interval is set to a number of seconds,
+ * they are published on the tick event as retained messages under
+ * $SYS/broker/tenants/<team>/..., using the same topic names as the broker's
+ * own $SYS tree. Publishing is off by default, in which case no tick callback
+ * is registered at all.
+ *
+ * The tenant entry goes when the tenant's last client disconnects, but its
+ * retained messages, queued messages and persistent sessions don't, and the
+ * counters shouldn't start again from 0 when it next connects. So when
+ * publishing is on, a freed tenant that has counted anything is parked by
+ * name, along with its usage records, until the tenant comes back, and is
+ * still published in the meantime. At most STATS_PARK_MAX tenants are parked
+ * and each for at most STATS_PARK_MAX_AGE seconds, after which its topics are
+ * cleared, so tenants that come and go can't fill the retained store.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define STATS_PARK_TABLE_SIZE 256
+#define STATS_PARK_MAX 1024
+#define STATS_PARK_MAX_AGE 3600
+
+/* The counters of a tenant with no entry */
+struct stats_park {
+	struct stats_park *next;
+	const struct retain_usage *retained;
+	struct queue_usage *queued;
+	const struct subs_usage *subs;
+	struct tenant_stats stats;
+	time_t publishes; /* left before it is dropped */
+	uint32_t hash;
+	size_t name_len;
+	char name[];
+};
+
+static time_t stats_interval = 0;
+static time_t stats_next = 0;
+static struct stats_park *park_table[STATS_PARK_TABLE_SIZE];
+static uint32_t park_count = 0;
+
+/* A NULL value clears the topic */
+static void stats_publish_value(const char *tenant, const char *name, const uint64_t *value)
+{
+	char topic[300];
+	char payload[30];
+	int len = 0;
+
+	snprintf(topic, sizeof(topic), "$SYS/broker/tenants/%s/%s", tenant, name);
+	if(value){
+		len = snprintf(payload, sizeof(payload), "%llu", (unsigned long long)*value);
+	}
+	mt_publish_copy(NULL, topic, len, payload, 0, true, NULL);
+}
+
+struct stats_value {
+	const char *name;
+	size_t offset;
+};
+
+static const struct stats_value stats_values[] = {
+	{"messages/received", offsetof(struct tenant_stats, messages_in)},
+	{"messages/sent", offsetof(struct tenant_stats, messages_out)},
+	{"bytes/received", offsetof(struct tenant_stats, bytes_in)},
+	{"bytes/sent", offsetof(struct tenant_stats, bytes_out)},
+	{"clients/connected", offsetof(struct tenant_stats, clients)},
+	{"rewrite/failures", offsetof(struct tenant_stats, rewrite_failures)},
+	{"messages/rate_limited", offsetof(struct tenant_stats, rate_limited)},
+	{"clients/rejected", offsetof(struct tenant_stats, connections_rejected)},
+	{"subscriptions/rejected", offsetof(struct tenant_stats, subscriptions_rejected)},
+	{"messages/payload_rejected", offsetof(struct tenant_stats, payload_rejected)},
+	{"retained/rejected", offsetof(struct tenant_stats, retained_rejected)},
+	{"messages/downsampled", offsetof(struct tenant_stats, downsampled)},
+	{"audit/dropped", offsetof(struct tenant_stats, audit_dropped)},
+	{"queued/dropped", offsetof(struct tenant_stats, queue_dropped)},
+	{"queued/rejected", offsetof(struct tenant_stats, queue_rejected)},
+	{"clients/evicted", offsetof(struct tenant_stats, evicted)},
+	{"tap/messages", offsetof(struct tenant_stats, tapped)},
+	{"tap/dropped", offsetof(struct tenant_stats, tap_dropped)},
+	{"messages/global_rejected", offsetof(struct tenant_stats, global_rejected)},
+};
+#define STATS_VALUE_COUNT (sizeof(stats_values)/sizeof(stats_values[0]))
+
+static uint64_t stats_value(const struct tenant *t, size_t i)
+{
+	return *(const uint64_t *)((const char *)&t->stats + stats_values[i].offset);
+}
+
+/* With stats NULL, the topics are cleared instead */
+static void stats_publish_values(const char *tenant, const struct tenant_stats *stats,
+		const struct retain_usage *retained, const struct queue_usage *queued, const struct subs_usage *subs)
+{
+	size_t i;
+
+	for(i=0; i<STATS_VALUE_COUNT; i++){
+		stats_publish_value(tenant, stats_values[i].name,
+				stats ? (const uint64_t *)((const char *)stats + stats_values[i].offset) : NULL);
+	}
+	if(subs){
+		stats_publish_value(tenant, "subscriptions/count", stats ? &subs->subscriptions : NULL);
+		stats_publish_value(tenant, "subscriptions/wildcard", stats ? &subs->wildcard_subscriptions : NULL);
+	}
+	if(retained){
+		stats_publish_value(tenant, "retained/count", stats ? &retained->count : NULL);
+		stats_publish_value(tenant, "retained/bytes", stats ? &retained->bytes : NULL);
+	}
+	if(queued){
+		stats_publish_value(tenant, "queued/count", stats ? &queued->msgs : NULL);
+		stats_publish_value(tenant, "queued/bytes", stats ? &queued->bytes : NULL);
+	}
+}
+
+static void stats_publish(struct tenant *t)
+{
+	stats_publish_values(t->name, &t->stats, t->retained, t->queued, t->subs);
+	latency_publish_tenant(t);
+}
+
+/* Whether a tenant has anything worth keeping */
+static bool stats_in_use(const struct tenant *t)
+{
+	size_t i;
+
+	for(i=0; i<STATS_VALUE_COUNT; i++){
+		if(stats_value(t, i)){
+			return true;
+		}
+	}
+	return (t->subs && t->subs->subscriptions)
+		|| (t->retained && t->retained->count)
+		|| (t->queued && t->queued->msgs);
+}
+
+void stats_tenant_park(const struct tenant *t)
+{
+	struct stats_park *p;
+	size_t slot = t->hash % STATS_PARK_TABLE_SIZE;
+
+	if(stats_interval == 0 || park_count >= STATS_PARK_MAX || !stats_in_use(t)){
+		return;
+	}
+	p = mosquitto_malloc(sizeof(struct stats_park) + t->name_len + 1);
+	if(p == NULL){
+		return;
+	}
+	memcpy(p->name, t->name, t->name_len + 1);
+	p->name_len = t->name_len;
+	p->hash = t->hash;
+	p->retained = t->retained;
+	p->queued = t->queued;
+	p->subs = t->subs;
+	p->stats = t->stats;
+	p->publishes = STATS_PARK_MAX_AGE / stats_interval + 1;
+	p->next = park_table[slot];
+	park_table[slot] = p;
+	park_count++;
+}
+
+void stats_tenant_restore(struct tenant *t)
+{
+	struct stats_park **prev, *p;
+
+	for(prev=&park_table[t->hash % STATS_PARK_TABLE_SIZE]; *prev; prev=&(*prev)->next){
+		p = *prev;
+		if(p->hash == t->hash && p->name_len == t->name_len && !memcmp(p->name, t->name, t->name_len)){
+			t->stats = p->stats;
+			if(t->queued == NULL){
+				/* Otherwise only set on the next publish */
+				t->queued = p->queued;
+			}
+			*prev = p->next;
+			mosquitto_free(p);
+			park_count--;
+			return;
+		}
+	}
+}
+
+void stats_format(const struct tenant *t, char *buf, size_t len)
+{
+	size_t i, n = 0;
+	int rc;
+
+	buf[0] = 0;
+	for(i=0; i<STATS_VALUE_COUNT && n<len; i++){
+		rc = snprintf(buf + n, len - n, "\n%s %llu", stats_values[i].name, (unsigned long long)stats_value(t, i));
+		if(rc < 0){
+			return;
+		}
+		n += (size_t)rc;
+	}
+	if(t->subs && n < len){
+		rc = snprintf(buf + n, len - n, "\nsubscriptions/count %llu\nsubscriptions/wildcard %llu",
+				(unsigned long long)t->subs->subscriptions, (unsigned long long)t->subs->wildcard_subscriptions);
+		if(rc < 0){
+			return;
+		}
+		n += (size_t)rc;
+	}
+	if(t->retained && n < len){
+		rc = snprintf(buf + n, len - n, "\nretained/count %llu\nretained/bytes %llu",
+				(unsigned long long)t->retained->count, (unsigned long long)t->retained->bytes);
+		if(rc < 0){
+			return;
+		}
+		n += (size_t)rc;
+	}
+	if(t->queued && n < len){
+		snprintf(buf + n, len - n, "\nqueued/count %llu\nqueued/bytes %llu",
+				(unsigned long long)t->queued->msgs, (unsigned long long)t->queued->bytes);
+	}
+}
+
+static int stats_tick_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_tick *ed = event_data;
+	struct stats_park **prev, *p;
+	uint32_t i;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->now_s < stats_next){
+		return MOSQ_ERR_SUCCESS;
+	}
+	stats_next = ed->now_s + stats_interval;
+
+	latency_publish();
+
+	for(i=0; i<tenant_id_max; i++){
+		if(tenant_by_id[i]){
+			stats_publish(tenant_by_id[i]);
+		}
+	}
+	for(i=0; i<STATS_PARK_TABLE_SIZE; i++){
+		prev = &park_table[i];
+		while(*prev){
+			p = *prev;
+			if(--p->publishes == 0){
+				stats_publish_values(p->name, NULL, p->retained, p->queued, p->subs);
+				*prev = p->next;
+				mosquitto_free(p);
+				park_count--;
+				continue;
+			}
+			stats_publish_values(p->name, &p->stats, p->retained, p->queued, p->subs);
+			prev = &p->next;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int stats_init(struct mosquitto_opt *opts, int opt_count)
+{
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "stats_interval")){
+			stats_interval = atoi(opts[i].value);
+			if(stats_interval < 0){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": stats_interval must be 0 or greater.");
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+
+	if(stats_interval > 0){
+		return mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, stats_tick_callback, NULL, NULL);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void stats_cleanup(void)
+{
+	struct stats_park *p, *next;
+	size_t i;
+
+	if(stats_interval > 0){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, stats_tick_callback, NULL);
+	}
+	for(i=0; i<STATS_PARK_TABLE_SIZE; i++){
+		for(p=park_table[i]; p; p=next){
+			next = p->next;
+			mosquitto_free(p);
+		}
+		park_table[i] = NULL;
+	}
+	park_count = 0;
+}
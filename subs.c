@@ -0,0 +1,503 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant subscription budget.
+ *
+ * Subscriptions belong to the session rather than the connection: a client
+ * with a persistent session keeps them in the broker after it disconnects,
+ * and gets them back when it reconnects. So the filters are kept in a session
+ * record keyed by the client id, which the plugin rewrote to <id>@<team> on
+ * connect, and the counts in a per-tenant record that, like retain_usage and
+ * queue_usage, lasts for the life of the plugin.
+ *
+ * Each session keeps its filters in an array sorted by hash, so that
+ * subscribing to the same filter again (which replaces the subscription in
+ * the broker) and unsubscribing from a filter that was never subscribed do
+ * not change the tenant's counts. The filters themselves are compared on a
+ * hash match, so two filters with the same hash are still counted apart. A session's filters are taken off the
+ * counts when the broker drops them: on disconnect if the session was not
+ * persisted, on a clean start reconnect, or when the persistence events say
+ * the session has been deleted or has expired.
+ *
+ * Sessions are only tracked, and the persistence events only registered,
+ * once some tenant has a subscription limit. Limits set at runtime count a
+ * client's session from its next connect.
+ *
+ * The limits are checked from the ACL subscribe check, which runs before the
+ * subscription is added, so that a refused filter gets a "not authorized"
+ * reason code in the SUBACK rather than the client being disconnected.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define SESSION_TABLE_MIN_SIZE 1024
+#define USAGE_TABLE_SIZE 256
+
+struct sub_entry {
+	char *filter;
+	uint32_t hash;
+	bool wildcard;
+};
+
+struct subs_session {
+	struct subs_session *next;
+	struct subs_usage *usage;
+	struct team_client *owner; /* the connected client, if any */
+	struct sub_entry *entries;
+	uint32_t count;
+	uint32_t alloc;
+	uint32_t wildcard_count;
+	uint32_t hash;
+	bool persistent; /* the broker keeps the session after disconnect */
+	char clientid[];
+};
+
+static struct subs_session **session_table = NULL;
+static size_t session_table_size = 0; /* always a power of two */
+static size_t session_count = 0;
+
+static struct subs_usage *usage_table[USAGE_TABLE_SIZE];
+static bool subs_registered = false;
+
+static bool filter_is_wildcard(const char *filter)
+{
+	return strpbrk(filter, "+#") != NULL;
+}
+
+static uint32_t filter_depth(const char *filter)
+{
+	uint32_t depth = 1;
+
+	if(!strncmp(filter, "$share/", 7)){
+		filter = strchr(filter + 7, '/');
+		if(filter == NULL){
+			return 0;
+		}
+		filter++;
+	}
+	for(; *filter; filter++){
+		if(*filter == '/'){
+			depth++;
+		}
+	}
+	return depth;
+}
+
+struct subs_usage *subs_usage_get(const char *name, size_t name_len)
+{
+	struct subs_usage *u;
+	uint32_t hash = mt_hash(name, name_len);
+
+	for(u=usage_table[hash % USAGE_TABLE_SIZE]; u; u=u->next){
+		if(u->hash == hash && u->name_len == name_len && !memcmp(u->name, name, name_len)){
+			return u;
+		}
+	}
+
+	u = mosquitto_calloc(1, sizeof(struct subs_usage) + name_len + 1);
+	if(u == NULL){
+		return NULL;
+	}
+	u->name = (char *)(u + 1);
+	memcpy(u->name, name, name_len);
+	u->name_len = name_len;
+	u->hash = hash;
+	u->next = usage_table[hash % USAGE_TABLE_SIZE];
+	usage_table[hash % USAGE_TABLE_SIZE] = u;
+	return u;
+}
+
+static int session_table_resize(size_t new_size)
+{
+	struct subs_session **new_table, *ss, *next;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct subs_session *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<session_table_size; i++){
+		for(ss=session_table[i]; ss; ss=next){
+			next = ss->next;
+			ss->next = new_table[ss->hash & (new_size-1)];
+			new_table[ss->hash & (new_size-1)] = ss;
+		}
+	}
+	mosquitto_free(session_table);
+	session_table = new_table;
+	session_table_size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct subs_session **session_find(const char *clientid)
+{
+	struct subs_session **prev;
+	uint32_t hash;
+
+	if(session_count == 0){
+		return NULL;
+	}
+	hash = mt_hash(clientid, strlen(clientid));
+	for(prev=&session_table[hash & (session_table_size-1)]; *prev; prev=&(*prev)->next){
+		if((*prev)->hash == hash && !strcmp((*prev)->clientid, clientid)){
+			return prev;
+		}
+	}
+	return NULL;
+}
+
+/* The broker has dropped the session's subscriptions */
+static void session_clear(struct subs_session *ss)
+{
+	uint32_t i;
+
+	for(i=0; i<ss->count; i++){
+		mosquitto_free(ss->entries[i].filter);
+	}
+	ss->usage->subscriptions -= ss->count;
+	ss->usage->wildcard_subscriptions -= ss->wildcard_count;
+	ss->count = 0;
+	ss->wildcard_count = 0;
+}
+
+static void session_remove(struct subs_session **prev)
+{
+	struct subs_session *ss = *prev;
+
+	session_clear(ss);
+	if(ss->owner){
+		ss->owner->session = NULL;
+	}
+	*prev = ss->next;
+	mosquitto_free(ss->entries);
+	mosquitto_free(ss);
+	session_count--;
+}
+
+void subs_client_attach(struct team_client *tc)
+{
+	struct subs_session **prev, *ss;
+	const char *clientid;
+	size_t len;
+	uint32_t hash;
+
+	tc->session = NULL;
+	if(tc->tenant->subs == NULL){
+		return;
+	}
+	clientid = mosquitto_client_id(tc->client);
+	prev = session_find(clientid);
+	if(prev){
+		ss = *prev;
+		if(ss->usage != tc->tenant->subs){
+			/* Only possible if the tenant map changed the team */
+			session_remove(prev);
+		}else{
+			if(ss->owner){
+				/* Taken over from a client that hasn't gone yet */
+				ss->owner->session = NULL;
+			}
+			if(mosquitto_client_clean_session(tc->client)){
+				session_clear(ss);
+				ss->persistent = false;
+			}
+			ss->owner = tc;
+			tc->session = ss;
+			return;
+		}
+	}
+
+	if(session_count >= session_table_size - session_table_size/4){
+		if(session_table_resize(session_table_size ? session_table_size*2 : SESSION_TABLE_MIN_SIZE)){
+			return;
+		}
+	}
+	len = strlen(clientid);
+	hash = mt_hash(clientid, len);
+	ss = mosquitto_calloc(1, sizeof(struct subs_session) + len + 1);
+	if(ss == NULL){
+		return;
+	}
+	memcpy(ss->clientid, clientid, len + 1);
+	ss->hash = hash;
+	ss->usage = tc->tenant->subs;
+	ss->owner = tc;
+	ss->next = session_table[hash & (session_table_size-1)];
+	session_table[hash & (session_table_size-1)] = ss;
+	session_count++;
+	tc->session = ss;
+}
+
+void subs_client_cleanup(struct team_client *tc)
+{
+	struct subs_session *ss = tc->session, **prev;
+
+	if(ss == NULL){
+		return;
+	}
+	tc->session = NULL;
+	ss->owner = NULL;
+	if(!ss->persistent){
+		prev = session_find(ss->clientid);
+		if(prev){
+			session_remove(prev);
+		}
+	}
+}
+
+/* Binary search for the filter. Returns true if found, and sets *pos to its
+ * index or to where it should be inserted. */
+static bool subs_find(const struct subs_session *ss, const char *filter, uint32_t hash, uint32_t *pos)
+{
+	uint32_t lo = 0, hi = ss->count, mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo)/2;
+		if(ss->entries[mid].hash < hash){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	*pos = lo;
+	for(; lo < ss->count && ss->entries[lo].hash == hash; lo++){
+		if(!strcmp(ss->entries[lo].filter, filter)){
+			*pos = lo;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool subs_allowed(const struct team_client *tc, const char *filter)
+{
+	const struct tenant_limits *l = tc->tenant->limits;
+	const struct subs_usage *u = tc->tenant->subs;
+	struct tenant_stats *stats = &tc->tenant->stats;
+	uint32_t pos;
+
+	if(!l->subs_enabled){
+		return true;
+	}
+	if(l->max_subscription_depth && filter_depth(filter) > l->max_subscription_depth){
+		stats->subscriptions_rejected++;
+		return false;
+	}
+	if(tc->session == NULL || u == NULL){
+		/* Not counted */
+		return true;
+	}
+	if(subs_find(tc->session, filter, mt_hash(filter, strlen(filter)), &pos)){
+		/* Replacing an existing subscription */
+		return true;
+	}
+	if(l->max_subscriptions && u->subscriptions >= l->max_subscriptions){
+		stats->subscriptions_rejected++;
+		return false;
+	}
+	if(l->max_wildcard_subscriptions && u->wildcard_subscriptions >= l->max_wildcard_subscriptions
+			&& filter_is_wildcard(filter)){
+
+		stats->subscriptions_rejected++;
+		return false;
+	}
+	return true;
+}
+
+int subs_add(struct team_client *tc, const char *filter)
+{
+	struct subs_session *ss = tc->session;
+	struct sub_entry *new_entries;
+	size_t len = strlen(filter);
+	uint32_t hash = mt_hash(filter, len);
+	uint32_t pos, new_alloc;
+	char *copy;
+
+	if(ss == NULL || subs_find(ss, filter, hash, &pos)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(ss->count == ss->alloc){
+		new_alloc = ss->alloc ? ss->alloc*2 : 4;
+		new_entries = mosquitto_realloc(ss->entries, new_alloc*sizeof(struct sub_entry));
+		if(new_entries == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		ss->entries = new_entries;
+		ss->alloc = new_alloc;
+	}
+	copy = mosquitto_malloc(len + 1);
+	if(copy == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(copy, filter, len + 1);
+	memmove(&ss->entries[pos+1], &ss->entries[pos], (ss->count - pos)*sizeof(struct sub_entry));
+	ss->entries[pos].filter = copy;
+	ss->entries[pos].hash = hash;
+	ss->entries[pos].wildcard = filter_is_wildcard(filter);
+	ss->count++;
+
+	ss->usage->subscriptions++;
+	if(ss->entries[pos].wildcard){
+		ss->wildcard_count++;
+		ss->usage->wildcard_subscriptions++;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void subs_remove(struct team_client *tc, const char *filter)
+{
+	struct subs_session *ss = tc->session;
+	uint32_t pos;
+
+	if(ss == NULL || !subs_find(ss, filter, mt_hash(filter, strlen(filter)), &pos)){
+		return;
+	}
+	mosquitto_free(ss->entries[pos].filter);
+	ss->usage->subscriptions--;
+	if(ss->entries[pos].wildcard){
+		ss->wildcard_count--;
+		ss->usage->wildcard_subscriptions--;
+	}
+	ss->count--;
+	memmove(&ss->entries[pos], &ss->entries[pos+1], (ss->count - pos)*sizeof(struct sub_entry));
+}
+
+/* A session is persisted if it has an expiry interval. The update event also
+ * comes when a client changes the interval as it disconnects. */
+static int subs_persist_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_persist_client *ed = event_data;
+	struct subs_session **prev;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->clientid == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	prev = session_find(ed->clientid);
+	if(prev){
+		(*prev)->persistent = ed->session_expiry_interval > 0;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The session has expired or been replaced, and its subscriptions with it */
+static int subs_persist_delete_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_persist_client *ed = event_data;
+	struct subs_session **prev;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	if(ed->clientid == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	prev = session_find(ed->clientid);
+	if(prev == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if((*prev)->owner){
+		/* Still connected, the broker carries on with an empty session */
+		session_clear(*prev);
+		(*prev)->persistent = false;
+	}else{
+		session_remove(prev);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static const struct {
+	int event;
+	MOSQ_FUNC_generic_callback cb;
+} subs_callbacks[] = {
+	{MOSQ_EVT_PERSIST_CLIENT_ADD, subs_persist_callback},
+	{MOSQ_EVT_PERSIST_CLIENT_UPDATE, subs_persist_callback},
+	{MOSQ_EVT_PERSIST_CLIENT_DELETE, subs_persist_delete_callback},
+};
+#define SUBS_CALLBACK_COUNT (sizeof(subs_callbacks)/sizeof(subs_callbacks[0]))
+
+int subs_limits_changed(void)
+{
+	size_t i;
+	int rc;
+
+	if(subs_registered || !limits_subscriptions_limited()){
+		return MOSQ_ERR_SUCCESS;
+	}
+	for(i=0; i<SUBS_CALLBACK_COUNT; i++){
+		rc = mosquitto_callback_register(mosq_pid, subs_callbacks[i].event, subs_callbacks[i].cb, NULL, NULL);
+		if(rc){
+			while(i > 0){
+				i--;
+				mosquitto_callback_unregister(mosq_pid, subs_callbacks[i].event, subs_callbacks[i].cb, NULL);
+			}
+			return rc;
+		}
+	}
+	subs_registered = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int subs_init(void)
+{
+	return subs_limits_changed();
+}
+
+void subs_cleanup(void)
+{
+	struct subs_session *ss, *next;
+	struct subs_usage *u, *u_next;
+	size_t i;
+	uint32_t j;
+
+	if(subs_registered){
+		for(i=0; i<SUBS_CALLBACK_COUNT; i++){
+			mosquitto_callback_unregister(mosq_pid, subs_callbacks[i].event, subs_callbacks[i].cb, NULL);
+		}
+		subs_registered = false;
+	}
+
+	for(i=0; i<session_table_size; i++){
+		for(ss=session_table[i]; ss; ss=next){
+			next = ss->next;
+			if(ss->owner){
+				ss->owner->session = NULL;
+			}
+			for(j=0; j<ss->count; j++){
+				mosquitto_free(ss->entries[j].filter);
+			}
+			mosquitto_free(ss->entries);
+			mosquitto_free(ss);
+		}
+	}
+	mosquitto_free(session_table);
+	session_table = NULL;
+	session_table_size = 0;
+	session_count = 0;
+
+	for(i=0; i<USAGE_TABLE_SIZE; i++){
+		for(u=usage_table[i]; u; u=u_next){
+			u_next = u->next;
+			mosquitto_free(u);
+		}
+		usage_table[i] = NULL;
+	}
+}
@@ -0,0 +1,481 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Per-tenant message tap.
+ *
+ * Publishes from tenants with tap_sample set are copied, one in every
+ * tap_sample, to plugin_opt_tap_sink so they can be fed to an analytics
+ * pipeline without a subscriber per tenant. The sink is one of:
+ *
+ *   udp://host:port   each datagram holds one or more whole frames
+ *   tcp://host:port
+ *   unix:/path        a unix stream socket
+ *
+ * Each message is one frame, all integers in network byte order:
+ *
+ *   uint32 length of the rest of the frame
+ *   uint64 time, ns since the epoch
+ *   uint8  qos
+ *   uint8  retain
+ *   uint16 tenant length
+ *   uint16 topic length
+ *   tenant, topic (without the tenant prefix), payload
+ *
+ * As with the audit log, the broker thread only copies the frame into a
+ * single producer, single consumer ring of plugin_opt_tap_buffer_size bytes,
+ * and the tap thread sends them on in batches. If the ring is full, or the
+ * frame could never be sent, the message is not tapped and counted in the
+ * tenant's tap/dropped stat. A stream sink that goes away is reconnected
+ * once a second, and the new connection picks up from the first frame of the
+ * batch that was not sent in full, so frames are never split and the ones
+ * already sent aren't sent twice; meanwhile the ring fills up. Connects and
+ * sends time out after TAP_SEND_TIMEOUT_MS so that a sink that stops reading
+ * can't hold up shutdown.
+ *
+ * The tap thread must not use mosquitto_malloc() and friends, as the
+ * broker's memory accounting is not thread safe.
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define TAP_DEFAULT_BUFFER (8*1024*1024)
+#define TAP_FRAME_HEADER 18 /* including the length */
+#define TAP_BATCH_BYTES 262144
+#define TAP_MAX_DATAGRAM 65507
+#define TAP_IDLE_NS 10000000L /* 10ms */
+#define TAP_RETRY_MS 1000
+#define TAP_SEND_TIMEOUT_MS 1000
+
+enum tap_sink_type {
+	TAP_SINK_UDP,
+	TAP_SINK_TCP,
+	TAP_SINK_UNIX,
+};
+
+static char *ring = NULL;
+static size_t ring_size = 0; /* always a power of two */
+static size_t ring_head = 0; /* written by the broker thread only */
+static size_t ring_tail = 0; /* written by the tap thread only */
+
+static enum tap_sink_type sink_type;
+static char *sink_host = NULL; /* or the path for unix sockets */
+static char *sink_port = NULL;
+
+static pthread_t tap_thread;
+static bool tap_running = false;
+static int tap_stop = 0;
+
+/* Tap thread state */
+static int sock = -1;
+static struct sockaddr_storage udp_addr;
+static socklen_t udp_addr_len = 0;
+static char *batch = NULL;
+static size_t batch_alloc = 0;
+static size_t batch_len = 0;
+static size_t batch_sent = 0; /* bytes of the batch sent on the current connection */
+
+
+static void put_be(uint8_t *p, uint64_t v, int bytes)
+{
+	int i;
+
+	for(i=bytes-1; i>=0; i--){
+		p[i] = (uint8_t)(v & 0xFF);
+		v >>= 8;
+	}
+}
+
+static void ring_put(size_t pos, const void *src, size_t len)
+{
+	size_t off = pos & (ring_size-1);
+	size_t first = len < ring_size - off ? len : ring_size - off;
+
+	memcpy(ring + off, src, first);
+	if(len > first){
+		memcpy(ring, (const char *)src + first, len - first);
+	}
+}
+
+static void ring_get(size_t pos, void *dst, size_t len)
+{
+	size_t off = pos & (ring_size-1);
+	size_t first = len < ring_size - off ? len : ring_size - off;
+
+	memcpy(dst, ring + off, first);
+	if(len > first){
+		memcpy((char *)dst + first, ring, len - first);
+	}
+}
+
+void tap_message(struct tenant *t, const struct mosquitto_evt_message *ed)
+{
+	uint8_t header[TAP_FRAME_HEADER];
+	struct timespec ts;
+	size_t topic_len, total, tail;
+
+	if(ring == NULL){
+		return;
+	}
+	if(++t->tap_count < t->limits->tap_sample){
+		return;
+	}
+	t->tap_count = 0;
+
+	topic_len = strlen(ed->topic);
+	total = TAP_FRAME_HEADER + t->name_len + topic_len + ed->payloadlen;
+	tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+	if(total > ring_size - (ring_head - tail)
+			|| t->name_len > UINT16_MAX || topic_len > UINT16_MAX
+			|| (sink_type == TAP_SINK_UDP && total > TAP_MAX_DATAGRAM)){
+
+		t->stats.tap_dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	put_be(header, total - 4, 4);
+	put_be(header + 4, (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec, 8);
+	header[12] = (uint8_t)ed->qos;
+	header[13] = ed->retain ? 1 : 0;
+	put_be(header + 14, t->name_len, 2);
+	put_be(header + 16, topic_len, 2);
+
+	ring_put(ring_head, header, sizeof(header));
+	ring_put(ring_head + sizeof(header), t->name, t->name_len);
+	ring_put(ring_head + sizeof(header) + t->name_len, ed->topic, topic_len);
+	if(ed->payloadlen){
+		ring_put(ring_head + sizeof(header) + t->name_len + topic_len, ed->payload, ed->payloadlen);
+	}
+	__atomic_store_n(&ring_head, ring_head + total, __ATOMIC_RELEASE);
+	t->stats.tapped++;
+}
+
+/* ================================================================
+ * Tap thread
+ * ================================================================ */
+
+static void sink_close(void)
+{
+	if(sock >= 0){
+		close(sock);
+		sock = -1;
+	}
+}
+
+/* Socket with connect() and send() timeouts, or -1 */
+static int sink_socket(int domain, int type, int protocol)
+{
+	struct timeval tv = {TAP_SEND_TIMEOUT_MS / 1000, (TAP_SEND_TIMEOUT_MS % 1000) * 1000};
+	int s;
+
+	s = socket(domain, type, protocol);
+	if(s >= 0 && setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static bool sink_open(void)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un addr;
+
+	if(sink_type == TAP_SINK_UNIX){
+		sock = sink_socket(AF_UNIX, SOCK_STREAM, 0);
+		if(sock < 0){
+			return false;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sink_host);
+		if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+			sink_close();
+			return false;
+		}
+		return true;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = sink_type == TAP_SINK_UDP ? SOCK_DGRAM : SOCK_STREAM;
+	if(getaddrinfo(sink_host, sink_port, &hints, &res)){
+		return false;
+	}
+	for(ai=res; ai; ai=ai->ai_next){
+		sock = sink_socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(sock < 0){
+			continue;
+		}
+		if(sink_type == TAP_SINK_UDP){
+			memcpy(&udp_addr, ai->ai_addr, ai->ai_addrlen);
+			udp_addr_len = ai->ai_addrlen;
+			break;
+		}
+		if(connect(sock, ai->ai_addr, ai->ai_addrlen) == 0){
+			break;
+		}
+		sink_close();
+	}
+	freeaddrinfo(res);
+	return sock >= 0;
+}
+
+/* Start of the frame in the batch that offset falls in */
+static size_t batch_frame_start(size_t offset)
+{
+	const uint8_t *p;
+	size_t pos = 0, total;
+
+	while(pos < batch_len){
+		p = (const uint8_t *)batch + pos;
+		total = 4 + (((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3]);
+		if(pos + total > offset){
+			break;
+		}
+		pos += total;
+	}
+	return pos;
+}
+
+/* Send the rest of the batch, true once all of it has gone */
+static bool sink_send(void)
+{
+	ssize_t n;
+
+	if(sock < 0){
+		if(!sink_open()){
+			return false;
+		}
+		/* The receiver throws away a frame cut off by the old connection */
+		batch_sent = batch_frame_start(batch_sent);
+	}
+	if(sink_type == TAP_SINK_UDP){
+		/* Nothing to retry with datagrams, a lost one is lost */
+		sendto(sock, batch, batch_len, 0, (struct sockaddr *)&udp_addr, udp_addr_len);
+		batch_sent = 0;
+		return true;
+	}
+	while(batch_sent < batch_len){
+		n = send(sock, batch + batch_sent, batch_len - batch_sent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			/* Timed out, the sink is slow but still there */
+			if(__atomic_load_n(&tap_stop, __ATOMIC_ACQUIRE)){
+				return false;
+			}
+			continue;
+		}
+		if(n <= 0){
+			sink_close();
+			return false;
+		}
+		batch_sent += (size_t)n;
+	}
+	batch_sent = 0;
+	return true;
+}
+
+/* Move whole frames from the ring into the batch, returns how many. */
+static size_t tap_fill(void)
+{
+	uint8_t lenbuf[4];
+	size_t head, tail, total, limit, count = 0;
+	char *new_batch;
+
+	limit = sink_type == TAP_SINK_UDP ? TAP_MAX_DATAGRAM : TAP_BATCH_BYTES;
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	tail = ring_tail;
+	while(tail != head){
+		ring_get(tail, lenbuf, sizeof(lenbuf));
+		total = 4 + (((size_t)lenbuf[0] << 24) | ((size_t)lenbuf[1] << 16) | ((size_t)lenbuf[2] << 8) | lenbuf[3]);
+		if(batch_len && batch_len + total > limit){
+			break;
+		}
+		if(batch_len + total > batch_alloc){
+			/* A frame bigger than a batch goes on its own */
+			new_batch = realloc(batch, batch_len + total);
+			if(new_batch == NULL){
+				break;
+			}
+			batch = new_batch;
+			batch_alloc = batch_len + total;
+		}
+		ring_get(tail, batch + batch_len, total);
+		batch_len += total;
+		tail += total;
+		count++;
+		/* Give the space back as soon as it has been copied */
+		__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+static void *tap_thread_main(void *arg)
+{
+	struct timespec idle = {0, TAP_IDLE_NS};
+	int waited;
+
+	UNUSED(arg);
+
+	while(!__atomic_load_n(&tap_stop, __ATOMIC_ACQUIRE)){
+		if(batch_len == 0 && tap_fill() == 0){
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		if(sink_send()){
+			batch_len = 0;
+			continue;
+		}
+		/* Sink is down, keep the batch and try again in a while */
+		for(waited=0; waited<TAP_RETRY_MS && !__atomic_load_n(&tap_stop, __ATOMIC_ACQUIRE); waited+=TAP_IDLE_NS/1000000L){
+			nanosleep(&idle, NULL);
+		}
+	}
+	/* One last go at whatever is left */
+	if(batch_len == 0){
+		tap_fill();
+	}
+	while(batch_len && sink_send()){
+		batch_len = 0;
+		tap_fill();
+	}
+	sink_close();
+	free(batch);
+	batch = NULL;
+	batch_alloc = 0;
+	batch_len = 0;
+	batch_sent = 0;
+	return NULL;
+}
+
+static int tap_parse_sink(const char *sink)
+{
+	const char *rest, *colon;
+	size_t len;
+
+	if(!strncmp(sink, "unix:", 5)){
+		sink_type = TAP_SINK_UNIX;
+		sink_host = mosquitto_strdup(sink + 5);
+		return sink_host ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NOMEM;
+	}else if(!strncmp(sink, "udp://", 6)){
+		sink_type = TAP_SINK_UDP;
+	}else if(!strncmp(sink, "tcp://", 6)){
+		sink_type = TAP_SINK_TCP;
+	}else{
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tap_sink must start with udp://, tcp:// or unix:, not '%s'.", sink);
+		return MOSQ_ERR_INVAL;
+	}
+
+	rest = sink + 6;
+	colon = strrchr(rest, ':');
+	if(colon == NULL || colon == rest || colon[1] == 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tap_sink '%s' needs a host and port.", sink);
+		return MOSQ_ERR_INVAL;
+	}
+	/* [::1]:port */
+	if(rest[0] == '[' && colon[-1] == ']'){
+		rest++;
+		len = (size_t)(colon - rest) - 1;
+	}else{
+		len = (size_t)(colon - rest);
+	}
+	sink_host = mosquitto_malloc(len + 1);
+	if(sink_host){
+		memcpy(sink_host, rest, len);
+		sink_host[len] = 0;
+	}
+	sink_port = mosquitto_strdup(colon + 1);
+	if(sink_host == NULL || sink_port == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int tap_init(struct mosquitto_opt *opts, int opt_count)
+{
+	const char *sink = NULL;
+	size_t buffer_size = TAP_DEFAULT_BUFFER, size;
+	int i, rc;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "tap_sink")){
+			sink = opts[i].value;
+		}else if(!strcasecmp(opts[i].key, "tap_buffer_size")){
+			buffer_size = strtoul(opts[i].value, NULL, 10);
+			if(buffer_size < 4096){
+				mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tap_buffer_size must be at least 4096.");
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+	if(sink == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = tap_parse_sink(sink);
+	if(rc){
+		return rc;
+	}
+
+	/* Round up to a power of two */
+	for(size=4096; size<buffer_size; size*=2){
+	}
+	ring = mosquitto_malloc(size);
+	if(ring == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	ring_size = size;
+	ring_head = 0;
+	ring_tail = 0;
+	tap_stop = 0;
+
+	if(pthread_create(&tap_thread, NULL, tap_thread_main, NULL)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to start tap thread.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	tap_running = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void tap_cleanup(void)
+{
+	if(tap_running){
+		__atomic_store_n(&tap_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(tap_thread, NULL);
+		tap_running = false;
+	}
+	mosquitto_free(ring);
+	ring = NULL;
+	ring_size = 0;
+	mosquitto_free(sink_host);
+	sink_host = NULL;
+	mosquitto_free(sink_port);
+	sink_port = NULL;
+}
@@ -0,0 +1,732 @@
+/*
+Copyright (c) 2024 Ben Hardill
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+*/
+
+/*
+ * Explicit username to tenant mapping.
+ *
+ * plugin_opt_tenant_map names a file of username to tenant mappings, one per
+ * line. A username ending in '*' maps every username starting with the rest
+ * of it:
+ *
+ *   # username  tenant
+ *   alice       foo
+ *   svc-bar-*   bar
+ *
+ * Exact matches win over prefixes, and longer prefixes win over shorter ones.
+ * Usernames that are not in the map fall through to the delimiter and regex.
+ *
+ * The map is read again when the broker reloads its config, or on the
+ * "reload map" control command. The new map is built in full before it
+ * replaces the old one, so a broken file leaves the old map in place.
+ * Connected clients keep the tenant they connected with.
+ *
+ * A big map can be compiled ahead of time into a snapshot with
+ * snapshot/mt_snapshot. The snapshot holds the finished hash table and the
+ * strings it points at, so it is mapped into memory and used as it is, with
+ * only a checksum and bounds check on load. Loading a new one is an mmap and
+ * a pointer swap. Snapshots are recognised by their magic number, so
+ * plugin_opt_tenant_map can name either kind of file.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mosquitto.h"
+#include "mosquitto_multi_tenant.h"
+
+#define MAP_TABLE_MIN_SIZE 1024
+
+struct map_entry {
+	struct map_entry *next;
+	const char *tenant;  /* points into key[] */
+	size_t key_len;
+	size_t tenant_len;
+	uint32_t hash;
+	bool prefix;
+	char key[];
+};
+
+/* Snapshot layout. Everything is in host byte order, offsets are from the
+ * start of the file. The entries are sorted by bucket, and bucket i holds
+ * entries buckets[i] to buckets[i+1]-1. */
+#define SNAPSHOT_MAGIC "MTMAP\0\r\n"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t file_size;
+	uint64_t checksum; /* snapshot_checksum() of everything after the header */
+	uint32_t bucket_count; /* always a power of two */
+	uint32_t entry_count;
+	uint32_t prefix_len_count;
+	uint32_t unused;
+	uint64_t buckets; /* uint32_t[bucket_count+1] */
+	uint64_t entries; /* struct snapshot_entry[entry_count] */
+	uint64_t prefix_lens; /* uint32_t[prefix_len_count], longest first */
+	uint64_t strings; /* NUL terminated keys and tenants */
+	uint64_t strings_size;
+};
+
+struct snapshot_entry {
+	uint32_t hash;
+	uint32_t key; /* offset into the strings */
+	uint32_t key_len;
+	uint32_t tenant;
+	uint32_t tenant_len;
+	uint32_t prefix;
+};
+
+struct tenant_map {
+	struct map_entry **table;
+	size_t size; /* always a power of two */
+	size_t count;
+	size_t *prefix_lens; /* distinct prefix lengths, longest first */
+	size_t prefix_len_count;
+	/* Set instead of table for a snapshot */
+	const struct snapshot_header *snap;
+	const uint32_t *snap_buckets;
+	const struct snapshot_entry *snap_entries;
+	const char *snap_strings;
+};
+
+static struct tenant_map *current_map = NULL;
+static char *map_path = NULL;
+
+static struct map_entry *map_find(const struct tenant_map *map, const char *key, size_t key_len, bool prefix)
+{
+	struct map_entry *e;
+	uint32_t hash = mt_hash(key, key_len);
+
+	for(e=map->table[hash & (map->size-1)]; e; e=e->next){
+		if(e->hash == hash && e->prefix == prefix && e->key_len == key_len && !memcmp(e->key, key, key_len)){
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static bool map_find_tenant(const struct tenant_map *map, const char *key, size_t key_len, bool prefix, const char **tenant, size_t *tenant_len)
+{
+	const struct snapshot_entry *se, *end;
+	const struct map_entry *e;
+	uint32_t hash, slot;
+
+	if(map->snap == NULL){
+		e = map_find(map, key, key_len, prefix);
+		if(e == NULL){
+			return false;
+		}
+		*tenant = e->tenant;
+		*tenant_len = e->tenant_len;
+		return true;
+	}
+
+	hash = mt_hash(key, key_len);
+	slot = hash & (map->snap->bucket_count-1);
+	end = &map->snap_entries[map->snap_buckets[slot+1]];
+	for(se=&map->snap_entries[map->snap_buckets[slot]]; se<end; se++){
+		if(se->hash == hash && se->prefix == prefix && se->key_len == key_len
+				&& !memcmp(map->snap_strings + se->key, key, key_len)){
+
+			*tenant = map->snap_strings + se->tenant;
+			*tenant_len = se->tenant_len;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int map_grow(struct tenant_map *map)
+{
+	struct map_entry **new_table, *e, *next;
+	size_t new_size = map->size*2;
+	size_t i;
+
+	new_table = mosquitto_calloc(new_size, sizeof(struct map_entry *));
+	if(new_table == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<map->size; i++){
+		for(e=map->table[i]; e; e=next){
+			next = e->next;
+			e->next = new_table[e->hash & (new_size-1)];
+			new_table[e->hash & (new_size-1)] = e;
+		}
+	}
+	mosquitto_free(map->table);
+	map->table = new_table;
+	map->size = new_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int map_prefix_len_add(struct tenant_map *map, size_t len)
+{
+	size_t *new_lens;
+	size_t i;
+
+	for(i=0; i<map->prefix_len_count; i++){
+		if(map->prefix_lens[i] == len){
+			return MOSQ_ERR_SUCCESS;
+		}
+		if(map->prefix_lens[i] < len){
+			break;
+		}
+	}
+	new_lens = mosquitto_realloc(map->prefix_lens, (map->prefix_len_count+1)*sizeof(size_t));
+	if(new_lens == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	memmove(&new_lens[i+1], &new_lens[i], (map->prefix_len_count-i)*sizeof(size_t));
+	new_lens[i] = len;
+	map->prefix_lens = new_lens;
+	map->prefix_len_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int map_add(struct tenant_map *map, const char *key, size_t key_len, bool prefix, const char *tenant, size_t tenant_len)
+{
+	struct map_entry *e;
+
+	if(map_find(map, key, key_len, prefix)){
+		return MOSQ_ERR_ALREADY_EXISTS;
+	}
+	if(map->count >= map->size - map->size/4){
+		if(map_grow(map)){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	if(prefix && map_prefix_len_add(map, key_len)){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	e = mosquitto_malloc(sizeof(struct map_entry) + key_len + 1 + tenant_len + 1);
+	if(e == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(e->key, key, key_len);
+	e->key[key_len] = 0;
+	memcpy(e->key + key_len + 1, tenant, tenant_len);
+	e->key[key_len + 1 + tenant_len] = 0;
+	e->tenant = e->key + key_len + 1;
+	e->key_len = key_len;
+	e->tenant_len = tenant_len;
+	e->prefix = prefix;
+	e->hash = mt_hash(key, key_len);
+
+	e->next = map->table[e->hash & (map->size-1)];
+	map->table[e->hash & (map->size-1)] = e;
+	map->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void map_free(struct tenant_map *map)
+{
+	struct map_entry *e, *next;
+	size_t i;
+
+	if(map == NULL){
+		return;
+	}
+	if(map->snap){
+		munmap((void *)map->snap, map->snap->file_size);
+	}
+	for(i=0; i<map->size; i++){
+		for(e=map->table[i]; e; e=next){
+			next = e->next;
+			mosquitto_free(e);
+		}
+	}
+	mosquitto_free(map->table);
+	mosquitto_free(map->prefix_lens);
+	mosquitto_free(map);
+}
+
+static char *strip(char *s)
+{
+	char *end;
+
+	while(*s == ' ' || *s == '\t'){
+		s++;
+	}
+	end = s + strlen(s);
+	while(end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')){
+		end--;
+	}
+	*end = 0;
+	return s;
+}
+
+static struct tenant_map *map_parse(const char *path)
+{
+	struct tenant_map *map;
+	FILE *fptr;
+	char buf[1024];
+	char *line, *key, *tenant;
+	size_t key_len, tenant_len;
+	bool prefix;
+	int lineno = 0;
+	int rc;
+
+	fptr = fopen(path, "rt");
+	if(fptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open tenant_map file '%s'.", path);
+		return NULL;
+	}
+
+	map = mosquitto_calloc(1, sizeof(struct tenant_map));
+	if(map == NULL){
+		fclose(fptr);
+		return NULL;
+	}
+	map->table = mosquitto_calloc(MAP_TABLE_MIN_SIZE, sizeof(struct map_entry *));
+	if(map->table == NULL){
+		goto error;
+	}
+	map->size = MAP_TABLE_MIN_SIZE;
+
+	while(fgets(buf, sizeof(buf), fptr)){
+		lineno++;
+		line = strip(buf);
+		if(line[0] == 0 || line[0] == '#'){
+			continue;
+		}
+
+		key = line;
+		tenant = key + strcspn(key, " \t");
+		if(*tenant){
+			*tenant = 0;
+			tenant = strip(tenant + 1);
+		}
+		tenant_len = strlen(tenant);
+		if(tenant_len == 0 || tenant[strcspn(tenant, " \t/+#$")]){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Missing or invalid tenant for '%s'.", path, lineno, key);
+			goto error;
+		}
+
+		key_len = strlen(key);
+		prefix = (key[key_len-1] == '*');
+		if(prefix){
+			key_len--;
+		}
+		if(key_len == 0){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Empty username prefix.", path, lineno);
+			goto error;
+		}
+
+		rc = map_add(map, key, key_len, prefix, tenant, tenant_len);
+		if(rc == MOSQ_ERR_ALREADY_EXISTS){
+			mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": %s:%d: Duplicate entry for '%s'.", path, lineno, key);
+			goto error;
+		}else if(rc){
+			goto error;
+		}
+	}
+	fclose(fptr);
+	mosquitto_log_printf(MOSQ_LOG_INFO, PLUGIN_NAME ": Loaded %zu tenant_map entries from '%s'.", map->count, path);
+
+	return map;
+error:
+	fclose(fptr);
+	map_free(map);
+	return NULL;
+}
+
+/* FNV-1a style, but a word at a time over four independent lanes, which
+ * is several times quicker than mt_hash() over a file of a few MB. len is
+ * always a multiple of 8. */
+static uint64_t snapshot_checksum(const char *data, size_t len)
+{
+	uint64_t lane[4] = {
+		0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+		0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL,
+	};
+	uint64_t w;
+	size_t i;
+
+	for(i=0; i+32<=len; i+=32){
+		memcpy(&w, data + i, 8); lane[0] = (lane[0] ^ w) * 0x100000001b3ULL;
+		memcpy(&w, data + i + 8, 8); lane[1] = (lane[1] ^ w) * 0x100000001b3ULL;
+		memcpy(&w, data + i + 16, 8); lane[2] = (lane[2] ^ w) * 0x100000001b3ULL;
+		memcpy(&w, data + i + 24, 8); lane[3] = (lane[3] ^ w) * 0x100000001b3ULL;
+	}
+	for(; i+8<=len; i+=8){
+		memcpy(&w, data + i, 8); lane[0] = (lane[0] ^ w) * 0x100000001b3ULL;
+	}
+	for(i=1; i<4; i++){
+		lane[0] = (lane[0] ^ (lane[i] >> 29) ^ lane[i]) * 0x100000001b3ULL;
+	}
+	return lane[0];
+}
+
+/* True if count items of size bytes at off fit in the file, aligned for the
+ * item type. */
+static bool section_ok(uint64_t off, uint64_t count, uint64_t size, uint64_t file_size)
+{
+	return off >= sizeof(struct snapshot_header) && off % (size < 8 ? size : 8) == 0
+		&& off <= file_size && count <= (file_size - off) / size;
+}
+
+static bool snapshot_valid(const struct snapshot_header *h, uint64_t file_size)
+{
+	const uint32_t *buckets;
+	const struct snapshot_entry *e;
+	const char *strings;
+	uint32_t i;
+
+	if(h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER){
+		return false;
+	}
+	if(h->file_size != file_size || h->bucket_count == 0 || (h->bucket_count & (h->bucket_count-1))){
+		return false;
+	}
+	if(!section_ok(h->buckets, (uint64_t)h->bucket_count+1, sizeof(uint32_t), file_size)
+			|| !section_ok(h->entries, h->entry_count, sizeof(struct snapshot_entry), file_size)
+			|| !section_ok(h->prefix_lens, h->prefix_len_count, sizeof(uint32_t), file_size)
+			|| !section_ok(h->strings, h->strings_size, 1, file_size)
+			|| h->strings_size > UINT32_MAX){
+
+		return false;
+	}
+	if(file_size % 8 || snapshot_checksum((const char *)(h + 1), file_size - sizeof(struct snapshot_header)) != h->checksum){
+		return false;
+	}
+
+	/* The checksum catches damage, this catches a bad compiler */
+	buckets = (const uint32_t *)((const char *)h + h->buckets);
+	for(i=0; i<h->bucket_count; i++){
+		if(buckets[i] > buckets[i+1]){
+			return false;
+		}
+	}
+	if(buckets[0] != 0 || buckets[h->bucket_count] != h->entry_count){
+		return false;
+	}
+	e = (const struct snapshot_entry *)((const char *)h + h->entries);
+	strings = (const char *)h + h->strings;
+	for(i=0; i<h->entry_count; i++){
+		if((uint64_t)e[i].key + e[i].key_len >= h->strings_size
+				|| (uint64_t)e[i].tenant + e[i].tenant_len >= h->strings_size
+				|| strings[e[i].tenant + e[i].tenant_len] != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct tenant_map *map_mmap(const char *path, int fd)
+{
+	struct tenant_map *map;
+	struct stat st;
+	const struct snapshot_header *h;
+	const uint32_t *prefix_lens;
+	void *mem;
+	uint32_t i;
+
+	if(fstat(fd, &st) || (uint64_t)st.st_size < sizeof(struct snapshot_header)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tenant_map snapshot '%s' is truncated.", path);
+		return NULL;
+	}
+	mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(mem == MAP_FAILED){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to map tenant_map snapshot '%s'.", path);
+		return NULL;
+	}
+	h = mem;
+	if(!snapshot_valid(h, (uint64_t)st.st_size)){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": tenant_map snapshot '%s' is damaged or from another version.", path);
+		munmap(mem, (size_t)st.st_size);
+		return NULL;
+	}
+
+	map = mosquitto_calloc(1, sizeof(struct tenant_map));
+	if(map == NULL){
+		munmap(mem, (size_t)st.st_size);
+		return NULL;
+	}
+	map->snap = h;
+	if(h->prefix_len_count){
+		map->prefix_lens = mosquitto_malloc(h->prefix_len_count*sizeof(size_t));
+		if(map->prefix_lens == NULL){
+			map_free(map);
+			return NULL;
+		}
+		prefix_lens = (const uint32_t *)((const char *)h + h->prefix_lens);
+		for(i=0; i<h->prefix_len_count; i++){
+			map->prefix_lens[i] = prefix_lens[i];
+		}
+		map->prefix_len_count = h->prefix_len_count;
+	}
+	map->snap_buckets = (const uint32_t *)((const char *)h + h->buckets);
+	map->snap_entries = (const struct snapshot_entry *)((const char *)h + h->entries);
+	map->snap_strings = (const char *)h + h->strings;
+	map->count = h->entry_count;
+
+	mosquitto_log_printf(MOSQ_LOG_INFO, PLUGIN_NAME ": Mapped %zu tenant_map entries from '%s'.", map->count, path);
+	return map;
+}
+
+static struct tenant_map *map_load(const char *path)
+{
+	struct tenant_map *map;
+	char magic[8];
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to open tenant_map file '%s'.", path);
+		return NULL;
+	}
+	if(read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic))){
+		map = map_mmap(path, fd);
+	}else{
+		map = map_parse(path);
+	}
+	close(fd);
+	return map;
+}
+
+/* Compile a text map into a snapshot. The snapshot is written next to out
+ * and renamed over it, so a broker that has the old one mapped keeps a
+ * complete file. */
+int tenantmap_compile(const char *in, const char *out)
+{
+	struct tenant_map *map;
+	struct snapshot_header *h;
+	struct snapshot_entry *entries, *se;
+	struct map_entry *e;
+	uint32_t *buckets, *prefix_lens, *fill = NULL;
+	uint32_t bucket_count = 16, i, n;
+	uint64_t strings_size = 0, file_size;
+	char *file = NULL, *strings, *tmp = NULL;
+	FILE *fptr;
+	int rc = MOSQ_ERR_NOMEM;
+
+	map = map_parse(in);
+	if(map == NULL){
+		return MOSQ_ERR_INVAL;
+	}
+	while(bucket_count - bucket_count/4 < map->count){
+		bucket_count *= 2;
+	}
+	for(i=0; i<map->size; i++){
+		for(e=map->table[i]; e; e=e->next){
+			strings_size += e->key_len + 1 + e->tenant_len + 1;
+		}
+	}
+	if(strings_size > UINT32_MAX){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": '%s' is too big for a snapshot.", in);
+		rc = MOSQ_ERR_INVAL;
+		goto done;
+	}
+
+	/* Build the whole file in memory. The strings are padded out so that the
+	 * checksum only has to deal with whole words, see snapshot_checksum(). */
+	file_size = sizeof(struct snapshot_header);
+	file_size += (((uint64_t)bucket_count+1)*sizeof(uint32_t) + 7) & ~(uint64_t)7;
+	file_size += map->count*sizeof(struct snapshot_entry);
+	file_size += map->prefix_len_count*sizeof(uint32_t);
+	file_size += (strings_size + 7) & ~(uint64_t)7;
+	file = mosquitto_calloc(1, (size_t)file_size);
+	fill = mosquitto_calloc(bucket_count, sizeof(uint32_t));
+	tmp = mosquitto_malloc(strlen(out) + 5);
+	if(file == NULL || fill == NULL || tmp == NULL){
+		goto done;
+	}
+
+	h = (struct snapshot_header *)file;
+	memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+	h->version = SNAPSHOT_VERSION;
+	h->byte_order = SNAPSHOT_BYTE_ORDER;
+	h->file_size = file_size;
+	h->bucket_count = bucket_count;
+	h->entry_count = (uint32_t)map->count;
+	h->prefix_len_count = (uint32_t)map->prefix_len_count;
+	h->buckets = sizeof(struct snapshot_header);
+	h->entries = (h->buckets + ((uint64_t)bucket_count+1)*sizeof(uint32_t) + 7) & ~(uint64_t)7;
+	h->prefix_lens = h->entries + map->count*sizeof(struct snapshot_entry);
+	h->strings = h->prefix_lens + map->prefix_len_count*sizeof(uint32_t);
+	h->strings_size = strings_size;
+	buckets = (uint32_t *)(file + h->buckets);
+	entries = (struct snapshot_entry *)(file + h->entries);
+	prefix_lens = (uint32_t *)(file + h->prefix_lens);
+	strings = file + h->strings;
+
+	/* Count the entries in each bucket, then place them */
+	for(i=0; i<map->size; i++){
+		for(e=map->table[i]; e; e=e->next){
+			buckets[(e->hash & (bucket_count-1)) + 1]++;
+		}
+	}
+	for(i=0; i<bucket_count; i++){
+		buckets[i+1] += buckets[i];
+	}
+	strings_size = 0;
+	for(i=0; i<map->size; i++){
+		for(e=map->table[i]; e; e=e->next){
+			n = e->hash & (bucket_count-1);
+			se = &entries[buckets[n] + fill[n]];
+			fill[n]++;
+			se->hash = e->hash;
+			se->key = (uint32_t)strings_size;
+			se->key_len = (uint32_t)e->key_len;
+			se->tenant = (uint32_t)(strings_size + e->key_len + 1);
+			se->tenant_len = (uint32_t)e->tenant_len;
+			se->prefix = e->prefix;
+			/* key[] holds the key and the tenant, both NUL terminated */
+			memcpy(strings + strings_size, e->key, e->key_len + 1 + e->tenant_len + 1);
+			strings_size += e->key_len + 1 + e->tenant_len + 1;
+		}
+	}
+	for(i=0; i<map->prefix_len_count; i++){
+		prefix_lens[i] = (uint32_t)map->prefix_lens[i];
+	}
+	h->checksum = snapshot_checksum(file + sizeof(struct snapshot_header), file_size - sizeof(struct snapshot_header));
+
+	sprintf(tmp, "%s.tmp", out);
+	fptr = fopen(tmp, "wb");
+	if(fptr == NULL){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to write '%s'.", tmp);
+		rc = MOSQ_ERR_ERRNO;
+		goto done;
+	}
+	rc = fwrite(file, 1, (size_t)file_size, fptr) == file_size ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO;
+	if(fclose(fptr) && !rc){
+		rc = MOSQ_ERR_ERRNO;
+	}
+	if(!rc && rename(tmp, out)){
+		rc = MOSQ_ERR_ERRNO;
+	}
+	if(rc){
+		mosquitto_log_printf(MOSQ_LOG_ERR, PLUGIN_NAME ": Unable to write '%s'.", out);
+		unlink(tmp);
+	}else{
+		mosquitto_log_printf(MOSQ_LOG_INFO, PLUGIN_NAME ": Wrote %zu entries to '%s'.", map->count, out);
+	}
+
+done:
+	mosquitto_free(tmp);
+	mosquitto_free(fill);
+	mosquitto_free(file);
+	map_free(map);
+	return rc;
+}
+
+bool tenantmap_lookup(const char *username, const char **team, size_t *team_len)
+{
+	const struct tenant_map *map = current_map;
+	size_t len, i;
+
+	if(map == NULL){
+		return false;
+	}
+
+	len = strlen(username);
+	if(map_find_tenant(map, username, len, false, team, team_len)){
+		return true;
+	}
+	for(i=0; i<map->prefix_len_count; i++){
+		if(map->prefix_lens[i] <= len && map_find_tenant(map, username, map->prefix_lens[i], true, team, team_len)){
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Read the map file again. If it can't be loaded the old map is kept and
+ * MOSQ_ERR_INVAL returned. */
+int tenantmap_reload(void)
+{
+	struct tenant_map *map, *old_map;
+
+	if(map_path == NULL){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+	map = map_load(map_path);
+	if(map == NULL){
+		mosquitto_log_printf(MOSQ_LOG_WARNING, PLUGIN_NAME ": Keeping the previous tenant_map.");
+		return MOSQ_ERR_INVAL;
+	}
+	old_map = current_map;
+	current_map = map;
+	map_free(old_map);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int tenantmap_reload_callback(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_reload *ed = event_data;
+	char *path;
+	int i;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	for(i=0; i<ed->option_count; i++){
+		if(!strcasecmp(ed->options[i].key, "tenant_map") && strcmp(ed->options[i].value, map_path)){
+			path = mosquitto_strdup(ed->options[i].value);
+			if(path == NULL){
+				return MOSQ_ERR_NOMEM;
+			}
+			mosquitto_free(map_path);
+			map_path = path;
+		}
+	}
+
+	tenantmap_reload();
+	return MOSQ_ERR_SUCCESS;
+}
+
+int tenantmap_init(struct mosquitto_opt *opts, int opt_count)
+{
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcasecmp(opts[i].key, "tenant_map")){
+			mosquitto_free(map_path);
+			map_path = mosquitto_strdup(opts[i].value);
+			if(map_path == NULL){
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+	if(map_path == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	current_map = map_load(map_path);
+	if(current_map == NULL){
+		return MOSQ_ERR_INVAL;
+	}
+	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_RELOAD, tenantmap_reload_callback, NULL, NULL);
+}
+
+void tenantmap_cleanup(void)
+{
+	if(map_path){
+		mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_RELOAD, tenantmap_reload_callback, NULL);
+	}
+	map_free(current_map);
+	current_map = NULL;
+	mosquitto_free(map_path);
+	map_path = NULL;
+}
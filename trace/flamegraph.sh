@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Per-tenant flame graphs from the plugin's USDT probes.
+#
+# Runs trace/tenant_latency.bt or trace/tenant_throughput.bt with bpftrace for
+# a number of seconds, folds the stacks with the tenant as the root frame and
+# renders them with flamegraph.pl from https://github.com/brendangregg/FlameGraph
+#
+#   make WITH_USDT=yes
+#   sudo ./trace/flamegraph.sh latency 30 > latency.svg
+#   sudo ./trace/flamegraph.sh throughput 30 > throughput.svg
+#
+# PLUGIN is the plugin the broker has loaded, FLAMEGRAPH is flamegraph.pl.
+# Without flamegraph.pl the folded stacks are written out instead.
+
+set -e
+
+MODE=${1:-latency}
+DURATION=${2:-10}
+PLUGIN=${PLUGIN:-$(pwd)/mosquitto_multi_tenant.so}
+FLAMEGRAPH=${FLAMEGRAPH:-$(command -v flamegraph.pl || true)}
+DIR=$(dirname "$0")
+
+case "${MODE}" in
+	latency) SCRIPT=${DIR}/tenant_latency.bt; UNITS=ns ;;
+	throughput) SCRIPT=${DIR}/tenant_throughput.bt; UNITS=messages ;;
+	*) echo "Usage: $0 latency|throughput [seconds]" >&2; exit 1 ;;
+esac
+
+if ! readelf -n "${PLUGIN}" 2>/dev/null | grep -q multi_tenant; then
+	echo "${PLUGIN} has no probes, build it with make WITH_USDT=yes" >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "${TMP}"' EXIT
+
+sed "s|@PLUGIN@|${PLUGIN}|g" "${SCRIPT}" > "${TMP}/trace.bt"
+echo "Tracing for ${DURATION}s..." >&2
+timeout -s INT "${DURATION}" bpftrace "${TMP}/trace.bt" > "${TMP}/raw" || true
+
+# bpftrace prints each entry as
+#   @map[tenant,
+#       frame+offset
+#       ...
+#   ]: value
+# with the innermost frame first. Fold it to "tenant;outer;...;inner value".
+awk '
+/^@[a-z_]+\[/ {
+	tenant = $0
+	sub(/^@[a-z_]+\[/, "", tenant)
+	sub(/, *$/, "", tenant)
+	n = 0
+	next
+}
+/^\]: / {
+	line = tenant
+	for(i=n; i>0; i--){
+		line = line ";" frames[i]
+	}
+	print line, $2
+	tenant = ""
+	next
+}
+tenant != "" {
+	frame = $1
+	sub(/\+[0-9]+$/, "", frame)
+	if(frame != ""){
+		frames[++n] = frame
+	}
+}
+' "${TMP}/raw" > "${TMP}/folded"
+
+if [ -n "${FLAMEGRAPH}" ]; then
+	"${FLAMEGRAPH}" --title "Per-tenant ${MODE}" --countname "${UNITS}" "${TMP}/folded"
+else
+	cat "${TMP}/folded"
+fi